@@ -3,78 +3,208 @@
 #include <mlx/ops.h>
 #include <mlx/nn/attention.h>
 #include <cmath>
+#include <stdexcept>
+#include <utility>
+
+#include "decode_attention.h"
 
 namespace mlx_transformer {
 
 AttentionImplementation::AttentionImplementation(
     int64_t hidden_size,
     int64_t num_heads,
-    float dropout_prob)
+    float dropout_prob,
+    float rope_theta,
+    const KVCacheOptions& kv_options)
     : hidden_size_(hidden_size),
       num_heads_(num_heads),
       head_dim_(hidden_size / num_heads),
       dropout_prob_(dropout_prob),
-      scale_(1.0f / std::sqrt(static_cast<float>(head_dim_))) {
-    
-    // Initialize query, key, value, and output projection weights
-    // These would normally be loaded from the model
-    query_weight_ = mlx::core::zeros({hidden_size_, hidden_size_}, mlx::core::float32);
-    key_weight_ = mlx::core::zeros({hidden_size_, hidden_size_}, mlx::core::float32);
-    value_weight_ = mlx::core::zeros({hidden_size_, hidden_size_}, mlx::core::float32);
-    output_weight_ = mlx::core::zeros({hidden_size_, hidden_size_}, mlx::core::float32);
+      scale_(1.0f / std::sqrt(static_cast<float>(head_dim_))),
+      rotary_(head_dim_, rope_theta),
+      kv_cache_(kv_options) {
+    // Query, key, value, and output projection weights are bound directly to
+    // the loaded tensors in loadWeights; no placeholders are allocated
 }
 
 void AttentionImplementation::loadWeights(ModelLoader& loader, const std::string& prefix) {
-    query_weight_ = loader.loadWeight(prefix + ".wq.weight");
-    key_weight_ = loader.loadWeight(prefix + ".wk.weight");
-    value_weight_ = loader.loadWeight(prefix + ".wv.weight");
-    output_weight_ = loader.loadWeight(prefix + ".wo.weight");
+    qkv_weight_ = loader.loadLinear(
+        prefix + ".wqkv",
+        {prefix + ".wq.weight", prefix + ".wk.weight", prefix + ".wv.weight"});
+    output_weight_ = loader.loadLinear(prefix + ".wo", {prefix + ".wo.weight"});
 }
 
 mlx::core::array AttentionImplementation::forward(
     const mlx::core::array& hidden_states,
     const mlx::core::array& attention_mask,
-    const std::pair<mlx::core::array, mlx::core::array>& kv_cache) {
+    bool use_cache) {
     
     auto batch_size = hidden_states.shape()[0];
     auto seq_length = hidden_states.shape()[1];
     
-    // Project hidden states to query, key, value
-    auto query = mlx::core::matmul(hidden_states, query_weight_);
-    auto key = mlx::core::matmul(hidden_states, key_weight_);
-    auto value = mlx::core::matmul(hidden_states, value_weight_);
+    // Project hidden states to query, key, value with the fused projection
+    auto qkv = mlx::core::split(linear(hidden_states, qkv_weight_), 3, -1);
+    auto query = qkv[0];
+    auto key = qkv[1];
+    auto value = qkv[2];
     
-    // Reshape for multi-head attention
-    query = mlx::core::reshape(query, {batch_size, seq_length, num_heads_, head_dim_});
-    key = mlx::core::reshape(key, {batch_size, seq_length, num_heads_, head_dim_});
-    value = mlx::core::reshape(value, {batch_size, seq_length, num_heads_, head_dim_});
+    // Reshape for multi-head attention: [batch, heads, seq, head_dim]
+    query = mlx::core::transpose(mlx::core::reshape(query, {batch_size, seq_length, num_heads_, head_dim_}), {0, 2, 1, 3});
+    key = mlx::core::transpose(mlx::core::reshape(key, {batch_size, seq_length, num_heads_, head_dim_}), {0, 2, 1, 3});
+    value = mlx::core::transpose(mlx::core::reshape(value, {batch_size, seq_length, num_heads_, head_dim_}), {0, 2, 1, 3});
     
-    // Use MLX's built-in attention mechanism for now
-    // In a real implementation, we would use a custom optimized version
-    auto attn_output = mlx::nn::scaled_dot_product_attention(
-        query, key, value, attention_mask, dropout_prob_);
+    // New tokens continue at the absolute position reached by the cache
+    int64_t offset = use_cache ? kv_cache_.tokensSeen() : 0;
+    query = rotary_.apply(query, offset);
+    key = rotary_.apply(key, offset);
+    
+    mlx::core::array attn_output;
+    if (use_cache && kv_cache_.shared()) {
+        if (attention_mask.size() != 0) {
+            throw std::invalid_argument("Shared-prefix KV caches do not take a padding mask");
+        }
+        kv_cache_.append(key, value, rotary_);
+        attn_output = sharedPrefixAttention(query);
+    } else {
+        if (use_cache) {
+            kv_cache_.append(key, value, rotary_);
+            key = kv_cache_.keys();
+            value = kv_cache_.values();
+        }
+        
+        if (use_cache && seq_length == 1 && dropout_prob_ == 0.0f && decodeAttentionAvailable()) {
+            // Decode step: one query against the whole cache, streamed in
+            // tiles without materializing the score row
+            attn_output = decodeAttention(query, key, value, scale_, attention_mask);
+        } else {
+            // MLX's built-in attention accumulates the softmax in float32
+            // for half-precision inputs
+            attn_output = mlx::nn::scaled_dot_product_attention(
+                query, key, value, attention_mask, dropout_prob_);
+        }
+    }
     
     // Reshape back and project to output dimension
+    attn_output = mlx::core::transpose(attn_output, {0, 2, 1, 3});
     attn_output = mlx::core::reshape(attn_output, {batch_size, seq_length, hidden_size_});
-    attn_output = mlx::core::matmul(attn_output, output_weight_);
+    attn_output = linear(attn_output, output_weight_);
+    
+    if (use_cache) {
+        // A prefill longer than the window leaves the cache over capacity
+        kv_cache_.trim(rotary_);
+    }
     
     return attn_output;
 }
 
+mlx::core::array AttentionImplementation::sharedPrefixAttention(const mlx::core::array& query) {
+    const auto& prefix_keys = kv_cache_.prefixKeys();
+    const auto& prefix_values = kv_cache_.prefixValues();
+    
+    int batch_size = query.shape()[0];
+    int seq_length = query.shape()[2];
+    int suffix_length = static_cast<int>(kv_cache_.suffixLength());
+    auto dtype = query.dtype();
+    auto scaled = mlx::core::multiply(query, mlx::core::astype(mlx::core::array(scale_), dtype));
+    
+    // The [1, heads, prefix, head_dim] prefix broadcasts over the batch inside
+    // matmul, so it is read once per step and never copied per row. Its
+    // scores start the running max, sum and output of the softmax.
+    auto scores = mlx::core::astype(
+        mlx::core::matmul(scaled, mlx::core::transpose(prefix_keys, {0, 1, 3, 2})),
+        mlx::core::float32);
+    auto running_max = mlx::core::max(scores, -1, true);
+    auto weights = mlx::core::exp(mlx::core::subtract(scores, running_max));
+    auto running_sum = mlx::core::sum(weights, -1, true);
+    auto output = mlx::core::astype(
+        mlx::core::matmul(mlx::core::astype(weights, dtype), prefix_values),
+        mlx::core::float32);
+    
+    // Suffix blocks are read where they are. A row may share its blocks with
+    // other rows, so each row gets its own small matmuls; only the
+    // query-sized results are joined across rows.
+    auto queries = mlx::core::split(scaled, batch_size, 0);
+    int block_start = 0;
+    for (int64_t block = 0; block < kv_cache_.suffixBlocks(); block++) {
+        std::vector<mlx::core::array> row_scores;
+        for (int row = 0; row < batch_size; row++) {
+            row_scores.push_back(mlx::core::matmul(
+                queries[row],
+                mlx::core::transpose(kv_cache_.suffixBlockKeys(row, block), {0, 1, 3, 2})));
+        }
+        auto block_scores = mlx::core::astype(mlx::core::concatenate(row_scores, 0), mlx::core::float32);
+        int block_length = block_scores.shape()[3];
+        
+        // The new tokens are the last seq_length suffix positions; each sees
+        // the whole prefix and the suffix up to itself
+        if (seq_length > 1) {
+            auto rows = mlx::core::reshape(
+                mlx::core::arange(suffix_length - seq_length, suffix_length), {seq_length, 1});
+            auto cols = mlx::core::reshape(
+                mlx::core::arange(block_start, block_start + block_length), {1, block_length});
+            block_scores = mlx::core::where(
+                mlx::core::less_equal(cols, rows), block_scores, mlx::core::array(-1e9f));
+        }
+        
+        // Rescale what was accumulated so far to the new running max
+        auto block_max = mlx::core::maximum(running_max, mlx::core::max(block_scores, -1, true));
+        auto correction = mlx::core::exp(mlx::core::subtract(running_max, block_max));
+        weights = mlx::core::exp(mlx::core::subtract(block_scores, block_max));
+        running_sum = mlx::core::add(
+            mlx::core::multiply(running_sum, correction),
+            mlx::core::sum(weights, -1, true));
+        running_max = block_max;
+        
+        auto row_weights = mlx::core::split(mlx::core::astype(weights, dtype), batch_size, 0);
+        std::vector<mlx::core::array> row_outputs;
+        for (int row = 0; row < batch_size; row++) {
+            row_outputs.push_back(mlx::core::matmul(row_weights[row], kv_cache_.suffixBlockValues(row, block)));
+        }
+        output = mlx::core::add(
+            mlx::core::multiply(output, correction),
+            mlx::core::astype(mlx::core::concatenate(row_outputs, 0), mlx::core::float32));
+        block_start += block_length;
+    }
+    
+    return mlx::core::astype(mlx::core::divide(output, running_sum), dtype);
+}
+
 std::pair<mlx::core::array, mlx::core::array> AttentionImplementation::getKVCache() const {
-    // In Phase 1, this is a simplified implementation
-    // In reality, we would manage a more sophisticated cache
-    return {key_cache_, value_cache_};
+    return {kv_cache_.keys(), kv_cache_.values()};
 }
 
 void AttentionImplementation::updateKVCache(const mlx::core::array& key, const mlx::core::array& value) {
-    if (key_cache_.size() == 0) {
-        key_cache_ = key;
-        value_cache_ = value;
-    } else {
-        key_cache_ = mlx::core::concatenate({key_cache_, key}, 1);  // Concat along sequence dimension
-        value_cache_ = mlx::core::concatenate({value_cache_, value}, 1);
-    }
+    // Expects already-rotated keys laid out as [batch, heads, seq, head_dim]
+    kv_cache_.append(key, value, rotary_);
+}
+
+void AttentionImplementation::clearKVCache() {
+    kv_cache_.reset();
+}
+
+void AttentionImplementation::swapKVCache(KVCache& cache) {
+    std::swap(kv_cache_, cache);
+}
+
+void AttentionImplementation::selectKVRows(const mlx::core::array& indices) {
+    kv_cache_.selectRows(indices);
+}
+
+void AttentionImplementation::forkKVCache(int64_t num_rows) {
+    kv_cache_.fork(num_rows);
+}
+
+void AttentionImplementation::restoreKVCache(
+    const mlx::core::array& keys,
+    const mlx::core::array& values,
+    int64_t tokens_seen,
+    int64_t evicted) {
+    
+    kv_cache_.restore(keys, values, tokens_seen, evicted, rotary_);
+}
+
+const KVCache& AttentionImplementation::kvCache() const {
+    return kv_cache_;
 }
 
 } // namespace mlx_transformer
\ No newline at end of file
@@ -4,7 +4,9 @@
 #include <utility>
 #include <string>
 
+#include "kv_cache.h"
 #include "model_loader.h"
+#include "rotary_embedding.h"
 
 namespace mlx_transformer {
 
@@ -13,20 +15,46 @@ public:
     AttentionImplementation(
         int64_t hidden_size,
         int64_t num_heads,
-        float dropout_prob = 0.0);
+        float dropout_prob = 0.0,
+        float rope_theta = 10000.0,
+        const KVCacheOptions& kv_options = {});
     
+    // Projection weights are only assigned here; construction allocates no tensors
     void loadWeights(ModelLoader& loader, const std::string& prefix);
     
+    // When use_cache is set, keys/values are appended to the layer's KV cache
+    // and the query attends over everything cached so far
     mlx::core::array forward(
         const mlx::core::array& hidden_states,
         const mlx::core::array& attention_mask = {},
-        const std::pair<mlx::core::array, mlx::core::array>& kv_cache = {});
+        bool use_cache = false);
     
     // Returns current KV cache
     std::pair<mlx::core::array, mlx::core::array> getKVCache() const;
     
     // Updates KV cache with new key and value tensors
     void updateKVCache(const mlx::core::array& key, const mlx::core::array& value);
+    
+    void clearKVCache();
+    
+    // Keeps only the given batch rows of the KV cache
+    void selectKVRows(const mlx::core::array& indices);
+    
+    // Switch the KV cache to shared-prefix mode with num_rows rows
+    void forkKVCache(int64_t num_rows);
+    
+    // Replace the KV cache with saved state, e.g. from a session snapshot
+    void restoreKVCache(
+        const mlx::core::array& keys,
+        const mlx::core::array& values,
+        int64_t tokens_seen,
+        int64_t evicted);
+    
+    // Exchanges the KV cache with `cache`, e.g. to switch between the caches
+    // of several in-flight micro-batches
+    void swapKVCache(KVCache& cache);
+    
+    const KVCache& kvCache() const;
 
 private:
     int64_t hidden_size_;
@@ -35,14 +63,18 @@ private:
     float dropout_prob_;
     float scale_;
     
-    mlx::core::array query_weight_;
-    mlx::core::array key_weight_;
-    mlx::core::array value_weight_;
-    mlx::core::array output_weight_;
+    // Query, key and value projections fused into one [hidden, 3 * hidden]
+    // weight, so each step reads the input once and runs a single matmul
+    LinearWeight qkv_weight_;
+    LinearWeight output_weight_;
+    
+    RotaryEmbedding rotary_;
+    KVCache kv_cache_;
     
-    // Simple KV cache for now
-    mlx::core::array key_cache_;
-    mlx::core::array value_cache_;
+    // Attention over a shared-prefix cache after the new keys/values were
+    // appended: the prefix and each suffix block are scored in place and
+    // joined under an online float32 softmax
+    mlx::core::array sharedPrefixAttention(const mlx::core::array& query);
 };
 
 } // namespace mlx_transformer
\ No newline at end of file
@@ -0,0 +1,565 @@
+#include <unistd.h>
+
+#include <mlx/nn/attention.h>
+#include <mlx/nn/layers.h>
+#include <mlx/ops.h>
+#include <mlx/random.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "decode_attention.h"
+#include "fixture_model.h"
+#include "fused_ops.h"
+#include "inference_pipeline.h"
+#include "pipeline_parallel.h"
+
+// Synthetic prompts of varying length so bucketing has something to do
+std::vector<std::string> makePrompts(int count) {
+    const std::string base = "The quick brown fox jumps over the lazy dog. ";
+    std::vector<std::string> prompts;
+    for (int i = 0; i < count; i++) {
+        std::string prompt;
+        for (int r = 0; r <= i % 4; r++) {
+            prompt += base;
+        }
+        prompts.push_back(prompt + std::to_string(i));
+    }
+    return prompts;
+}
+
+// Throughput of generate_batch as the batch size grows
+void benchmarkBatch(mlx_transformer::InferencePipeline& pipeline, int num_prompts, int max_new_tokens) {
+    auto prompts = makePrompts(num_prompts);
+
+    std::cout << "batch  seconds  tokens/s" << std::endl;
+    for (int batch_size : {1, 2, 4, 8, 16}) {
+        auto start = std::chrono::steady_clock::now();
+        pipeline.generate_batch(prompts, max_new_tokens, 0.7, 50, batch_size);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        // Count token ids, not output bytes: detokenize drops ids outside
+        // the byte range
+        int64_t generated = 0;
+        for (int64_t count : pipeline.stats().batch_tokens_generated) {
+            generated += count;
+        }
+
+        std::cout << batch_size << "  " << seconds << "  " << generated / seconds << std::endl;
+    }
+}
+
+// Single-process generate_batch against the same prompts run through
+// pipeline stage processes on this machine
+void benchmarkPipeline(
+    const std::string& model_path,
+    const std::string& stage_executable,
+    int num_stages,
+    int num_prompts,
+    int max_new_tokens) {
+
+    auto prompts = makePrompts(num_prompts);
+    const int micro_batch_size = 4;
+
+    double single_seconds;
+    {
+        mlx_transformer::InferencePipeline pipeline(model_path);
+        auto start = std::chrono::steady_clock::now();
+        pipeline.generate_batch(prompts, max_new_tokens, 0.7, 50, micro_batch_size);
+        single_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Same byte-level tokenization as the pipeline
+    std::vector<std::vector<int>> prompt_ids;
+    for (const auto& prompt : prompts) {
+        prompt_ids.emplace_back(prompt.begin(), prompt.end());
+    }
+
+    mlx_transformer::PipelineParallelOptions options;
+    options.num_stages = num_stages;
+    options.micro_batch_size = micro_batch_size;
+    options.stage_executable = stage_executable;
+    mlx_transformer::PipelineParallelGenerator generator(model_path, options);
+
+    auto start = std::chrono::steady_clock::now();
+    auto outputs = generator.generate(prompt_ids, max_new_tokens, 0.7, 50);
+    double pipeline_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t generated = 0;
+    for (const auto& output : outputs) {
+        generated += output.size();
+    }
+
+    std::cout << "stages:";
+    for (const auto& stage : generator.stages()) {
+        std::cout << " [" << stage.first_layer << ", " << stage.end_layer << ")";
+    }
+    std::cout << std::endl;
+    std::cout << "single process  " << single_seconds << " s" << std::endl;
+    std::cout << num_stages << " stages        " << pipeline_seconds << " s  "
+              << generated / pipeline_seconds << " tokens/s" << std::endl;
+}
+
+// Mean milliseconds per call of fn, after one warm-up call
+template <typename Fn>
+double timeCalls(Fn fn, int iterations) {
+    mlx::core::eval(fn());
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        mlx::core::eval(fn());
+    }
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+// Single-query decode attention: the generic scaled_dot_product_attention
+// path against the tiled decodeAttention kernel, on the CPU
+void benchmarkDecodeAttention(mlx::core::Dtype dtype) {
+    const int heads = 32;
+    const int head_dim = 128;
+    const float scale = 1.0f / std::sqrt(static_cast<float>(head_dim));
+    mlx::core::set_default_device(mlx::core::Device::cpu);
+    
+    std::cout << "context  generic_ms  decode_ms  speedup  max_abs_diff" << std::endl;
+    for (int length : {1024, 8192, 32768}) {
+        auto query = mlx::core::astype(mlx::core::random::normal({1, heads, 1, head_dim}), dtype);
+        auto keys = mlx::core::astype(mlx::core::random::normal({1, heads, length, head_dim}), dtype);
+        auto values = mlx::core::astype(mlx::core::random::normal({1, heads, length, head_dim}), dtype);
+        mlx::core::eval(query, keys, values);
+        
+        auto generic = [&]() {
+            return mlx::nn::scaled_dot_product_attention(query, keys, values, {}, 0.0f);
+        };
+        auto decode = [&]() {
+            return mlx_transformer::decodeAttention(query, keys, values, scale);
+        };
+        
+        int iterations = length >= 32768 ? 10 : 50;
+        double generic_ms = timeCalls(generic, iterations);
+        double decode_ms = timeCalls(decode, iterations);
+        
+        auto difference = mlx::core::max(mlx::core::abs(mlx::core::subtract(
+            mlx::core::astype(generic(), mlx::core::float32),
+            mlx::core::astype(decode(), mlx::core::float32))));
+        
+        std::cout << length << "  " << generic_ms << "  " << decode_ms << "  "
+                  << generic_ms / decode_ms << "x  " << mlx::core::item<float>(difference) << std::endl;
+    }
+}
+
+// Residual+norm and gated activation of one layer, unfused MLX ops against
+// the fused kernels, with the memory traffic each moves per token
+void benchmarkFusedOps(mlx::core::Dtype dtype) {
+    const int hidden = 4096;
+    const int intermediate = 11008;
+    const float eps = 1e-5f;
+    mlx::core::set_default_device(mlx::core::Device::cpu);
+    
+    auto traffic = mlx_transformer::estimateFusedTraffic(hidden, intermediate, dtype);
+    std::cout << "per layer and token: unfused " << traffic.unfused_bytes / 1024.0 << " KB, fused "
+              << traffic.fused_bytes / 1024.0 << " KB, saved " << traffic.savedBytes() / 1024.0 << " KB" << std::endl;
+    
+    auto weight = mlx::core::random::normal({hidden});
+    auto bias = mlx::core::random::normal({hidden});
+    
+    std::cout << "tokens  unfused_ms  fused_ms  speedup" << std::endl;
+    for (int tokens : {1, 64, 512}) {
+        auto x = mlx::core::astype(mlx::core::random::normal({1, tokens, hidden}), dtype);
+        auto residual = mlx::core::astype(mlx::core::random::normal({1, tokens, hidden}), dtype);
+        auto gate_up = mlx::core::astype(mlx::core::random::normal({1, tokens, 2 * intermediate}), dtype);
+        mlx::core::eval(x, residual, gate_up, weight, bias);
+        
+        auto unfused = [&]() {
+            auto sum = mlx::core::add(residual, x);
+            auto normed = mlx::core::astype(
+                mlx::nn::layer_norm(mlx::core::astype(sum, mlx::core::float32), weight, bias, eps), dtype);
+            auto halves = mlx::core::split(gate_up, 2, -1);
+            auto activated = mlx::core::multiply(mlx::core::gelu(halves[0]), halves[1]);
+            return std::vector<mlx::core::array>{sum, normed, activated};
+        };
+        auto fused = [&]() {
+            auto [sum, normed] = mlx_transformer::addLayerNorm(x, residual, weight, bias, eps);
+            return std::vector<mlx::core::array>{sum, normed, mlx_transformer::gatedGelu(gate_up)};
+        };
+        
+        int iterations = 50;
+        double unfused_ms = timeCalls(unfused, iterations);
+        double fused_ms = timeCalls(fused, iterations);
+        std::cout << tokens << "  " << unfused_ms << "  " << fused_ms << "  " << unfused_ms / fused_ms << "x" << std::endl;
+    }
+}
+
+// Model plus the loader holding its weights' accounting
+struct LoadedModel {
+    std::unique_ptr<mlx_transformer::ModelLoader> loader;
+    std::unique_ptr<mlx_transformer::TransformerModel> model;
+};
+
+LoadedModel loadModel(
+    const std::string& model_path,
+    mlx_transformer::QuantizationMode quantization,
+    mlx_transformer::ComputeDtype compute_dtype) {
+
+    mlx_transformer::QuantizationOptions quant_options;
+    quant_options.mode = quantization;
+
+    LoadedModel loaded;
+    loaded.loader = std::make_unique<mlx_transformer::ModelLoader>(model_path, quant_options, compute_dtype);
+    loaded.model = std::make_unique<mlx_transformer::TransformerModel>(loaded.loader->config());
+    loaded.model->loadWeights(*loaded.loader);
+    return loaded;
+}
+
+mlx::core::array tokenArray(const std::vector<int>& ids, size_t begin, size_t end) {
+    return mlx::core::array(ids.begin() + begin, {1, static_cast<int>(end - begin)}, mlx::core::int32);
+}
+
+// Largest absolute difference relative to the largest reference magnitude
+float relativeError(const mlx::core::array& actual, const mlx::core::array& reference) {
+    auto difference = mlx::core::max(mlx::core::abs(mlx::core::subtract(actual, reference)));
+    auto scale = mlx::core::max(mlx::core::abs(reference));
+    return mlx::core::divide(difference, scale).item<float>();
+}
+
+// Fraction of positions whose argmax token agrees
+float top1Agreement(const mlx::core::array& actual, const mlx::core::array& reference) {
+    auto same = mlx::core::equal(mlx::core::argmax(actual, -1), mlx::core::argmax(reference, -1));
+    return mlx::core::mean(mlx::core::astype(same, mlx::core::float32)).item<float>();
+}
+
+// Teacher-forced decode with the KV cache: prefill ids[:prefix], then feed
+// the remaining ids one per step. Returns the logits for positions
+// prefix - 1 .. end - 1 as [1, end - prefix + 1, vocab].
+mlx::core::array cachedLogits(mlx_transformer::TransformerModel& model, const std::vector<int>& ids, size_t prefix) {
+    using mlx_transformer::LogitsMode;
+    model.clearKVCache();
+
+    std::vector<mlx::core::array> steps = {model.forward(tokenArray(ids, 0, prefix), {}, true, LogitsMode::LAST)};
+    steps.back().eval();
+    for (size_t i = prefix; i < ids.size(); i++) {
+        steps.push_back(model.forward(tokenArray(ids, i, i + 1), {}, true, LogitsMode::LAST));
+        steps.back().eval();
+    }
+    return mlx::core::concatenate(steps, 1);
+}
+
+struct ParityResult {
+    std::string name;
+    float error;
+    float tolerance;
+    double ms;
+    // Top-1 agreement with the float32 pass; negative when not measured
+    float agreement = -1.0f;
+    // Set when the path could not run at all
+    std::string failure;
+};
+
+// Checks that every execution path of one model agrees with full recompute
+// in float32: incremental KV decode (decode-attention and fused kernels
+// included on the CPU), left-padded batches, half precision and quantized
+// weights. Prints one line per check plus load and speed counters; returns
+// false if any check is out of tolerance.
+bool runParity(const std::string& model_path) {
+    using mlx_transformer::ComputeDtype;
+    using mlx_transformer::LogitsMode;
+    using mlx_transformer::QuantizationMode;
+    using Clock = std::chrono::steady_clock;
+    auto elapsed_ms = [](Clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    };
+
+    auto reference = loadModel(model_path, QuantizationMode::NONE, ComputeDtype::FLOAT32);
+    auto& model = *reference.model;
+    const auto& config = model.config();
+
+    // Fixed random tokens; decoding is teacher-forced so every path sees
+    // the same sequence
+    const size_t prefix = 16;
+    const size_t steps = 16;
+    std::mt19937 rng(0);
+    std::uniform_int_distribution<int> token(0, static_cast<int>(config.vocab_size) - 1);
+    std::vector<int> ids(prefix + steps);
+    std::vector<int> short_ids(prefix / 2 + steps);
+    for (auto& id : ids) id = token(rng);
+    for (auto& id : short_ids) id = token(rng);
+
+    std::vector<ParityResult> results;
+
+    auto start = Clock::now();
+    auto full = model.forward(tokenArray(ids, 0, ids.size()), {}, false, LogitsMode::ALL);
+    full.eval();
+    double full_ms = elapsed_ms(start);
+    auto full_tail = mlx::core::slice(
+        full, {0, static_cast<int>(prefix) - 1, 0}, {1, static_cast<int>(ids.size()), static_cast<int>(config.vocab_size)});
+
+    // Incremental decode against the matching positions of one full pass
+    start = Clock::now();
+    auto cached = cachedLogits(model, ids, prefix);
+    double cached_ms = elapsed_ms(start);
+    results.push_back({"kv decode", relativeError(cached, full_tail), 1e-4f, cached_ms});
+
+    // The same steps without a cache, recomputing the whole sequence
+    start = Clock::now();
+    for (size_t end = prefix; end <= ids.size(); end++) {
+        model.forward(tokenArray(ids, 0, end), {}, false, LogitsMode::LAST).eval();
+    }
+    double recompute_ms = elapsed_ms(start);
+
+    // Two left-padded rows of different lengths against each row alone
+    {
+        start = Clock::now();
+        size_t short_prefix = prefix / 2;
+        std::vector<int> prompt_ids(2 * prefix, 0);
+        std::vector<int> padding(2 * prefix, 0);
+        for (size_t i = 0; i < prefix; i++) {
+            prompt_ids[i] = ids[i];
+            padding[i] = 1;
+        }
+        for (size_t i = 0; i < short_prefix; i++) {
+            prompt_ids[prefix + (prefix - short_prefix) + i] = short_ids[i];
+            padding[prefix + (prefix - short_prefix) + i] = 1;
+        }
+        auto padding_mask = mlx::core::array(padding.begin(), {2, static_cast<int>(prefix)}, mlx::core::int32);
+
+        model.clearKVCache();
+        std::vector<mlx::core::array> batch_steps = {model.forward(
+            mlx::core::array(prompt_ids.begin(), {2, static_cast<int>(prefix)}, mlx::core::int32),
+            padding_mask, true, LogitsMode::LAST)};
+        batch_steps.back().eval();
+        for (size_t s = 0; s < steps; s++) {
+            std::vector<int> step_ids = {ids[prefix + s], short_ids[short_prefix + s]};
+            padding_mask = mlx::core::concatenate({padding_mask, mlx::core::ones({2, 1}, mlx::core::int32)}, 1);
+            batch_steps.push_back(model.forward(
+                mlx::core::array(step_ids.begin(), {2, 1}, mlx::core::int32), padding_mask, true, LogitsMode::LAST));
+            batch_steps.back().eval();
+        }
+        auto batched = mlx::core::concatenate(batch_steps, 1);
+        double batched_ms = elapsed_ms(start);
+
+        auto single = mlx::core::concatenate({cached, cachedLogits(model, short_ids, short_prefix)}, 0);
+        results.push_back({"batched decode", relativeError(batched, single), 1e-4f, batched_ms});
+    }
+
+    // Reduced-precision variants against the float32 full pass
+    struct Variant {
+        const char* name;
+        QuantizationMode quantization;
+        ComputeDtype compute_dtype;
+        float tolerance;
+    };
+    const Variant variants[] = {
+        {"fp16", QuantizationMode::NONE, ComputeDtype::FLOAT16, 0.02f},
+        {"bf16", QuantizationMode::NONE, ComputeDtype::BFLOAT16, 0.05f},
+        {"int8", QuantizationMode::INT8, ComputeDtype::FLOAT32, 0.05f},
+        {"int4", QuantizationMode::INT4, ComputeDtype::FLOAT32, 0.5f},
+    };
+    for (const auto& variant : variants) {
+        // A variant that cannot load (e.g. sizes that do not split into
+        // quantization groups) fails on its own; the other checks still run
+        try {
+            auto loaded = loadModel(model_path, variant.quantization, variant.compute_dtype);
+            start = Clock::now();
+            auto logits = loaded.model->forward(tokenArray(ids, 0, ids.size()), {}, false, LogitsMode::ALL);
+            logits.eval();
+            results.push_back({variant.name, relativeError(logits, full), variant.tolerance, elapsed_ms(start),
+                               top1Agreement(logits, full)});
+        } catch (const std::exception& e) {
+            results.push_back({variant.name, 0.0f, variant.tolerance, 0.0, -1.0f, e.what()});
+        }
+    }
+
+    bool passed = true;
+    std::cout << "check           rel_error     tolerance  ms       result" << std::endl;
+    for (const auto& result : results) {
+        bool ok = result.failure.empty() && result.error <= result.tolerance;
+        passed = passed && ok;
+        std::cout << std::left << std::setw(16) << result.name;
+        if (!result.failure.empty()) {
+            std::cout << std::setw(14) << "-" << std::setw(11) << result.tolerance << std::setw(9) << "-"
+                      << "FAIL  " << result.failure << std::endl;
+            continue;
+        }
+        std::cout << std::setw(14) << result.error << std::setw(11) << result.tolerance << std::setw(9)
+                  << result.ms << (ok ? "PASS" : "FAIL");
+        if (result.agreement >= 0.0f) {
+            std::cout << "  top-1 agreement " << result.agreement;
+        }
+        std::cout << std::endl;
+    }
+
+    const auto& load_stats = reference.loader->loadStats();
+    double decoded = static_cast<double>(steps + 1);
+    std::cout << std::endl
+              << "layers " << config.num_hidden_layers << ", hidden " << config.hidden_size
+              << ", vocab " << config.vocab_size << std::endl
+              << "load: config " << load_stats.config_ms << " ms, weights " << load_stats.weights_ms << " ms, "
+              << load_stats.weights_loaded << " tensors, " << load_stats.bytes_loaded / 1024.0 << " KB" << std::endl
+              << "full pass: " << full_ms << " ms for " << ids.size() << " tokens" << std::endl
+              << "decode: kv " << decoded * 1000.0 / cached_ms << " tokens/s, recompute "
+              << decoded * 1000.0 / recompute_ms << " tokens/s" << std::endl
+              << "kv cache: " << model.kvCacheBytes() / 1024.0 << " KB" << std::endl;
+
+    return passed;
+}
+
+// Greedy tokens of a two-stage pipeline against single-process generate on
+// the same prompts. Both take the argmax at every step, so they must agree.
+bool runPipelineParity(const std::string& model_path, const std::string& stage_executable) {
+    const int max_new_tokens = 16;
+    // Equal lengths, so the micro-batches need no left padding
+    std::vector<std::string> prompts;
+    for (int i = 0; i < 4; i++) {
+        prompts.push_back("pipeline prompt " + std::to_string(i));
+    }
+
+    std::vector<std::string> expected;
+    {
+        mlx_transformer::InferencePipeline pipeline(model_path);
+        for (const auto& prompt : prompts) {
+            expected.push_back(pipeline.generate(prompt, max_new_tokens, 1.0f, 1));
+        }
+    }
+
+    mlx_transformer::PipelineParallelOptions options;
+    options.num_stages = 2;
+    options.micro_batch_size = 2;
+    options.stage_executable = stage_executable;
+    mlx_transformer::PipelineParallelGenerator generator(model_path, options);
+
+    // Same byte-level tokenization as the pipeline
+    std::vector<std::vector<int>> prompt_ids;
+    for (const auto& prompt : prompts) {
+        prompt_ids.emplace_back(prompt.begin(), prompt.end());
+    }
+    auto outputs = generator.generate(prompt_ids, max_new_tokens, 1.0f, 1);
+
+    // generate stops before an EOS token and does not return it
+    const auto& eos_token_ids = mlx_transformer::ModelLoader(model_path).config().eos_token_ids;
+    bool passed = true;
+    for (size_t i = 0; i < prompts.size(); i++) {
+        std::string text;
+        for (int token_id : outputs[i]) {
+            if (std::find(eos_token_ids.begin(), eos_token_ids.end(), token_id) != eos_token_ids.end()) {
+                break;
+            }
+            text.push_back(static_cast<char>(token_id));
+        }
+        bool ok = text == expected[i];
+        passed = passed && ok;
+        std::cout << std::left << std::setw(20) << prompts[i] << outputs[i].size() << " tokens  "
+                  << (ok ? "PASS" : "FAIL") << std::endl;
+    }
+
+    std::cout << "stages:";
+    for (const auto& stage : generator.stages()) {
+        std::cout << " [" << stage.first_layer << ", " << stage.end_layer << ")";
+    }
+    std::cout << std::endl;
+    return passed;
+}
+
+// Runs check on model_path or, when it is empty, on a tiny random model
+// written to a temporary directory and removed afterwards. Returns the exit
+// code.
+template <typename Check>
+int checkOnFixture(std::string model_path, Check check) {
+    bool temporary = model_path.empty();
+    bool passed = false;
+    try {
+        if (temporary) {
+            model_path = (std::filesystem::temp_directory_path() /
+                          ("mlx-transformer-parity-" + std::to_string(::getpid()))).string();
+            mlx_transformer::writeFixtureModel(model_path);
+        }
+        passed = check(model_path);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+    }
+    if (temporary) {
+        std::filesystem::remove_all(model_path);
+    }
+    return passed ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 2 && std::string(argv[1]) == "fused") {
+        try {
+            benchmarkFusedOps(mlx_transformer::toMlxDtype(
+                mlx_transformer::parseComputeDtype(argc >= 3 ? argv[2] : "fp32")));
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    
+    if (argc >= 2 && std::string(argv[1]) == "parity") {
+        return checkOnFixture(argc >= 3 ? argv[2] : "", runParity);
+    }
+    
+    if (argc >= 2 && std::string(argv[1]) == "pipeline-parity") {
+        // The stage executable is built next to this one unless given
+        std::string stage_executable = argc >= 3
+            ? argv[2]
+            : (std::filesystem::path(argv[0]).parent_path() / "mlx_transformer_stage").string();
+        return checkOnFixture(argc >= 4 ? argv[3] : "", [&](const std::string& model_path) {
+            return runPipelineParity(model_path, stage_executable);
+        });
+    }
+    
+    if (argc >= 2 && std::string(argv[1]) == "decode-attention") {
+        try {
+            benchmarkDecodeAttention(mlx_transformer::toMlxDtype(
+                mlx_transformer::parseComputeDtype(argc >= 3 ? argv[2] : "fp32")));
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <model_path> batch [num_prompts] [max_new_tokens]" << std::endl;
+        std::cerr << "       " << argv[0] << " <model_path> pipeline [num_stages] [num_prompts] [max_new_tokens]" << std::endl;
+        std::cerr << "       " << argv[0] << " decode-attention [fp32|fp16|bf16]" << std::endl;
+        std::cerr << "       " << argv[0] << " fused [fp32|fp16|bf16]" << std::endl;
+        std::cerr << "       " << argv[0] << " parity [model_path]" << std::endl;
+        std::cerr << "       " << argv[0] << " pipeline-parity [stage_executable] [model_path]" << std::endl;
+        return 1;
+    }
+
+    std::string model_path = argv[1];
+    std::string mode = argv[2];
+
+    try {
+        if (mode == "batch") {
+            int num_prompts = argc >= 4 ? std::stoi(argv[3]) : 32;
+            int max_new_tokens = argc >= 5 ? std::stoi(argv[4]) : 64;
+
+            mlx_transformer::InferencePipeline pipeline(model_path);
+            benchmarkBatch(pipeline, num_prompts, max_new_tokens);
+        } else if (mode == "pipeline") {
+            int num_stages = argc >= 4 ? std::stoi(argv[3]) : 2;
+            int num_prompts = argc >= 5 ? std::stoi(argv[4]) : 16;
+            int max_new_tokens = argc >= 6 ? std::stoi(argv[5]) : 32;
+
+            // The stage executable is built next to this one
+            auto stage_executable = std::filesystem::path(argv[0]).parent_path() / "mlx_transformer_stage";
+            benchmarkPipeline(model_path, stage_executable.string(), num_stages, num_prompts, max_new_tokens);
+        } else {
+            std::cerr << "Unknown benchmark: " << mode << std::endl;
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -17,4 +17,4 @@ cmake --build . -- -j$(nproc)
 cd ..
 
 echo "Build completed successfully."
-echo "Usage: ./build/transformer_example <model_path> [quantization_mode]"
+echo "Usage: ./build/transformer_example <model_path> [quantization_mode] [kv_window] [fp32|fp16|bf16]"
@@ -0,0 +1,73 @@
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "memory_accountant.h"
+#include "model_loader.h"
+#include "packed_model.h"
+#include "transformer_model.h"
+
+// Converts a checkpoint of per-tensor safetensors files into a single packed
+// model file, doing all dtype conversion, fusion, transposition and
+// quantization once instead of at every startup
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <model_path> [output_path] [quantization_mode] [fp32|fp16|bf16]" << std::endl;
+        return 1;
+    }
+    
+    std::string model_path = argv[1];
+    std::string output_path = model_path + "/" + mlx_transformer::kPackedModelFileName;
+    int quantization_mode = 0;
+    std::string compute_dtype = "fp32";
+    
+    if (argc >= 3) {
+        output_path = argv[2];
+    }
+    if (argc >= 4) {
+        quantization_mode = std::stoi(argv[3]);
+    }
+    if (argc >= 5) {
+        compute_dtype = argv[4];
+    }
+    
+    try {
+        auto start = std::chrono::steady_clock::now();
+        
+        mlx_transformer::QuantizationOptions quant_options;
+        quant_options.mode = static_cast<mlx_transformer::QuantizationMode>(quantization_mode);
+        
+        mlx_transformer::ModelLoader loader(
+            model_path, quant_options, mlx_transformer::parseComputeDtype(compute_dtype));
+        if (loader.isPacked()) {
+            std::cerr << "Error: " << model_path << " already contains "
+                      << mlx_transformer::kPackedModelFileName
+                      << "; remove it to convert from the original weights" << std::endl;
+            return 1;
+        }
+        
+        // Loading the model through a recording loader yields every tensor in
+        // its final layout, in execution order
+        std::vector<mlx_transformer::PackedTensor> tensors;
+        loader.recordTensors(&tensors);
+        
+        mlx_transformer::TransformerModel model(loader.config());
+        model.loadWeights(loader);
+        
+        mlx_transformer::writePackedModel(
+            output_path, tensors, loader.config().compute_dtype, quant_options.mode);
+        
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Wrote " << tensors.size() << " tensors ("
+                  << std::filesystem::file_size(output_path) / (1024.0 * 1024.0) << " MB) to "
+                  << output_path << " in " << seconds << " s" << std::endl;
+        
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    
+    return 0;
+}
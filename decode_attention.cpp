@@ -0,0 +1,277 @@
+#include "decode_attention.h"
+
+#include <mlx/allocator.h>
+#include <mlx/backend/cpu/encoder.h>
+#include <mlx/ops.h>
+#include <mlx/primitives.h>
+#include <mlx/utils.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include "thread_pool.h"
+
+namespace mlx_transformer {
+
+namespace {
+
+// Positions per tile. A tile's keys and values (2 * 64 * head_dim elements)
+// stay in L1 while its scores are computed and applied.
+constexpr int kTileSize = 64;
+
+// Shortest sequence range worth giving its own split
+constexpr int kMinSplitLength = 256;
+
+// Independent lanes keep the loops free of a serial dependency, so the
+// compiler emits SIMD multiply-adds without needing -ffast-math
+constexpr int kLanes = 8;
+
+template <typename T>
+inline float dot(const float* query, const T* key, int head_dim) {
+    float lanes[kLanes] = {};
+    int i = 0;
+    for (; i + kLanes <= head_dim; i += kLanes) {
+        for (int l = 0; l < kLanes; l++) {
+            lanes[l] += query[i + l] * static_cast<float>(key[i + l]);
+        }
+    }
+    float sum = 0.0f;
+    for (; i < head_dim; i++) {
+        sum += query[i] * static_cast<float>(key[i]);
+    }
+    for (int l = 0; l < kLanes; l++) {
+        sum += lanes[l];
+    }
+    return sum;
+}
+
+template <typename T>
+inline void accumulate(float* output, float weight, const T* value, int head_dim) {
+    for (int i = 0; i < head_dim; i++) {
+        output[i] += weight * static_cast<float>(value[i]);
+    }
+}
+
+struct DecodeShape {
+    int batch;
+    int heads;
+    int length;
+    int head_dim;
+};
+
+template <typename T>
+void decodeAttentionKernel(
+    const T* queries,
+    const T* keys,
+    const T* values,
+    const float* mask,
+    T* output,
+    DecodeShape shape,
+    float scale) {
+
+    auto& pool = ThreadPool::global();
+    int rows = shape.batch * shape.heads;
+    int head_dim = shape.head_dim;
+
+    // Split the sequence until there are enough work items for every thread
+    int max_splits = std::max(1, shape.length / kMinSplitLength);
+    int wanted = static_cast<int>((2 * pool.size() + rows - 1) / rows);
+    int splits = std::clamp(wanted, 1, max_splits);
+    int split_length = (shape.length + splits - 1) / splits;
+
+    // Per-split running max, softmax denominator and unnormalized output
+    std::vector<float> split_max(rows * splits);
+    std::vector<float> split_sum(rows * splits);
+    std::vector<float> split_output(static_cast<size_t>(rows) * splits * head_dim);
+
+    pool.parallelFor(rows * splits, [&](int item) {
+        int row = item / splits;
+        int batch = row / shape.heads;
+        int begin = (item % splits) * split_length;
+        int end = std::min(shape.length, begin + split_length);
+
+        std::vector<float> query(head_dim);
+        for (int i = 0; i < head_dim; i++) {
+            query[i] = static_cast<float>(queries[static_cast<size_t>(row) * head_dim + i]) * scale;
+        }
+
+        float running_max = -std::numeric_limits<float>::infinity();
+        float running_sum = 0.0f;
+        float* out = split_output.data() + static_cast<size_t>(item) * head_dim;
+        std::fill(out, out + head_dim, 0.0f);
+
+        const T* row_keys = keys + static_cast<size_t>(row) * shape.length * head_dim;
+        const T* row_values = values + static_cast<size_t>(row) * shape.length * head_dim;
+        const float* row_mask = mask ? mask + static_cast<size_t>(batch) * shape.length : nullptr;
+
+        float scores[kTileSize];
+        for (int tile = begin; tile < end; tile += kTileSize) {
+            int count = std::min(kTileSize, end - tile);
+
+            float tile_max = -std::numeric_limits<float>::infinity();
+            for (int j = 0; j < count; j++) {
+                size_t position = tile + j;
+                float score = dot(query.data(), row_keys + position * head_dim, head_dim);
+                if (row_mask) {
+                    score += row_mask[position];
+                }
+                scores[j] = score;
+                tile_max = std::max(tile_max, score);
+            }
+
+            // Rescale what was accumulated so far to the new maximum
+            float new_max = std::max(running_max, tile_max);
+            float correction = std::exp(running_max - new_max);
+            running_sum *= correction;
+            for (int i = 0; i < head_dim; i++) {
+                out[i] *= correction;
+            }
+
+            for (int j = 0; j < count; j++) {
+                float weight = std::exp(scores[j] - new_max);
+                running_sum += weight;
+                accumulate(out, weight, row_values + static_cast<size_t>(tile + j) * head_dim, head_dim);
+            }
+            running_max = new_max;
+        }
+
+        split_max[item] = running_max;
+        split_sum[item] = running_sum;
+    });
+
+    // Combine the splits of each (row, head)
+    pool.parallelFor(rows, [&](int row) {
+        float global_max = -std::numeric_limits<float>::infinity();
+        for (int s = 0; s < splits; s++) {
+            global_max = std::max(global_max, split_max[row * splits + s]);
+        }
+
+        std::vector<float> combined(head_dim, 0.0f);
+        float total = 0.0f;
+        for (int s = 0; s < splits; s++) {
+            int item = row * splits + s;
+            if (split_sum[item] == 0.0f) {
+                continue;  // Empty split
+            }
+            float weight = std::exp(split_max[item] - global_max);
+            total += weight * split_sum[item];
+            accumulate(combined.data(), weight, split_output.data() + static_cast<size_t>(item) * head_dim, head_dim);
+        }
+
+        T* out = output + static_cast<size_t>(row) * head_dim;
+        for (int i = 0; i < head_dim; i++) {
+            out[i] = static_cast<T>(combined[i] / total);
+        }
+    });
+}
+
+class DecodeAttention : public mlx::core::Primitive {
+public:
+    DecodeAttention(mlx::core::Stream stream, float scale)
+        : mlx::core::Primitive(stream), scale_(scale) {
+    }
+
+    void eval_cpu(const std::vector<mlx::core::array>& inputs, std::vector<mlx::core::array>& outputs) override {
+        const auto& queries = inputs[0];
+        const auto& keys = inputs[1];
+        const auto& values = inputs[2];
+        auto& output = outputs[0];
+        output.set_data(mlx::core::allocator::malloc(output.nbytes()));
+
+        auto& encoder = mlx::core::cpu::get_command_encoder(stream());
+        for (const auto& input : inputs) {
+            encoder.set_input_array(input);
+        }
+        encoder.set_output_array(output);
+
+        DecodeShape shape{keys.shape(0), keys.shape(1), keys.shape(2), keys.shape(3)};
+        const float* mask = inputs.size() > 3 ? inputs[3].data<float>() : nullptr;
+        float scale = scale_;
+
+        auto dtype = queries.dtype();
+        if (dtype == mlx::core::float32) {
+            encoder.dispatch([q = queries.data<float>(), k = keys.data<float>(), v = values.data<float>(),
+                              mask, out = output.data<float>(), shape, scale]() {
+                decodeAttentionKernel(q, k, v, mask, out, shape, scale);
+            });
+        } else if (dtype == mlx::core::float16) {
+            using T = mlx::core::float16_t;
+            encoder.dispatch([q = queries.data<T>(), k = keys.data<T>(), v = values.data<T>(),
+                              mask, out = output.data<T>(), shape, scale]() {
+                decodeAttentionKernel(q, k, v, mask, out, shape, scale);
+            });
+        } else {
+            using T = mlx::core::bfloat16_t;
+            encoder.dispatch([q = queries.data<T>(), k = keys.data<T>(), v = values.data<T>(),
+                              mask, out = output.data<T>(), shape, scale]() {
+                decodeAttentionKernel(q, k, v, mask, out, shape, scale);
+            });
+        }
+    }
+
+    void eval_gpu(const std::vector<mlx::core::array>&, std::vector<mlx::core::array>&) override {
+        throw std::runtime_error("DecodeAttention has no GPU implementation");
+    }
+
+    const char* name() const override {
+        return "DecodeAttention";
+    }
+
+    bool is_equivalent(const mlx::core::Primitive& other) const override {
+        return scale_ == static_cast<const DecodeAttention&>(other).scale_;
+    }
+
+private:
+    float scale_;
+};
+
+} // namespace
+
+mlx::core::array decodeAttention(
+    const mlx::core::array& queries,
+    const mlx::core::array& keys,
+    const mlx::core::array& values,
+    float scale,
+    const mlx::core::array& mask) {
+
+    if (queries.ndim() != 4 || queries.shape(2) != 1) {
+        throw std::invalid_argument("decodeAttention takes queries of shape [batch, heads, 1, head_dim]");
+    }
+    if (keys.shape() != values.shape() || keys.shape(0) != queries.shape(0) ||
+        keys.shape(1) != queries.shape(1) || keys.shape(3) != queries.shape(3)) {
+        throw std::invalid_argument("decodeAttention keys and values do not match the queries");
+    }
+    auto dtype = queries.dtype();
+    if (dtype != mlx::core::float32 && dtype != mlx::core::float16 && dtype != mlx::core::bfloat16) {
+        throw std::invalid_argument("decodeAttention needs float32, float16 or bfloat16 inputs");
+    }
+
+    // The kernel indexes raw row-major buffers; contiguous() is free for the
+    // concatenated cache and only copies views
+    std::vector<mlx::core::array> inputs = {
+        mlx::core::contiguous(queries),
+        mlx::core::contiguous(mlx::core::astype(keys, dtype)),
+        mlx::core::contiguous(mlx::core::astype(values, dtype))};
+
+    if (mask.size() != 0) {
+        // [batch or 1, 1, 1, seq] -> [batch, seq] float32; never per head
+        int batch = queries.shape(0);
+        int length = keys.shape(2);
+        auto rows = mlx::core::reshape(mask, {mask.shape(0), length});
+        inputs.push_back(mlx::core::contiguous(
+            mlx::core::broadcast_to(mlx::core::astype(rows, mlx::core::float32), {batch, length})));
+    }
+
+    return mlx::core::array(
+        queries.shape(),
+        dtype,
+        std::make_shared<DecodeAttention>(mlx::core::to_stream(mlx::core::Device::cpu), scale),
+        inputs);
+}
+
+bool decodeAttentionAvailable() {
+    return mlx::core::default_device() == mlx::core::Device::cpu;
+}
+
+} // namespace mlx_transformer
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <mlx/array.h>
+
+namespace mlx_transformer {
+
+// Attention of one query position per row against a KV cache, as a custom
+// CPU primitive for the decode step.
+//
+// queries are [batch, heads, 1, head_dim] and keys/values [batch, heads,
+// seq, head_dim], all float32, float16 or bfloat16. mask, if given, is an
+// additive [batch or 1, 1, 1, seq] mask. Each (row, head) is split along the
+// sequence; every split streams its keys and values in small tiles with an
+// online softmax, accumulating in float32, and the splits are combined at the
+// end. No [seq]-sized score tensor is ever materialized.
+mlx::core::array decodeAttention(
+    const mlx::core::array& queries,
+    const mlx::core::array& keys,
+    const mlx::core::array& values,
+    float scale,
+    const mlx::core::array& mask = {});
+
+// Whether decodeAttention can run on the default device; it has no GPU kernel
+bool decodeAttentionAvailable();
+
+} // namespace mlx_transformer
@@ -3,35 +3,39 @@
 #include <mlx/ops.h>
 #include <mlx/nn/layers.h>
 
+#include "fused_ops.h"
+
 namespace mlx_transformer {
 
 FeedForward::FeedForward(int64_t hidden_size, int64_t intermediate_size, float dropout_prob)
     : hidden_size_(hidden_size),
       intermediate_size_(intermediate_size),
       dropout_prob_(dropout_prob) {
-    
-    // Initialize feed-forward weights
-    gate_weight_ = mlx::core::zeros({hidden_size_, intermediate_size_}, mlx::core::float32);
-    up_weight_ = mlx::core::zeros({hidden_size_, intermediate_size_}, mlx::core::float32);
-    down_weight_ = mlx::core::zeros({intermediate_size_, hidden_size_}, mlx::core::float32);
+    // Feed-forward weights are bound directly to the loaded tensors in loadWeights
 }
 
 void FeedForward::loadWeights(ModelLoader& loader, const std::string& prefix) {
-    gate_weight_ = loader.loadWeight(prefix + ".gate_proj.weight");
-    up_weight_ = loader.loadWeight(prefix + ".up_proj.weight");
-    down_weight_ = loader.loadWeight(prefix + ".down_proj.weight");
+    gate_up_weight_ = loader.loadLinear(
+        prefix + ".gate_up_proj",
+        {prefix + ".gate_proj.weight", prefix + ".up_proj.weight"});
+    down_weight_ = loader.loadLinear(prefix + ".down_proj", {prefix + ".down_proj.weight"});
 }
 
 mlx::core::array FeedForward::forward(const mlx::core::array& hidden_states) {
-    // SwiGLU activation as used in many modern transformer models
-    auto gate = mlx::core::matmul(hidden_states, gate_weight_);
-    gate = mlx::core::gelu(gate);
-    
-    auto up = mlx::core::matmul(hidden_states, up_weight_);
-    auto intermediate = mlx::core::multiply(gate, up);
+    // Gated activation (SwiGLU-style, with GELU) on the fused gate/up
+    // projection. The CPU kernel reads both halves once and writes only the
+    // product.
+    auto gate_up = linear(hidden_states, gate_up_weight_);
+    mlx::core::array intermediate;
+    if (fusedOpsAvailable()) {
+        intermediate = gatedGelu(gate_up);
+    } else {
+        auto halves = mlx::core::split(gate_up, 2, -1);
+        intermediate = mlx::core::multiply(mlx::core::gelu(halves[0]), halves[1]);
+    }
     
     // Project back to hidden dimension
-    auto output = mlx::core::matmul(intermediate, down_weight_);
+    auto output = linear(intermediate, down_weight_);
     
     // Apply dropout if needed
     if (dropout_prob_ > 0.0) {
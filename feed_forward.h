@@ -11,6 +11,7 @@ class FeedForward {
 public:
     FeedForward(int64_t hidden_size, int64_t intermediate_size, float dropout_prob = 0.0);
     
+    // Weights are only assigned here; construction allocates no tensors
     void loadWeights(ModelLoader& loader, const std::string& prefix);
     
     mlx::core::array forward(const mlx::core::array& hidden_states);
@@ -20,9 +21,9 @@ private:
     int64_t intermediate_size_;
     float dropout_prob_;
     
-    mlx::core::array gate_weight_;
-    mlx::core::array up_weight_;
-    mlx::core::array down_weight_;
+    // Gate and up projections fused into one [hidden, 2 * intermediate] weight
+    LinearWeight gate_up_weight_;
+    LinearWeight down_weight_;
 };
 
 } // namespace mlx_transformer
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include "fixture_model.h"
+
+// Writes a small model with random weights for benchmarks and parity checks,
+// so neither needs a multi-GB checkpoint
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <output_dir> [tiny|small|medium]"
+                  << " [layers=N] [hidden=N] [heads=N] [intermediate=N] [vocab=N] [positions=N]"
+                  << " [tied=0|1] [seed=N]" << std::endl;
+        return 1;
+    }
+
+    std::string output_dir = argv[1];
+
+    try {
+        int first_override = 2;
+        mlx_transformer::FixtureOptions options;
+        if (argc >= 3 && std::string(argv[2]).find('=') == std::string::npos) {
+            options = mlx_transformer::fixturePreset(argv[2]);
+            first_override = 3;
+        }
+
+        for (int i = first_override; i < argc; i++) {
+            std::string arg = argv[i];
+            auto eq = arg.find('=');
+            if (eq == std::string::npos) {
+                std::cerr << "Expected key=value, got: " << arg << std::endl;
+                return 1;
+            }
+            std::string key = arg.substr(0, eq);
+            int64_t value = std::stoll(arg.substr(eq + 1));
+
+            if (key == "layers") {
+                options.num_hidden_layers = value;
+            } else if (key == "hidden") {
+                options.hidden_size = value;
+            } else if (key == "heads") {
+                options.num_attention_heads = value;
+            } else if (key == "intermediate") {
+                options.intermediate_size = value;
+            } else if (key == "vocab") {
+                options.vocab_size = value;
+            } else if (key == "positions") {
+                options.max_position_embeddings = value;
+            } else if (key == "tied") {
+                options.tie_word_embeddings = value != 0;
+            } else if (key == "seed") {
+                options.seed = static_cast<uint64_t>(value);
+            } else {
+                std::cerr << "Unknown option: " << key << std::endl;
+                return 1;
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        mlx_transformer::writeFixtureModel(output_dir, options);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        size_t bytes = 0;
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(output_dir)) {
+            if (entry.is_regular_file()) {
+                bytes += entry.file_size();
+            }
+        }
+        std::cout << "Wrote " << options.num_hidden_layers << "-layer model (hidden " << options.hidden_size
+                  << ", heads " << options.num_attention_heads << ", vocab " << options.vocab_size << ", "
+                  << bytes / (1024.0 * 1024.0) << " MB) to " << output_dir << " in " << seconds << " s"
+                  << std::endl;
+
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+#include "fixture_model.h"
+
+#include <mlx/io.h>
+#include <mlx/ops.h>
+#include <mlx/random.h>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#include "quantizer.h"
+
+namespace mlx_transformer {
+
+namespace {
+
+void writeTensor(const std::string& path, const std::string& name, const mlx::core::array& tensor) {
+    auto evaluated = tensor;
+    evaluated.eval();
+    mlx::io::save_safetensors(path + "/weights/" + name + ".safetensors", {{name, evaluated}});
+}
+
+mlx::core::array randomNormal(const mlx::core::Shape& shape, float scale) {
+    return mlx::core::multiply(mlx::core::random::normal(shape), mlx::core::array(scale));
+}
+
+} // namespace
+
+FixtureOptions fixturePreset(const std::string& name) {
+    FixtureOptions options;
+    if (name == "tiny") {
+        return options;
+    }
+    if (name == "small") {
+        options.hidden_size = 256;
+        options.intermediate_size = 704;
+        options.num_hidden_layers = 4;
+        options.num_attention_heads = 8;
+        options.max_position_embeddings = 2048;
+        return options;
+    }
+    if (name == "medium") {
+        options.vocab_size = 4096;
+        options.hidden_size = 512;
+        options.intermediate_size = 1408;
+        options.num_hidden_layers = 8;
+        options.num_attention_heads = 8;
+        options.max_position_embeddings = 4096;
+        return options;
+    }
+    throw std::invalid_argument("Unknown fixture preset: " + name);
+}
+
+void writeFixtureModel(const std::string& path, const FixtureOptions& options) {
+    if (options.vocab_size < 256) {
+        throw std::invalid_argument("Fixture vocab_size must be at least 256 for the byte-level tokenizer");
+    }
+    if (options.hidden_size % options.num_attention_heads != 0) {
+        throw std::invalid_argument("Fixture hidden_size must be a multiple of num_attention_heads");
+    }
+    // Every linear input dimension has to split into quantization groups,
+    // so the same fixture also loads as int8/int4
+    int64_t group_size = QuantizationOptions{}.group_size;
+    if (options.hidden_size % group_size != 0 || options.intermediate_size % group_size != 0) {
+        throw std::invalid_argument(
+            "Fixture hidden_size and intermediate_size must be multiples of the quantization group size " +
+            std::to_string(group_size));
+    }
+
+    std::filesystem::create_directories(path + "/weights");
+
+    std::ofstream config(path + "/config.json");
+    config << "{\n"
+           << "  \"model_type\": \"llama\",\n"
+           << "  \"vocab_size\": " << options.vocab_size << ",\n"
+           << "  \"hidden_size\": " << options.hidden_size << ",\n"
+           << "  \"intermediate_size\": " << options.intermediate_size << ",\n"
+           << "  \"num_hidden_layers\": " << options.num_hidden_layers << ",\n"
+           << "  \"num_attention_heads\": " << options.num_attention_heads << ",\n"
+           << "  \"max_position_embeddings\": " << options.max_position_embeddings << ",\n"
+           << "  \"layer_norm_epsilon\": 1e-05,\n"
+           << "  \"rope_theta\": 10000.0,\n"
+           << "  \"tie_word_embeddings\": " << (options.tie_word_embeddings ? "true" : "false") << ",\n"
+           << "  \"eos_token_id\": 2\n"
+           << "}\n";
+    if (!config) {
+        throw std::runtime_error("Cannot write " + path + "/config.json");
+    }
+
+    mlx::core::random::seed(options.seed);
+    int vocab = static_cast<int>(options.vocab_size);
+    int hidden = static_cast<int>(options.hidden_size);
+    int intermediate = static_cast<int>(options.intermediate_size);
+    float hidden_scale = 1.0f / std::sqrt(static_cast<float>(hidden));
+    float intermediate_scale = 1.0f / std::sqrt(static_cast<float>(intermediate));
+
+    // Norm parameters are perturbed so that a norm loaded from the wrong
+    // tensor (or not at all) changes the output
+    auto norm = [&](const std::string& prefix) {
+        writeTensor(path, prefix + ".weight",
+                    mlx::core::add(mlx::core::array(1.0f), randomNormal({hidden}, 0.1f)));
+        writeTensor(path, prefix + ".bias", randomNormal({hidden}, 0.1f));
+    };
+
+    writeTensor(path, "embedding.weight", randomNormal({vocab, hidden}, 1.0f));
+    for (int64_t i = 0; i < options.num_hidden_layers; i++) {
+        std::string prefix = "transformer.layers." + std::to_string(i);
+
+        // Linear weights are stored [in, out]
+        for (const char* name : {".attention.wq", ".attention.wk", ".attention.wv", ".attention.wo"}) {
+            writeTensor(path, prefix + name + ".weight", randomNormal({hidden, hidden}, hidden_scale));
+        }
+        writeTensor(path, prefix + ".mlp.gate_proj.weight", randomNormal({hidden, intermediate}, hidden_scale));
+        writeTensor(path, prefix + ".mlp.up_proj.weight", randomNormal({hidden, intermediate}, hidden_scale));
+        writeTensor(path, prefix + ".mlp.down_proj.weight", randomNormal({intermediate, hidden}, intermediate_scale));
+        norm(prefix + ".attention_norm");
+        norm(prefix + ".mlp_norm");
+    }
+    norm("transformer.ln_f");
+
+    // The LM head uses the checkpoint layout [vocab, hidden]
+    if (!options.tie_word_embeddings) {
+        writeTensor(path, "lm_head.weight", randomNormal({vocab, hidden}, hidden_scale));
+    }
+}
+
+} // namespace mlx_transformer
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace mlx_transformer {
+
+// Dimensions of a synthetic model with random weights. The defaults give a
+// model of well under 1 MB that loads and runs in milliseconds.
+struct FixtureOptions {
+    // At least 256: the pipeline's tokenizer is byte-level
+    int64_t vocab_size = 256;
+    int64_t hidden_size = 64;
+    // hidden_size and intermediate_size are multiples of the default
+    // quantization group size (64) so fixtures also load quantized
+    int64_t intermediate_size = 192;
+    int64_t num_hidden_layers = 2;
+    int64_t num_attention_heads = 4;
+    int64_t max_position_embeddings = 512;
+    bool tie_word_embeddings = false;
+    uint64_t seed = 0;
+};
+
+// "tiny", "small" or "medium"
+FixtureOptions fixturePreset(const std::string& name);
+
+// Writes a complete model directory that ModelLoader reads like a real
+// checkpoint: config.json plus one safetensors file per tensor under
+// weights/, in the checkpoint layouts the loader expects. Linear weights are
+// scaled by 1/sqrt(fan_in) so activations keep unit scale through the layers
+// and the logits are far from uniform. The same options and seed always
+// produce the same weights.
+void writeFixtureModel(const std::string& path, const FixtureOptions& options = {});
+
+} // namespace mlx_transformer
@@ -0,0 +1,319 @@
+#include "fused_ops.h"
+
+#include <mlx/allocator.h>
+#include <mlx/backend/cpu/encoder.h>
+#include <mlx/ops.h>
+#include <mlx/primitives.h>
+#include <mlx/utils.h>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace mlx_transformer {
+
+namespace {
+
+// Elements per parallel work item; smaller items cost more in scheduling
+// than they gain
+constexpr size_t kMinElementsPerItem = 16384;
+
+// Independent lanes so the reductions vectorize without -ffast-math
+constexpr int kLanes = 8;
+
+// Splits `rows` rows of `row_size` elements into work items
+void parallelRows(size_t rows, size_t row_size, const std::function<void(size_t, size_t)>& fn) {
+    size_t rows_per_item = std::max<size_t>(1, kMinElementsPerItem / std::max<size_t>(1, row_size));
+    int items = static_cast<int>((rows + rows_per_item - 1) / rows_per_item);
+    ThreadPool::global().parallelFor(items, [&](int item) {
+        size_t begin = item * rows_per_item;
+        fn(begin, std::min(rows, begin + rows_per_item));
+    });
+}
+
+// erf as a rational function on [-4, 4] (erf is +-1 in float32 outside).
+// Unlike std::erf it has no branches or library calls, so the loop around it
+// vectorizes; the maximum error is about 4e-7.
+inline float erfApprox(float x) {
+    x = std::min(4.0f, std::max(-4.0f, x));
+    float x2 = x * x;
+
+    float p = x2 * -2.72614225801306e-10f + 2.77068142495902e-08f;
+    p = x2 * p - 2.10102402082508e-06f;
+    p = x2 * p - 5.69250639462346e-05f;
+    p = x2 * p - 7.34990630326855e-04f;
+    p = x2 * p - 2.95459980854025e-03f;
+    p = x2 * p - 1.60960333262415e-02f;
+
+    float q = x2 * -1.45660718464996e-05f - 2.13374055278905e-04f;
+    q = x2 * q - 1.68282697438203e-03f;
+    q = x2 * q - 7.37332916720468e-03f;
+    q = x2 * q - 1.42647390514189e-02f;
+
+    return x * p / q;
+}
+
+template <typename T>
+void addLayerNormKernel(
+    const T* x,
+    const T* residual,
+    const float* weight,
+    const float* bias,
+    T* sum_out,
+    T* normed_out,
+    size_t rows,
+    size_t hidden,
+    float eps) {
+
+    parallelRows(rows, hidden, [&](size_t begin, size_t end) {
+        std::vector<float> row(hidden);
+        for (size_t r = begin; r < end; r++) {
+            size_t offset = r * hidden;
+
+            // Pass 1: the residual sum, written out and kept in float32
+            float lanes[kLanes] = {};
+            size_t i = 0;
+            for (; i + kLanes <= hidden; i += kLanes) {
+                for (int l = 0; l < kLanes; l++) {
+                    T value = static_cast<T>(static_cast<float>(x[offset + i + l]) +
+                                             static_cast<float>(residual[offset + i + l]));
+                    sum_out[offset + i + l] = value;
+                    row[i + l] = static_cast<float>(value);
+                    lanes[l] += row[i + l];
+                }
+            }
+            float total = 0.0f;
+            for (; i < hidden; i++) {
+                T value = static_cast<T>(static_cast<float>(x[offset + i]) + static_cast<float>(residual[offset + i]));
+                sum_out[offset + i] = value;
+                row[i] = static_cast<float>(value);
+                total += row[i];
+            }
+            for (int l = 0; l < kLanes; l++) {
+                total += lanes[l];
+            }
+            float mean = total / hidden;
+
+            // Pass 2: variance from the row, which is still in cache
+            float square_lanes[kLanes] = {};
+            i = 0;
+            for (; i + kLanes <= hidden; i += kLanes) {
+                for (int l = 0; l < kLanes; l++) {
+                    float centered = row[i + l] - mean;
+                    square_lanes[l] += centered * centered;
+                }
+            }
+            float squares = 0.0f;
+            for (; i < hidden; i++) {
+                float centered = row[i] - mean;
+                squares += centered * centered;
+            }
+            for (int l = 0; l < kLanes; l++) {
+                squares += square_lanes[l];
+            }
+            float inv_std = 1.0f / std::sqrt(squares / hidden + eps);
+
+            // Pass 3: normalize, scale and shift
+            for (i = 0; i < hidden; i++) {
+                normed_out[offset + i] = static_cast<T>((row[i] - mean) * inv_std * weight[i] + bias[i]);
+            }
+        }
+    });
+}
+
+template <typename T>
+void gatedGeluKernel(const T* gate_up, T* output, size_t rows, size_t width) {
+    const float inv_sqrt2 = 0.70710678118654752f;
+    parallelRows(rows, width, [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; r++) {
+            const T* gate = gate_up + r * 2 * width;
+            const T* up = gate + width;
+            T* out = output + r * width;
+            for (size_t i = 0; i < width; i++) {
+                float g = static_cast<float>(gate[i]);
+                float activated = 0.5f * g * (1.0f + erfApprox(g * inv_sqrt2));
+                out[i] = static_cast<T>(activated * static_cast<float>(up[i]));
+            }
+        }
+    });
+}
+
+// Calls fn with a null pointer of the element type matching dtype
+template <typename Fn>
+void dispatchFloat(mlx::core::Dtype dtype, Fn fn) {
+    if (dtype == mlx::core::float32) {
+        fn(static_cast<float*>(nullptr));
+    } else if (dtype == mlx::core::float16) {
+        fn(static_cast<mlx::core::float16_t*>(nullptr));
+    } else {
+        fn(static_cast<mlx::core::bfloat16_t*>(nullptr));
+    }
+}
+
+class AddLayerNorm : public mlx::core::Primitive {
+public:
+    AddLayerNorm(mlx::core::Stream stream, float eps)
+        : mlx::core::Primitive(stream), eps_(eps) {
+    }
+
+    void eval_cpu(const std::vector<mlx::core::array>& inputs, std::vector<mlx::core::array>& outputs) override {
+        auto& encoder = mlx::core::cpu::get_command_encoder(stream());
+        for (const auto& input : inputs) {
+            encoder.set_input_array(input);
+        }
+        for (auto& output : outputs) {
+            output.set_data(mlx::core::allocator::malloc(output.nbytes()));
+            encoder.set_output_array(output);
+        }
+
+        size_t hidden = inputs[0].shape(-1);
+        size_t rows = inputs[0].size() / hidden;
+        float eps = eps_;
+        dispatchFloat(inputs[0].dtype(), [&](auto* tag) {
+            using T = std::remove_pointer_t<decltype(tag)>;
+            encoder.dispatch([x = inputs[0].data<T>(), residual = inputs[1].data<T>(),
+                              weight = inputs[2].data<float>(), bias = inputs[3].data<float>(),
+                              sum = outputs[0].data<T>(), normed = outputs[1].data<T>(),
+                              rows, hidden, eps]() {
+                addLayerNormKernel(x, residual, weight, bias, sum, normed, rows, hidden, eps);
+            });
+        });
+    }
+
+    void eval_gpu(const std::vector<mlx::core::array>&, std::vector<mlx::core::array>&) override {
+        throw std::runtime_error("AddLayerNorm has no GPU implementation");
+    }
+
+    const char* name() const override {
+        return "AddLayerNorm";
+    }
+
+    bool is_equivalent(const mlx::core::Primitive& other) const override {
+        return eps_ == static_cast<const AddLayerNorm&>(other).eps_;
+    }
+
+private:
+    float eps_;
+};
+
+class GatedGelu : public mlx::core::Primitive {
+public:
+    explicit GatedGelu(mlx::core::Stream stream)
+        : mlx::core::Primitive(stream) {
+    }
+
+    void eval_cpu(const std::vector<mlx::core::array>& inputs, std::vector<mlx::core::array>& outputs) override {
+        auto& output = outputs[0];
+        output.set_data(mlx::core::allocator::malloc(output.nbytes()));
+
+        auto& encoder = mlx::core::cpu::get_command_encoder(stream());
+        encoder.set_input_array(inputs[0]);
+        encoder.set_output_array(output);
+
+        size_t width = output.shape(-1);
+        size_t rows = output.size() / width;
+        dispatchFloat(output.dtype(), [&](auto* tag) {
+            using T = std::remove_pointer_t<decltype(tag)>;
+            encoder.dispatch([gate_up = inputs[0].data<T>(), out = output.data<T>(), rows, width]() {
+                gatedGeluKernel(gate_up, out, rows, width);
+            });
+        });
+    }
+
+    void eval_gpu(const std::vector<mlx::core::array>&, std::vector<mlx::core::array>&) override {
+        throw std::runtime_error("GatedGelu has no GPU implementation");
+    }
+
+    const char* name() const override {
+        return "GatedGelu";
+    }
+
+    bool is_equivalent(const mlx::core::Primitive&) const override {
+        return true;
+    }
+};
+
+void checkFloatDtype(mlx::core::Dtype dtype, const char* op) {
+    if (dtype != mlx::core::float32 && dtype != mlx::core::float16 && dtype != mlx::core::bfloat16) {
+        throw std::invalid_argument(std::string(op) + " needs float32, float16 or bfloat16 inputs");
+    }
+}
+
+} // namespace
+
+std::pair<mlx::core::array, mlx::core::array> addLayerNorm(
+    const mlx::core::array& x,
+    const mlx::core::array& residual,
+    const mlx::core::array& weight,
+    const mlx::core::array& bias,
+    float eps) {
+
+    if (x.shape() != residual.shape() || x.dtype() != residual.dtype()) {
+        throw std::invalid_argument("addLayerNorm inputs must have the same shape and dtype");
+    }
+    checkFloatDtype(x.dtype(), "addLayerNorm");
+
+    int hidden = x.shape(-1);
+    if (weight.size() != static_cast<size_t>(hidden) || bias.size() != static_cast<size_t>(hidden)) {
+        throw std::invalid_argument("addLayerNorm weight and bias must have the hidden size");
+    }
+
+    auto outputs = mlx::core::array::make_arrays(
+        {x.shape(), x.shape()},
+        {x.dtype(), x.dtype()},
+        std::make_shared<AddLayerNorm>(mlx::core::to_stream(mlx::core::Device::cpu), eps),
+        {mlx::core::contiguous(x),
+         mlx::core::contiguous(residual),
+         mlx::core::contiguous(mlx::core::astype(weight, mlx::core::float32)),
+         mlx::core::contiguous(mlx::core::astype(bias, mlx::core::float32))});
+    return {outputs[0], outputs[1]};
+}
+
+mlx::core::array gatedGelu(const mlx::core::array& gate_up) {
+    checkFloatDtype(gate_up.dtype(), "gatedGelu");
+    if (gate_up.shape(-1) % 2 != 0) {
+        throw std::invalid_argument("gatedGelu needs an even last dimension");
+    }
+
+    auto shape = gate_up.shape();
+    shape.back() /= 2;
+    return mlx::core::array(
+        shape,
+        gate_up.dtype(),
+        std::make_shared<GatedGelu>(mlx::core::to_stream(mlx::core::Device::cpu)),
+        {mlx::core::contiguous(gate_up)});
+}
+
+bool fusedOpsAvailable() {
+    return mlx::core::default_device() == mlx::core::Device::cpu;
+}
+
+FusedTraffic estimateFusedTraffic(int64_t hidden_size, int64_t intermediate_size, mlx::core::Dtype dtype) {
+    size_t element = dtype.size();
+    size_t hidden = hidden_size;
+    size_t width = intermediate_size;
+
+    FusedTraffic traffic;
+
+    // add (2 reads, 1 write), layer_norm over float32 (1 read, 1 write) and,
+    // for half precision, the casts to and from float32
+    traffic.unfused_bytes += 3 * hidden * element + 2 * hidden * 4;
+    if (element != 4) {
+        traffic.unfused_bytes += 2 * (hidden * element + hidden * 4);
+    }
+    // Fused: x and residual read once, sum and normed written once
+    traffic.fused_bytes += 4 * hidden * element;
+
+    // gelu (1 read, 1 write) and multiply (2 reads, 1 write)
+    traffic.unfused_bytes += 5 * width * element;
+    // Fused: gate and up read once, product written once
+    traffic.fused_bytes += 3 * width * element;
+
+    return traffic;
+}
+
+} // namespace mlx_transformer
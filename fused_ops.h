@@ -0,0 +1,45 @@
+#pragma once
+
+#include <utility>
+#include <mlx/array.h>
+
+namespace mlx_transformer {
+
+// Fused elementwise CPU primitives for the transformer block. Each replaces a
+// chain of MLX ops that would otherwise make one full pass over memory, and
+// one temporary, per op.
+
+// residual + x and layer_norm(residual + x) in one pass over each row: both
+// inputs are read once and both outputs written once. x and residual share a
+// dtype and a shape [..., hidden]; weight and bias are float32 [hidden]. The
+// sum is rounded to the input dtype before normalizing, like the unfused
+// path, and the statistics are computed in float32.
+std::pair<mlx::core::array, mlx::core::array> addLayerNorm(
+    const mlx::core::array& x,
+    const mlx::core::array& residual,
+    const mlx::core::array& weight,
+    const mlx::core::array& bias,
+    float eps);
+
+// gelu(gate) * up for the fused gate/up projection output [..., 2 * n],
+// whose first half is the gate and second half the up projection. Returns
+// [..., n] without materializing either half or the activation.
+mlx::core::array gatedGelu(const mlx::core::array& gate_up);
+
+// Whether the fused primitives can run on the default device; they have no
+// GPU kernels
+bool fusedOpsAvailable();
+
+// Bytes per token that one layer's residual+norm and gated activation move
+// through memory, unfused and fused. Each unfused op is counted as a single
+// read of its inputs and write of its output, so the saving is a lower bound.
+struct FusedTraffic {
+    size_t unfused_bytes = 0;
+    size_t fused_bytes = 0;
+
+    size_t savedBytes() const { return unfused_bytes - fused_bytes; }
+};
+
+FusedTraffic estimateFusedTraffic(int64_t hidden_size, int64_t intermediate_size, mlx::core::Dtype dtype);
+
+} // namespace mlx_transformer
@@ -1,19 +1,62 @@
 #include "inference_pipeline.h"
 
+#include <mlx/ops.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <iostream>
+#include <memory>
 #include <cstring>
+#include <filesystem>
+#include <numeric>
+#include <stdexcept>
+
+#include "kv_snapshot.h"
 
 namespace mlx_transformer {
 
-InferencePipeline::InferencePipeline(const std::string& model_path, const QuantizationOptions& quant_options)
-    : loader_(model_path, quant_options),
-      model_(loader_.config()) {
+InferencePipeline::InferencePipeline(
+    const std::string& model_path,
+    const QuantizationOptions& quant_options,
+    const KVCacheOptions& kv_options,
+    ComputeDtype compute_dtype,
+    const MappingOptions& mapping_options)
+    : created_at_(std::chrono::steady_clock::now()),
+      loader_(model_path, quant_options, compute_dtype, mapping_options),
+      model_(loader_.config(), kv_options) {
+    
+    static std::atomic<int> next_id{0};
+    accounting_name_ = "pipeline" + std::to_string(next_id++);
+    
+    auto constructed = std::chrono::steady_clock::now();
     
     // Load model weights
     model_.loadWeights(loader_);
     
+    auto loaded = std::chrono::steady_clock::now();
+    
+    // Mapped weights are bound lazily; fault them in now rather than during
+    // the first request
+    auto faults_before_warmup = pageFaults().major_faults;
+    loader_.warmup();
+    major_faults_after_startup_ = pageFaults().major_faults;
+    
+    auto warm = std::chrono::steady_clock::now();
+    startup_.config_ms = loader_.loadStats().config_ms;
+    startup_.construct_ms = std::chrono::duration<double, std::milli>(constructed - created_at_).count() - startup_.config_ms;
+    startup_.load_weights_ms = std::chrono::duration<double, std::milli>(loaded - constructed).count();
+    startup_.warmup_ms = std::chrono::duration<double, std::milli>(warm - loaded).count();
+    startup_.total_ms = std::chrono::duration<double, std::milli>(warm - created_at_).count();
+    startup_.warmup_major_faults = major_faults_after_startup_ - faults_before_warmup;
+    
     // Initialize tokenizer (simplified for Phase 1)
-    // In a real implementation, this would load the tokenizer configuration
+    // In a real implementation, this would load the tokenizer configuration.
+    // The byte-level placeholder holds no tables, but it is still reported.
+    MemoryAccountant::global().record(MemoryCategory::TOKENIZER, accounting_name_ + "/tokenizer", 0);
+}
+
+InferencePipeline::~InferencePipeline() {
+    MemoryAccountant::global().release(MemoryCategory::TOKENIZER, accounting_name_ + "/tokenizer");
 }
 
 std::string InferencePipeline::generate(
@@ -22,74 +65,754 @@ std::string InferencePipeline::generate(
     float temperature,
     int top_k) {
     
+    GenerationOptions options;
+    options.max_length = max_length;
+    options.temperature = temperature;
+    options.top_k = top_k;
+    return generate(prompt, options);
+}
+
+std::string InferencePipeline::generate(const std::string& prompt, const GenerationOptions& options) {
+    return prompt + decode(prompt, options, nullptr);
+}
+
+void InferencePipeline::generate_stream(
+    const std::string& prompt,
+    std::function<void(const std::string&)> token_callback,
+    int max_length,
+    float temperature,
+    int top_k) {
+    
+    GenerationOptions options;
+    options.max_length = max_length;
+    options.temperature = temperature;
+    options.top_k = top_k;
+    generate_stream(prompt, std::move(token_callback), options);
+}
+
+void InferencePipeline::generate_stream(
+    const std::string& prompt,
+    std::function<void(const std::string&)> token_callback,
+    const GenerationOptions& options) {
+    
+    decode(prompt, options, token_callback);
+}
+
+std::string InferencePipeline::decode(
+    const std::string& prompt,
+    const GenerationOptions& options,
+    const std::function<void(const std::string&)>& token_callback) {
+    
     // Tokenize input (simplified)
     auto input_ids = tokenize(prompt);
+    const auto& eos_token_ids = options.eos_token_ids.empty() ? loader_.config().eos_token_ids : options.eos_token_ids;
     
-    // Clear KV cache before generation
-    model_.clearKVCache();
+    // Admit the session against the memory budget, keeping the cached
+    // prefix of a restored or previous session
+    int64_t reused = reusablePrefix(input_ids);
+    auto activations = beginSession(1, input_ids.size() - reused, options.max_length, reused);
+    SessionGuard session(*this);
     
-    // Generate tokens
-    std::vector<int> output_ids(input_ids.begin(), input_ids.end());
+    std::unique_ptr<JsonConstraint> constraint;
+    if (options.json) {
+        constraint = std::make_unique<JsonConstraint>(jsonGrammar(options.json_options, eos_token_ids));
+    }
+    StopStringMatcher stop_strings(options.stop);
+    std::string output;
+    auto emit = [&](const std::string& text) {
+        if (text.empty()) {
+            return;
+        }
+        output += text;
+        if (token_callback) {
+            token_callback(text);
+        }
+    };
+    
+    // The first step prefills the uncached part of the prompt, later steps
+    // feed only the previously sampled token and reuse the KV cache
+    std::vector<int> step_ids(input_ids.begin() + reused, input_ids.end());
     
-    for (int i = 0; i < max_length; i++) {
+    finish_reason_ = FinishReason::LENGTH;
+    for (int i = 0; i < options.max_length; i++) {
+        // Checked before each step, so an abandoned request never starts
+        // another forward pass, including the prefill
+        if (options.cancellation && options.cancellation->cancelled()) {
+            finish_reason_ = FinishReason::CANCELLED;
+            break;
+        }
+        if (std::chrono::steady_clock::now() >= options.deadline) {
+            finish_reason_ = FinishReason::DEADLINE;
+            break;
+        }
+        
         // Convert to MLX array
-        auto input_array = mlx::core::array(output_ids, mlx::core::int32);
+        auto input_array = mlx::core::array(step_ids, mlx::core::int32);
         input_array = mlx::core::reshape(input_array, {1, -1});  // Add batch dimension
         
-        // Generate next token
-        auto next_token = model_.generate_next_token(input_array, temperature, top_k);
+        // Generate next token, restricted to what keeps the output valid
+        auto allowed = constraint ? constraint->allowedTokens() : mlx::core::array();
+        auto next_token = model_.generate_next_token(
+            input_array, options.temperature, options.top_k, {}, allowed);
         
-        // Convert to scalar and add to output
+        // Convert to scalar
         int token_id = static_cast<int>(mlx::core::item<int>(next_token));
-        output_ids.push_back(token_id);
+        session_tokens_.insert(session_tokens_.end(), step_ids.begin(), step_ids.end());
+        step_ids = {token_id};
         
-        // Check for end of sequence token (simplified)
-        if (token_id == 2) {  // Assuming 2 is EOS token
+        if (std::find(eos_token_ids.begin(), eos_token_ids.end(), token_id) != eos_token_ids.end()) {
+            finish_reason_ = FinishReason::EOS;
             break;
         }
+        if (constraint) {
+            constraint->accept(token_id);
+        }
+        
+        // Text that may be the start of a stop string is held back until
+        // the following tokens decide it
+        stop_strings.feed(detokenize({token_id}));
+        emit(stop_strings.release());
+        if (stop_strings.matched()) {
+            finish_reason_ = FinishReason::STOP_STRING;
+            break;
+        }
+    }
+    
+    if (finish_reason_ == FinishReason::CANCELLED) {
+        // Nobody will continue this session; hand its KV memory back now
+        releaseSession();
+        return output;
     }
     
-    // Detokenize output (simplified)
-    return detokenize(output_ids);
+    emit(stop_strings.flush());
+    return output;
 }
 
-void InferencePipeline::generate_stream(
+std::shared_ptr<JsonGrammar> InferencePipeline::jsonGrammar(
+    const JsonGrammarOptions& options,
+    const std::vector<int>& eos_token_ids) {
+    
+    if (json_grammar_ &&
+        json_grammar_->options().require_object == options.require_object &&
+        json_grammar_->options().max_depth == options.max_depth &&
+        json_grammar_->options().max_cached_states == options.max_cached_states &&
+        json_grammar_->eosTokenIds() == eos_token_ids) {
+        return json_grammar_;
+    }
+    
+    // The trie and the per-state masks depend only on the vocabulary, so
+    // they are built once and shared by every constrained request
+    std::vector<std::string> token_texts(loader_.config().vocab_size);
+    for (size_t id = 0; id < token_texts.size(); id++) {
+        token_texts[id] = detokenize({static_cast<int>(id)});
+    }
+    json_grammar_ = std::make_shared<JsonGrammar>(token_texts, eos_token_ids, options);
+    return json_grammar_;
+}
+
+std::vector<std::string> InferencePipeline::generate_batch(
+    const std::vector<std::string>& prompts,
+    int max_length,
+    float temperature,
+    int top_k,
+    int max_batch_size) {
+    
+    if (max_batch_size < 1) {
+        throw std::invalid_argument("max_batch_size must be at least 1");
+    }
+    
+    std::vector<std::vector<int>> input_ids;
+    input_ids.reserve(prompts.size());
+    for (const auto& prompt : prompts) {
+        input_ids.push_back(tokenize(prompt));
+    }
+    
+    // Bucket by length: neighbours in sorted order pad to almost nothing
+    std::vector<size_t> order(prompts.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return input_ids[a].size() < input_ids[b].size();
+    });
+    
+    std::vector<std::string> results(prompts.size());
+    batch_tokens_generated_.assign(prompts.size(), 0);
+    for (size_t start = 0; start < order.size(); start += max_batch_size) {
+        size_t end = std::min(order.size(), start + static_cast<size_t>(max_batch_size));
+        
+        std::vector<std::vector<int>> bucket;
+        for (size_t i = start; i < end; i++) {
+            bucket.push_back(input_ids[order[i]]);
+        }
+        
+        auto generated = generateBucket(bucket, max_length, temperature, top_k);
+        for (size_t i = start; i < end; i++) {
+            auto output_ids = bucket[i - start];
+            output_ids.insert(output_ids.end(), generated[i - start].begin(), generated[i - start].end());
+            results[order[i]] = detokenize(output_ids);
+            batch_tokens_generated_[order[i]] = static_cast<int64_t>(generated[i - start].size());
+        }
+    }
+    
+    return results;
+}
+
+std::vector<std::vector<int>> InferencePipeline::generateBucket(
+    const std::vector<std::vector<int>>& prompts,
+    int max_length,
+    float temperature,
+    int top_k) {
+    
+    int batch_size = static_cast<int>(prompts.size());
+    size_t prompt_length = 0;
+    for (const auto& prompt : prompts) {
+        prompt_length = std::max(prompt_length, prompt.size());
+    }
+    
+    // Left-pad so every row's last prompt token sits in the last column and
+    // the sampled tokens of all rows line up
+    std::vector<int> ids(batch_size * prompt_length, 0);
+    std::vector<int> padding(batch_size * prompt_length, 0);
+    for (int b = 0; b < batch_size; b++) {
+        size_t pad = prompt_length - prompts[b].size();
+        for (size_t i = 0; i < prompts[b].size(); i++) {
+            ids[b * prompt_length + pad + i] = prompts[b][i];
+            padding[b * prompt_length + pad + i] = 1;
+        }
+    }
+    
+    auto activations = beginSession(batch_size, prompt_length, max_length);
+    SessionGuard session(*this);
+    
+    int step_length = static_cast<int>(prompt_length);
+    auto input_array = mlx::core::array(ids.begin(), {batch_size, step_length}, mlx::core::int32);
+    auto padding_mask = mlx::core::array(padding.begin(), {batch_size, step_length}, mlx::core::int32);
+    
+    // Rows still generating, as indices into `prompts`
+    std::vector<int> active(batch_size);
+    std::iota(active.begin(), active.end(), 0);
+    std::vector<std::vector<int>> generated(batch_size);
+    const auto& kv_options = model_.kvCache().options();
+    
+    for (int i = 0; i < max_length && !active.empty(); i++) {
+        auto next_token = model_.generate_next_token(input_array, temperature, top_k, padding_mask);
+        next_token = mlx::core::astype(next_token, mlx::core::int32);
+        next_token.eval();
+        const int32_t* tokens = next_token.data<int32_t>();
+        
+        // Record each row's token and note which rows keep going
+        std::vector<int> keep;
+        std::vector<int> still_active;
+        std::vector<int> step_ids;
+        for (size_t row = 0; row < active.size(); row++) {
+            int token_id = tokens[row];
+            generated[active[row]].push_back(token_id);
+            if (!isEos(token_id) && i + 1 < max_length) {
+                keep.push_back(static_cast<int>(row));
+                still_active.push_back(active[row]);
+                step_ids.push_back(token_id);
+            }
+        }
+        
+        if (still_active.empty()) {
+            break;
+        }
+        
+        // Retire finished rows so later steps only compute live sequences
+        if (still_active.size() < active.size()) {
+            auto rows = mlx::core::array(keep.begin(), {static_cast<int>(keep.size())}, mlx::core::int32);
+            model_.selectBatch(rows);
+            padding_mask = mlx::core::take(padding_mask, rows, 0);
+        }
+        active = std::move(still_active);
+        
+        int rows = static_cast<int>(active.size());
+        input_array = mlx::core::array(step_ids.begin(), {rows, 1}, mlx::core::int32);
+        padding_mask = mlx::core::concatenate({padding_mask, mlx::core::ones({rows, 1}, mlx::core::int32)}, 1);
+        
+        // A bounded cache keeps only its sinks and window, so drop the columns
+        // of evicted positions instead of growing the mask with every step
+        int columns = padding_mask.shape()[1];
+        if (kv_options.bounded() && columns > kv_options.capacity()) {
+            int sinks = static_cast<int>(kv_options.sink_tokens);
+            int window = static_cast<int>(kv_options.window_size);
+            padding_mask = mlx::core::concatenate({
+                mlx::core::slice(padding_mask, {0, 0}, {rows, sinks}),
+                mlx::core::slice(padding_mask, {0, columns - window}, {rows, columns})
+            }, 1);
+        }
+    }
+    
+    return generated;
+}
+
+mlx::core::array InferencePipeline::prefillShared(
+    const std::vector<int>& input_ids,
+    int num_rows,
+    int decode_rows,
+    int max_length) {
+    
+    if (input_ids.empty()) {
+        throw std::invalid_argument("Prompt must not be empty");
+    }
+    
+    // Admit one copy of the prompt, then the per-row growth after forking
+    auto activations = beginSession(1, input_ids.size(), 0);
+    
+    int prompt_length = static_cast<int>(input_ids.size());
+    auto logits = model_.forward(
+        mlx::core::array(input_ids.begin(), {1, prompt_length}, mlx::core::int32),
+        {}, true, LogitsMode::LAST);
+    logits = mlx::core::squeeze(logits, 1);
+    logits.eval();
+    
+    model_.forkKVCache(num_rows);
+    kv_reservation_.resize(
+        model_.estimateKVCacheBytes(1, prompt_length) + model_.estimateKVCacheBytes(decode_rows, max_length));
+    return logits;
+}
+
+std::vector<std::string> InferencePipeline::generate_n(
     const std::string& prompt,
-    std::function<void(const std::string&)> token_callback,
+    int n,
     int max_length,
     float temperature,
     int top_k) {
     
-    // Tokenize input (simplified)
+    if (n < 1) {
+        throw std::invalid_argument("n must be at least 1");
+    }
+    
     auto input_ids = tokenize(prompt);
+    SessionGuard session(*this);
+    auto logits = prefillShared(input_ids, n, n, max_length);
     
-    // Clear KV cache before generation
-    model_.clearKVCache();
+    // Independent draws for every row from the shared last-position logits
+    auto next_token = model_.sample(
+        mlx::core::broadcast_to(logits, {n, logits.shape()[1]}), temperature, top_k);
     
-    // Generate tokens
-    std::vector<int> output_ids(input_ids.begin(), input_ids.end());
+    std::vector<int> active(n);
+    std::iota(active.begin(), active.end(), 0);
+    std::vector<std::vector<int>> generated(n);
     
-    for (int i = 0; i < max_length; i++) {
-        // Convert to MLX array
-        auto input_array = mlx::core::array({output_ids.back()}, mlx::core::int32);
-        input_array = mlx::core::reshape(input_array, {1, 1});  // Add batch dimension
+    for (int i = 0; i < max_length && !active.empty(); i++) {
+        next_token = mlx::core::astype(next_token, mlx::core::int32);
+        next_token.eval();
+        const int32_t* tokens = next_token.data<int32_t>();
+        
+        std::vector<int> keep;
+        std::vector<int> still_active;
+        std::vector<int> step_ids;
+        for (size_t row = 0; row < active.size(); row++) {
+            int token_id = tokens[row];
+            generated[active[row]].push_back(token_id);
+            if (!isEos(token_id) && i + 1 < max_length) {
+                keep.push_back(static_cast<int>(row));
+                still_active.push_back(active[row]);
+                step_ids.push_back(token_id);
+            }
+        }
+        if (still_active.empty()) {
+            break;
+        }
         
-        // Generate next token
-        auto next_token = model_.generate_next_token(input_array, temperature, top_k);
+        // Retiring rows only drops block references
+        if (still_active.size() < active.size()) {
+            model_.selectBatch(mlx::core::array(keep.begin(), {static_cast<int>(keep.size())}, mlx::core::int32));
+        }
+        active = std::move(still_active);
         
-        // Convert to scalar and add to output
-        int token_id = static_cast<int>(mlx::core::item<int>(next_token));
-        output_ids.push_back(token_id);
+        auto input_array = mlx::core::array(step_ids.begin(), {static_cast<int>(active.size()), 1}, mlx::core::int32);
+        next_token = model_.generate_next_token(input_array, temperature, top_k);
+    }
+    
+    kv_bytes_saved_ = model_.kvCacheIndependentBytes() - model_.kvCacheBytes();
+    
+    std::vector<std::string> results;
+    for (const auto& tokens : generated) {
+        std::vector<int> output_ids = input_ids;
+        output_ids.insert(output_ids.end(), tokens.begin(), tokens.end());
+        results.push_back(detokenize(output_ids));
+    }
+    return results;
+}
+
+std::vector<BeamResult> InferencePipeline::beam_search(
+    const std::string& prompt,
+    int num_beams,
+    int max_length) {
+    
+    if (num_beams < 1) {
+        throw std::invalid_argument("num_beams must be at least 1");
+    }
+    
+    auto input_ids = tokenize(prompt);
+    SessionGuard session(*this);
+    // One row until the first step selects the beams, then num_beams rows
+    // grow and decode together for the rest of the search
+    auto logits = prefillShared(input_ids, 1, num_beams, max_length);
+    MemoryReservation activations(
+        MemoryCategory::ACTIVATIONS,
+        accounting_name_ + "/activations",
+        model_.estimateActivationBytes(num_beams, 1, static_cast<int64_t>(input_ids.size()) + max_length));
+    
+    struct Beam {
+        std::vector<int> tokens;
+        double logprob;
+    };
+    std::vector<Beam> beams = {{{}, 0.0}};
+    std::vector<Beam> finished;
+    
+    for (int step = 0; step < max_length && !beams.empty(); step++) {
+        // Candidate scores: each beam's total plus the log-softmax of its next
+        // token, over the flattened [beams * vocab] grid
+        int vocab_size = logits.shape()[1];
+        std::vector<float> beam_scores;
+        for (const auto& beam : beams) {
+            beam_scores.push_back(static_cast<float>(beam.logprob));
+        }
+        auto totals = mlx::core::add(
+            mlx::core::subtract(logits, mlx::core::logsumexp(logits, -1, true)),
+            mlx::core::reshape(
+                mlx::core::array(beam_scores.begin(), {static_cast<int>(beams.size())}, mlx::core::float32),
+                {static_cast<int>(beams.size()), 1}));
+        totals = mlx::core::reshape(totals, {-1});
+        
+        // Twice the beam count, so that after EOS candidates are set aside
+        // there are still num_beams live extensions
+        int k = std::min<int>(2 * num_beams, totals.size());
+        auto candidates = mlx::core::slice(
+            mlx::core::argpartition(mlx::core::negative(totals), k - 1, 0), {0}, {k});
+        auto candidate_scores = mlx::core::take(totals, candidates, 0);
+        candidates = mlx::core::astype(candidates, mlx::core::int32);
+        mlx::core::eval({candidates, candidate_scores});
+        
+        std::vector<std::pair<float, int>> ranked;
+        for (int c = 0; c < k; c++) {
+            ranked.push_back({candidate_scores.data<float>()[c], candidates.data<int32_t>()[c]});
+        }
+        std::sort(ranked.begin(), ranked.end(), std::greater<>());
         
-        // Detokenize and send to callback
-        std::string token_text = detokenize({token_id});
-        token_callback(token_text);
+        // Refill num_beams live beams from the best non-EOS extensions. An
+        // EOS candidate only finishes if it ranks within the top num_beams;
+        // at max_length the top num_beams candidates all finish.
+        bool last_step = step + 1 == max_length;
+        std::vector<Beam> next_beams;
+        std::vector<int> parents;
+        std::vector<int> step_ids;
+        for (size_t rank = 0; rank < ranked.size() && static_cast<int>(next_beams.size()) < num_beams; rank++) {
+            auto [score, flat_index] = ranked[rank];
+            int parent = flat_index / vocab_size;
+            int token_id = flat_index % vocab_size;
+            Beam beam{beams[parent].tokens, score};
+            beam.tokens.push_back(token_id);
+            
+            if (isEos(token_id) || last_step) {
+                if (static_cast<int>(rank) < num_beams) {
+                    finished.push_back(std::move(beam));
+                }
+            } else {
+                next_beams.push_back(std::move(beam));
+                parents.push_back(parent);
+                step_ids.push_back(token_id);
+            }
+        }
+        beams = std::move(next_beams);
         
-        // Check for end of sequence token (simplified)
-        if (token_id == 2) {  // Assuming 2 is EOS token
+        // Keep the num_beams best hypotheses. Scores only decrease as beams
+        // grow, so once no live beam beats the worst of them the search is done.
+        std::sort(finished.begin(), finished.end(), [](const Beam& a, const Beam& b) {
+            return a.logprob > b.logprob;
+        });
+        if (static_cast<int>(finished.size()) > num_beams) {
+            finished.resize(num_beams);
+        }
+        if (beams.empty() ||
+            (static_cast<int>(finished.size()) == num_beams && beams.front().logprob <= finished.back().logprob)) {
             break;
         }
+        
+        // Beams that share a parent share all of its blocks until they append
+        model_.selectBatch(mlx::core::array(parents.begin(), {static_cast<int>(parents.size())}, mlx::core::int32));
+        auto logits_3d = model_.forward(
+            mlx::core::array(step_ids.begin(), {static_cast<int>(step_ids.size()), 1}, mlx::core::int32),
+            {}, true, LogitsMode::LAST);
+        logits = mlx::core::squeeze(logits_3d, 1);
+    }
+    
+    kv_bytes_saved_ = model_.kvCacheIndependentBytes() - model_.kvCacheBytes();
+    
+    std::vector<BeamResult> results;
+    for (const auto& beam : finished) {
+        std::vector<int> output_ids = input_ids;
+        output_ids.insert(output_ids.end(), beam.tokens.begin(), beam.tokens.end());
+        results.push_back({detokenize(output_ids), beam.logprob});
     }
+    return results;
+}
+
+std::vector<ScoreResult> InferencePipeline::score(
+    const std::string& prompt,
+    const std::vector<std::string>& continuations) {
+    
+    auto prompt_ids = tokenize(prompt);
+    if (prompt_ids.empty()) {
+        throw std::invalid_argument("Scoring needs a non-empty prompt");
+    }
+    
+    std::vector<std::vector<int>> candidates;
+    size_t max_length = 0;
+    for (const auto& continuation : continuations) {
+        candidates.push_back(tokenize(continuation));
+        max_length = std::max(max_length, candidates.back().size());
+    }
+    
+    std::vector<ScoreResult> results(candidates.size());
+    if (max_length == 0) {
+        return results;
+    }
+    
+    int batch_size = static_cast<int>(candidates.size());
+    auto activations = beginSession(batch_size, prompt_ids.size(), max_length);
+    SessionGuard session(*this);
+    
+    // Prefill everything but the last prompt token once, then fan the cache
+    // out to one row per candidate
+    int prefix_length = static_cast<int>(prompt_ids.size()) - 1;
+    if (prefix_length > 0) {
+        auto prefix = mlx::core::array(prompt_ids.begin(), {1, prefix_length}, mlx::core::int32);
+        model_.forwardHidden(prefix, {}, true).eval();
+    }
+    model_.selectBatch(mlx::core::zeros({batch_size}, mlx::core::int32));
+    
+    // Each row is [last prompt token, continuation...], right-padded; the
+    // last prompt token's logits score the first continuation token
+    int row_length = static_cast<int>(max_length) + 1;
+    std::vector<int> ids(batch_size * row_length, 0);
+    std::vector<int> padding(batch_size * (prefix_length + row_length), 1);
+    for (int b = 0; b < batch_size; b++) {
+        ids[b * row_length] = prompt_ids.back();
+        for (int i = 0; i < row_length - 1; i++) {
+            if (i < static_cast<int>(candidates[b].size())) {
+                ids[b * row_length + 1 + i] = candidates[b][i];
+            } else {
+                padding[b * (prefix_length + row_length) + prefix_length + 1 + i] = 0;
+            }
+        }
+    }
+    
+    auto logprobs = model_.scoreTokens(
+        mlx::core::array(ids.begin(), {batch_size, row_length}, mlx::core::int32),
+        mlx::core::array(padding.begin(), {batch_size, prefix_length + row_length}, mlx::core::int32),
+        true);
+    logprobs.eval();
+    const float* values = logprobs.data<float>();
+    
+    for (int b = 0; b < batch_size; b++) {
+        for (size_t i = 0; i < candidates[b].size(); i++) {
+            float logprob = values[b * max_length + i];
+            results[b].token_logprobs.push_back(logprob);
+            results[b].total_logprob += logprob;
+        }
+    }
+    
+    return results;
+}
+
+double InferencePipeline::perplexity(const std::string& text) {
+    auto input_ids = tokenize(text);
+    if (input_ids.size() < 2) {
+        throw std::invalid_argument("Perplexity needs at least two tokens");
+    }
+    
+    auto activations = beginSession(1, input_ids.size(), 0);
+    SessionGuard session(*this);
+    
+    int seq_length = static_cast<int>(input_ids.size());
+    auto logprobs = model_.scoreTokens(
+        mlx::core::array(input_ids.begin(), {1, seq_length}, mlx::core::int32));
+    auto total = mlx::core::sum(mlx::core::astype(logprobs, mlx::core::float32));
+    double mean_nll = -static_cast<double>(mlx::core::item<float>(total)) / (seq_length - 1);
+    
+    return std::exp(mean_nll);
+}
+
+std::vector<std::vector<float>> InferencePipeline::embed(
+    const std::vector<std::string>& texts,
+    const EmbeddingOptions& options) {
+    
+    if (options.batch_size < 1) {
+        throw std::invalid_argument("batch_size must be at least 1");
+    }
+    if (options.layer < -1 || options.layer >= model_.numLayers()) {
+        throw std::invalid_argument("Embedding layer index out of range: " + std::to_string(options.layer));
+    }
+    int num_layers = options.layer < 0 ? model_.numLayers() : options.layer + 1;
+    
+    std::vector<std::vector<int>> input_ids;
+    for (const auto& text : texts) {
+        input_ids.push_back(tokenize(text));
+        if (input_ids.back().empty()) {
+            throw std::invalid_argument("Cannot embed an empty text");
+        }
+    }
+    
+    // Sort by length so every batch is nearly unpadded
+    std::vector<size_t> order(texts.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return input_ids[a].size() < input_ids[b].size();
+    });
+    
+    std::vector<std::vector<float>> results(texts.size());
+    for (size_t start = 0; start < order.size(); start += options.batch_size) {
+        size_t end = std::min(order.size(), start + static_cast<size_t>(options.batch_size));
+        int batch_size = static_cast<int>(end - start);
+        int seq_length = static_cast<int>(input_ids[order[end - 1]].size());
+        
+        // Right-pad; no KV cache is involved, so padding can go last
+        std::vector<int> ids(batch_size * seq_length, 0);
+        std::vector<int> padding(batch_size * seq_length, 0);
+        std::vector<int> last_index(batch_size);
+        for (int b = 0; b < batch_size; b++) {
+            const auto& tokens = input_ids[order[start + b]];
+            std::copy(tokens.begin(), tokens.end(), ids.begin() + b * seq_length);
+            std::fill(padding.begin() + b * seq_length, padding.begin() + b * seq_length + tokens.size(), 1);
+            last_index[b] = static_cast<int>(tokens.size()) - 1;
+        }
+        
+        MemoryReservation activations(
+            MemoryCategory::ACTIVATIONS,
+            accounting_name_ + "/activations",
+            model_.estimateActivationBytes(batch_size, seq_length, 0));
+        
+        auto padding_mask = mlx::core::array(padding.begin(), {batch_size, seq_length}, mlx::core::int32);
+        auto hidden = model_.forwardHidden(
+            mlx::core::array(ids.begin(), {batch_size, seq_length}, mlx::core::int32),
+            padding_mask,
+            false,
+            num_layers);
+        // Only -1 means the model's output; an explicit index, even the
+        // last one, is that layer's raw output
+        if (options.layer < 0) {
+            hidden = model_.finalNorm(hidden);
+        }
+        hidden = mlx::core::astype(hidden, mlx::core::float32);
+        int hidden_size = hidden.shape()[2];
+        
+        mlx::core::array pooled = hidden;
+        if (options.pooling == PoolingMode::MEAN) {
+            auto weights = mlx::core::expand_dims(mlx::core::astype(padding_mask, mlx::core::float32), -1);
+            pooled = mlx::core::divide(
+                mlx::core::sum(mlx::core::multiply(hidden, weights), 1),
+                mlx::core::sum(weights, 1));
+        } else {
+            auto index = mlx::core::broadcast_to(
+                mlx::core::reshape(mlx::core::array(last_index.begin(), {batch_size}, mlx::core::int32), {batch_size, 1, 1}),
+                {batch_size, 1, hidden_size});
+            pooled = mlx::core::squeeze(mlx::core::take_along_axis(hidden, index, 1), 1);
+        }
+        
+        if (options.normalize) {
+            auto norm = mlx::core::sqrt(mlx::core::sum(mlx::core::square(pooled), -1, true));
+            pooled = mlx::core::divide(pooled, mlx::core::maximum(norm, mlx::core::array(1e-12f)));
+        }
+        
+        pooled.eval();
+        const float* values = pooled.data<float>();
+        for (int b = 0; b < batch_size; b++) {
+            results[order[start + b]].assign(values + b * hidden_size, values + (b + 1) * hidden_size);
+        }
+    }
+    
+    return results;
+}
+
+PipelineStats InferencePipeline::stats() const {
+    PipelineStats stats;
+    stats.memory = MemoryAccountant::global().report();
+    stats.kv_cache_bytes = model_.kvCacheBytes();
+    stats.kv_cache_positions = model_.kvCache().length();
+    stats.kv_tokens_seen = model_.kvCache().tokensSeen();
+    stats.kv_tokens_evicted = model_.kvCache().evicted();
+    stats.kv_bytes_saved = kv_bytes_saved_;
+    stats.batch_tokens_generated = batch_tokens_generated_;
+    stats.startup = startup_;
+    stats.major_faults = pageFaults().major_faults - major_faults_after_startup_;
+    stats.finish_reason = finish_reason_;
+    return stats;
+}
+
+MemoryReservation InferencePipeline::beginSession(
+    int64_t batch_size,
+    int64_t prompt_tokens,
+    int64_t max_new_tokens,
+    int64_t cached_tokens) {
+    
+    size_t kv_bytes = model_.estimateKVCacheBytes(batch_size, cached_tokens + prompt_tokens + max_new_tokens);
+    if (cached_tokens > 0) {
+        // The cached prefix stays; only the growth needs admitting
+        kv_reservation_.resize(kv_bytes);
+    } else {
+        // Drop the previous session's cache before admitting the new one
+        releaseSession();
+        kv_reservation_ = MemoryReservation(MemoryCategory::KV_CACHE, accounting_name_ + "/kv", kv_bytes);
+    }
+    
+    // The prefill step is the largest forward of the session
+    return MemoryReservation(
+        MemoryCategory::ACTIVATIONS,
+        accounting_name_ + "/activations",
+        model_.estimateActivationBytes(batch_size, prompt_tokens, cached_tokens));
+}
+
+int64_t InferencePipeline::reusablePrefix(const std::vector<int>& input_ids) const {
+    const auto& cache = model_.kvCache();
+    if (cache.empty() || cache.batchSize() != 1 ||
+        cache.tokensSeen() != static_cast<int64_t>(session_tokens_.size()) ||
+        session_tokens_.size() >= input_ids.size()) {
+        return 0;
+    }
+    if (!std::equal(session_tokens_.begin(), session_tokens_.end(), input_ids.begin())) {
+        return 0;
+    }
+    return static_cast<int64_t>(session_tokens_.size());
+}
+
+void InferencePipeline::saveSession(const std::string& path) const {
+    saveKVSnapshot(path, model_, session_tokens_);
+}
+
+void InferencePipeline::restoreSession(const std::string& path) {
+    releaseSession();
+    
+    // Admit the restored cache before it is read in
+    size_t file_bytes = std::filesystem::file_size(path);
+    kv_reservation_ = MemoryReservation(MemoryCategory::KV_CACHE, accounting_name_ + "/kv", file_bytes);
+    
+    // A snapshot that does not match the model (or is truncated) leaves
+    // nothing behind: no partial cache and no reservation
+    try {
+        session_tokens_ = loadKVSnapshot(path, model_);
+    } catch (...) {
+        releaseSession();
+        throw;
+    }
+    kv_reservation_.update(model_.kvCacheBytes());
+}
+
+void InferencePipeline::releaseSession() {
+    model_.clearKVCache();
+    kv_reservation_.reset();
+    session_tokens_.clear();
+}
+
+bool InferencePipeline::isEos(int token_id) const {
+    const auto& eos_token_ids = loader_.config().eos_token_ids;
+    return std::find(eos_token_ids.begin(), eos_token_ids.end(), token_id) != eos_token_ids.end();
+}
+
+void InferencePipeline::endSession() {
+    kv_reservation_.update(model_.kvCacheBytes());
 }
 
 std::vector<int> InferencePipeline::tokenize(const std::string& text) {
@@ -160,6 +883,19 @@ void freeGeneratedText(const char* text) {
     }
 }
 
+const char* getMemoryReport(void* model) {
+    if (!model) {
+        return nullptr;
+    }
+    
+    auto* pipeline = static_cast<InferencePipeline*>(model);
+    std::string report = pipeline->stats().memory.toString();
+    
+    char* output = new char[report.size() + 1];
+    std::strcpy(output, report.c_str());
+    return output;
+}
+
 } // extern "C"
 
 } // namespace mlx_transformer
\ No newline at end of file
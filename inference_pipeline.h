@@ -1,17 +1,127 @@
 #pragma once
 
+#include <chrono>
 #include <string>
 #include <vector>
 #include <functional>
+#include <memory>
 
+#include "json_constraint.h"
+#include "memory_accountant.h"
 #include "model_loader.h"
+#include "stopping_criteria.h"
 #include "transformer_model.h"
 
 namespace mlx_transformer {
 
+// Cold-start phases of the pipeline constructor
+struct StartupTimings {
+    double config_ms = 0.0;        // Reading config.json
+    double construct_ms = 0.0;     // Building the module structure
+    double load_weights_ms = 0.0;  // Reading, converting and binding weights
+    double warmup_ms = 0.0;        // Faulting in mapped weights
+    double total_ms = 0.0;
+    
+    // Major page faults (disk reads) while faulting in mapped weights
+    long warmup_major_faults = 0;
+};
+
+struct PipelineStats {
+    // Process-wide report from the global MemoryAccountant
+    MemoryReport memory;
+    
+    // This pipeline's KV cache
+    size_t kv_cache_bytes = 0;
+    int64_t kv_cache_positions = 0;
+    int64_t kv_tokens_seen = 0;
+    int64_t kv_tokens_evicted = 0;
+    
+    // KV bytes the last n-best or beam search session saved at its end by
+    // sharing the prompt and common blocks, compared with independent runs
+    size_t kv_bytes_saved = 0;
+    
+    // Token ids the last generate_batch call generated for each prompt, in
+    // the order of its prompts. Counts the EOS token of rows that stopped.
+    std::vector<int64_t> batch_tokens_generated;
+    
+    StartupTimings startup;
+    
+    // Major page faults since startup finished. Weights should stay resident
+    // once warm, so a growing count means they are being paged out.
+    // Process-wide, like getrusage.
+    long major_faults = 0;
+    
+    // How the last generate or generate_stream call ended
+    FinishReason finish_reason = FinishReason::LENGTH;
+};
+
+struct ScoreResult {
+    // Log-probability of each continuation token
+    std::vector<float> token_logprobs;
+    // Sum of token_logprobs: the continuation's log-likelihood
+    double total_logprob = 0.0;
+};
+
+enum class PoolingMode {
+    LAST_TOKEN,  // Hidden state of each text's last token
+    MEAN         // Mean over each text's tokens, ignoring padding
+};
+
+struct EmbeddingOptions {
+    PoolingMode pooling = PoolingMode::MEAN;
+    // Layer whose output is pooled. -1 takes the last layer after the final
+    // norm. An index takes that layer's output without the final norm (also
+    // for the last layer) and skips the remaining layers.
+    int layer = -1;
+    // L2-normalize each embedding
+    bool normalize = true;
+    // Texts per forward pass
+    int batch_size = 64;
+};
+
+struct GenerationOptions {
+    int max_length = 100;
+    float temperature = 0.7;
+    int top_k = 50;
+    
+    // Constrain the generated text to a single JSON document. Every step
+    // masks out tokens that cannot continue valid JSON, and EOS is only
+    // allowed once the document is complete, so the output is valid JSON
+    // unless max_length cuts it short.
+    bool json = false;
+    JsonGrammarOptions json_options;
+    
+    // Generation ends before any of these strings would be emitted; the stop
+    // string itself is not part of the output
+    std::vector<std::string> stop;
+    
+    // End-of-sequence tokens; empty uses the model config's eos_token_ids
+    std::vector<int> eos_token_ids;
+    
+    // Generation stops at the first step boundary after this time and
+    // returns what it has so far
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    
+    // Checked before every step. A cancelled request also drops its KV
+    // cache, so its memory goes straight back to queued requests.
+    std::shared_ptr<CancellationToken> cancellation;
+};
+
+struct BeamResult {
+    std::string text;
+    // Sum of the log-probabilities of the generated tokens
+    double logprob = 0.0;
+};
+
 class InferencePipeline {
 public:
-    InferencePipeline(const std::string& model_path, const QuantizationOptions& quant_options = {});
+    InferencePipeline(
+        const std::string& model_path,
+        const QuantizationOptions& quant_options = {},
+        const KVCacheOptions& kv_options = {},
+        ComputeDtype compute_dtype = ComputeDtype::FLOAT32,
+        const MappingOptions& mapping_options = {});
+    ~InferencePipeline();
     
     // Generate text given a prompt
     std::string generate(
@@ -20,6 +130,8 @@ public:
         float temperature = 0.7,
         int top_k = 50);
     
+    std::string generate(const std::string& prompt, const GenerationOptions& options);
+    
     // Streaming version of generate
     void generate_stream(
         const std::string& prompt,
@@ -27,10 +139,156 @@ public:
         int max_length = 100,
         float temperature = 0.7,
         int top_k = 50);
+    
+    void generate_stream(
+        const std::string& prompt,
+        std::function<void(const std::string&)> token_callback,
+        const GenerationOptions& options);
+    
+    // Offline batched generation. Prompts are sorted by length and grouped
+    // into batches of at most max_batch_size so each batch needs little
+    // left padding; finished rows are retired from the batch as they hit
+    // EOS. Results are returned in the order of `prompts`.
+    std::vector<std::string> generate_batch(
+        const std::vector<std::string>& prompts,
+        int max_length = 100,
+        float temperature = 0.7,
+        int top_k = 50,
+        int max_batch_size = 8);
+    
+    // n independent samples of one prompt. The prompt is prefilled once and
+    // its KV cache is shared by reference by all samples, which decode
+    // together as one batch.
+    std::vector<std::string> generate_n(
+        const std::string& prompt,
+        int n,
+        int max_length = 100,
+        float temperature = 0.7,
+        int top_k = 50);
+    
+    // Beam search over a shared prompt KV cache; beams fork with block-level
+    // copy-on-write. Returns at most num_beams finished beams, best first.
+    std::vector<BeamResult> beam_search(
+        const std::string& prompt,
+        int num_beams = 4,
+        int max_length = 100);
+    
+    // Scores candidate continuations of a prompt without generating. The
+    // prompt is run once and its KV cache is shared by all candidates, which
+    // are then scored together in one batched forward pass.
+    std::vector<ScoreResult> score(
+        const std::string& prompt,
+        const std::vector<std::string>& continuations);
+    
+    // exp of the mean negative log-likelihood of text's tokens after the first
+    double perplexity(const std::string& text);
+    
+    // Pooled hidden states for each text, in order, as float32 vectors of
+    // hidden_size. Runs the transformer stack only; the LM head is skipped.
+    std::vector<std::vector<float>> embed(
+        const std::vector<std::string>& texts,
+        const EmbeddingOptions& options = {});
+    
+    // Writes the current session (its KV cache and token ids) to a snapshot
+    // file, so an idle session can be released and resumed later
+    void saveSession(const std::string& path) const;
+    
+    // Restores a session saved by saveSession without re-running prefill.
+    // A following generate() whose prompt extends the restored tokens only
+    // prefills the new tokens.
+    void restoreSession(const std::string& path);
+    
+    // Drops the current session's KV cache and its memory reservation
+    void releaseSession();
+    
+    // Live memory and KV cache statistics
+    PipelineStats stats() const;
 
 private:
+    // Declared first so it is initialized before the loader starts
+    std::chrono::steady_clock::time_point created_at_;
     ModelLoader loader_;
     TransformerModel model_;
+    StartupTimings startup_;
+    long major_faults_after_startup_ = 0;
+    size_t kv_bytes_saved_ = 0;
+    std::vector<int64_t> batch_tokens_generated_;
+    FinishReason finish_reason_ = FinishReason::LENGTH;
+    
+    // Memory accounting: the KV reservation lives as long as the cache does
+    std::string accounting_name_;
+    MemoryReservation kv_reservation_;
+    
+    // Tokens whose keys/values are in the KV cache, for single-sequence
+    // sessions; empty after batched calls
+    std::vector<int> session_tokens_;
+    
+    // Compiled lazily on the first JSON-constrained request
+    std::shared_ptr<JsonGrammar> json_grammar_;
+    
+    // Admits a session against the memory budget. Throws
+    // MemoryBudgetExceeded (or waits, depending on the admission policy)
+    // when it does not fit. The KV cache is cleared unless cached_tokens
+    // positions of the current session are being reused. The returned
+    // reservation covers the session's activations.
+    MemoryReservation beginSession(
+        int64_t batch_size,
+        int64_t prompt_tokens,
+        int64_t max_new_tokens,
+        int64_t cached_tokens = 0);
+    
+    // Number of leading prompt tokens already in the KV cache. At least one
+    // token is always left to prefill, since sampling needs its logits.
+    int64_t reusablePrefix(const std::vector<int>& input_ids) const;
+    
+    // Replaces the KV estimate with the cache's actual size
+    void endSession();
+    
+    // Ends the session when a call's scope exits, including by an exception,
+    // so the KV reservation never keeps the admission estimate
+    class SessionGuard {
+    public:
+        explicit SessionGuard(InferencePipeline& pipeline) : pipeline_(pipeline) {}
+        ~SessionGuard() { pipeline_.endSession(); }
+        
+        SessionGuard(const SessionGuard&) = delete;
+        SessionGuard& operator=(const SessionGuard&) = delete;
+        
+    private:
+        InferencePipeline& pipeline_;
+    };
+    
+    // Single-sequence decode loop behind generate and generate_stream.
+    // Returns the generated text.
+    std::string decode(
+        const std::string& prompt,
+        const GenerationOptions& options,
+        const std::function<void(const std::string&)>& token_callback);
+    
+    // Whether token_id is one of the model config's EOS tokens
+    bool isEos(int token_id) const;
+    
+    // Grammar for the current vocabulary, reused while the options match
+    std::shared_ptr<JsonGrammar> jsonGrammar(
+        const JsonGrammarOptions& options,
+        const std::vector<int>& eos_token_ids);
+    
+    // Prefills a prompt once and forks the KV cache into num_rows rows. The
+    // KV reservation covers decode_rows rows of up to max_length generated
+    // positions each. Returns the float32 logits [1, vocab] of the last
+    // prompt position.
+    mlx::core::array prefillShared(
+        const std::vector<int>& input_ids,
+        int num_rows,
+        int decode_rows,
+        int max_length);
+    
+    // Generates continuations for one left-padded batch of tokenized prompts
+    std::vector<std::vector<int>> generateBucket(
+        const std::vector<std::vector<int>>& prompts,
+        int max_length,
+        float temperature,
+        int top_k);
     
     // Very simplified tokenizer for Phase 1
     std::vector<int> tokenize(const std::string& text);
@@ -46,6 +304,9 @@ extern "C" {
     // Text generation
     const char* generateText(void* model, const char* prompt, int max_length, float temperature, int top_k);
     void freeGeneratedText(const char* text);
+    
+    // Memory report, released with freeGeneratedText
+    const char* getMemoryReport(void* model);
 }
 
 } // namespace mlx_transformer
\ No newline at end of file
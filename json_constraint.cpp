@@ -0,0 +1,438 @@
+#include "json_constraint.h"
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+namespace mlx_transformer {
+
+namespace {
+
+enum Mode : uint8_t {
+    VALUE,           // Expecting a value
+    ROOT_OBJECT,     // Expecting the '{' of a top-level object
+    KEY_OR_CLOSE,    // After '{': a key or '}'
+    KEY,             // After ',' in an object: a key
+    STRING,          // Inside a string
+    ESCAPE,          // After a backslash
+    UNICODE,         // Inside \uXXXX
+    COLON,           // After a key
+    VALUE_OR_CLOSE,  // After '[': a value or ']'
+    AFTER_VALUE,     // After a value inside a container: ',' or a close
+    NUMBER,          // Inside a number
+    LITERAL,         // Inside true, false or null
+    DONE             // The top-level value is complete
+};
+
+enum NumberPart : uint8_t {
+    MINUS,       // "-"
+    ZERO,        // "0"
+    INTEGER,     // "12"
+    DOT,         // "1."
+    FRACTION,    // "1.5"
+    EXPONENT,    // "1e"
+    EXP_SIGN,    // "1e-"
+    EXP_DIGITS   // "1e5"
+};
+
+const char* const kLiterals[] = {"true", "false", "null"};
+
+bool isWhitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+bool numberComplete(uint8_t part) {
+    return part == ZERO || part == INTEGER || part == FRACTION || part == EXP_DIGITS;
+}
+
+} // namespace
+
+TokenTrie::TokenTrie(const std::vector<std::string>& token_texts) {
+    nodes_.emplace_back();
+    for (size_t id = 0; id < token_texts.size(); id++) {
+        const auto& text = token_texts[id];
+        if (text.empty()) {
+            continue;
+        }
+
+        int current = kRoot;
+        for (char c : text) {
+            auto& children = nodes_[current].children;
+            auto it = std::find_if(children.begin(), children.end(),
+                                   [c](const std::pair<char, int>& child) { return child.first == c; });
+            if (it != children.end()) {
+                current = it->second;
+            } else {
+                int next = static_cast<int>(nodes_.size());
+                children.push_back({c, next});
+                nodes_.emplace_back();
+                current = next;
+            }
+        }
+        nodes_[current].tokens.push_back(static_cast<int>(id));
+    }
+}
+
+const TokenTrie::Node& TokenTrie::node(int index) const {
+    return nodes_[index];
+}
+
+JsonGrammar::JsonGrammar(
+    const std::vector<std::string>& token_texts,
+    std::vector<int> eos_token_ids,
+    const JsonGrammarOptions& options)
+    : token_texts_(token_texts),
+      eos_token_ids_(std::move(eos_token_ids)),
+      options_(options),
+      trie_([&]() {
+          // EOS is handled separately from text
+          auto texts = token_texts;
+          for (int id : eos_token_ids_) {
+              if (id >= 0 && id < static_cast<int>(texts.size())) {
+                  texts[id].clear();
+              }
+          }
+          return TokenTrie(texts);
+      }()) {
+
+    for (const auto& text : token_texts_) {
+        long depth = 0;
+        for (char c : text) {
+            if (c == '{' || c == '[') {
+                depth++;
+            } else if (c == '}' || c == ']') {
+                depth--;
+            }
+            max_closes_ = std::max(max_closes_, static_cast<size_t>(std::max(0L, -depth)));
+            max_opens_ = std::max(max_opens_, static_cast<size_t>(std::max(0L, depth)));
+        }
+    }
+}
+
+const JsonGrammarOptions& JsonGrammar::options() const {
+    return options_;
+}
+
+JsonState JsonGrammar::initialState() const {
+    JsonState state;
+    state.mode = options_.require_object ? ROOT_OBJECT : VALUE;
+    return state;
+}
+
+bool JsonGrammar::closeValue(JsonState& state) const {
+    state.mode = state.stack.empty() ? DONE : AFTER_VALUE;
+    state.aux = 0;
+    state.pos = 0;
+    return true;
+}
+
+std::string JsonGrammar::cacheKey(const JsonState& state) const {
+    // Fields a mode does not use are left out, so states that accept the
+    // same continuations share one cached mask
+    bool uses_aux = state.mode == NUMBER || state.mode == LITERAL || state.mode == UNICODE;
+    bool in_string = state.mode == STRING || state.mode == ESCAPE || state.mode == UNICODE;
+    std::string result;
+    result.push_back(static_cast<char>(state.mode));
+    result.push_back(static_cast<char>(uses_aux ? state.aux : 0));
+    result.push_back(static_cast<char>(state.mode == LITERAL ? state.pos : 0));
+    result.push_back(in_string && state.in_key ? 1 : 0);
+
+    // A token pops at most max_closes_ brackets and then reads the next one,
+    // so deeper entries cannot change its outcome; only whether there are
+    // any does (it decides whether the document ends). The depth itself
+    // matters only when a token could open past max_depth.
+    size_t depth = state.stack.size();
+    size_t visible = std::min(depth, max_closes_ + 1);
+    result.push_back(depth > visible ? 1 : 0);
+    if (depth + max_opens_ > static_cast<size_t>(options_.max_depth)) {
+        result += std::to_string(depth);
+    }
+    result.append(state.stack, depth - visible, visible);
+    return result;
+}
+
+bool JsonGrammar::advance(JsonState& state, char c) const {
+    auto open = [&](char bracket, uint8_t mode) {
+        if (static_cast<int>(state.stack.size()) >= options_.max_depth) {
+            return false;
+        }
+        state.stack.push_back(bracket);
+        state.mode = mode;
+        return true;
+    };
+
+    switch (state.mode) {
+        case VALUE:
+        case VALUE_OR_CLOSE:
+            if (isWhitespace(c)) return true;
+            if (c == ']' && state.mode == VALUE_OR_CLOSE) {
+                state.stack.pop_back();
+                return closeValue(state);
+            }
+            if (c == '{') return open('{', KEY_OR_CLOSE);
+            if (c == '[') return open('[', VALUE_OR_CLOSE);
+            if (c == '"') {
+                state.mode = STRING;
+                state.in_key = false;
+                return true;
+            }
+            if (c == '-' || isDigit(c)) {
+                state.mode = NUMBER;
+                state.aux = c == '-' ? MINUS : (c == '0' ? ZERO : INTEGER);
+                return true;
+            }
+            for (uint8_t i = 0; i < 3; i++) {
+                if (c == kLiterals[i][0]) {
+                    state.mode = LITERAL;
+                    state.aux = i;
+                    state.pos = 1;
+                    return true;
+                }
+            }
+            return false;
+
+        case ROOT_OBJECT:
+            if (isWhitespace(c)) return true;
+            return c == '{' && open('{', KEY_OR_CLOSE);
+
+        case KEY_OR_CLOSE:
+        case KEY:
+            if (isWhitespace(c)) return true;
+            if (c == '}' && state.mode == KEY_OR_CLOSE) {
+                state.stack.pop_back();
+                return closeValue(state);
+            }
+            if (c == '"') {
+                state.mode = STRING;
+                state.in_key = true;
+                return true;
+            }
+            return false;
+
+        case STRING:
+            if (c == '"') {
+                if (state.in_key) {
+                    state.mode = COLON;
+                    state.in_key = false;
+                    return true;
+                }
+                return closeValue(state);
+            }
+            if (c == '\\') {
+                state.mode = ESCAPE;
+                return true;
+            }
+            return static_cast<unsigned char>(c) >= 0x20;
+
+        case ESCAPE:
+            if (c == 'u') {
+                state.mode = UNICODE;
+                state.aux = 4;
+                return true;
+            }
+            if (std::string("\"\\/bfnrt").find(c) != std::string::npos) {
+                state.mode = STRING;
+                return true;
+            }
+            return false;
+
+        case UNICODE:
+            if (!std::isxdigit(static_cast<unsigned char>(c))) return false;
+            if (--state.aux == 0) {
+                state.mode = STRING;
+            }
+            return true;
+
+        case COLON:
+            if (isWhitespace(c)) return true;
+            if (c == ':') {
+                state.mode = VALUE;
+                return true;
+            }
+            return false;
+
+        case AFTER_VALUE:
+            if (isWhitespace(c)) return true;
+            if (c == ',') {
+                state.mode = state.stack.back() == '{' ? KEY : VALUE;
+                return true;
+            }
+            if ((c == '}' && state.stack.back() == '{') || (c == ']' && state.stack.back() == '[')) {
+                state.stack.pop_back();
+                return closeValue(state);
+            }
+            return false;
+
+        case NUMBER: {
+            uint8_t part = state.aux;
+            if (isDigit(c)) {
+                switch (part) {
+                    case MINUS: state.aux = c == '0' ? ZERO : INTEGER; return true;
+                    case ZERO: return false;  // No leading zeros
+                    case INTEGER: return true;
+                    case DOT: state.aux = FRACTION; return true;
+                    case FRACTION: return true;
+                    case EXPONENT:
+                    case EXP_SIGN: state.aux = EXP_DIGITS; return true;
+                    case EXP_DIGITS: return true;
+                }
+            }
+            if (c == '.' && (part == ZERO || part == INTEGER)) {
+                state.aux = DOT;
+                return true;
+            }
+            if ((c == 'e' || c == 'E') && (part == ZERO || part == INTEGER || part == FRACTION)) {
+                state.aux = EXPONENT;
+                return true;
+            }
+            if ((c == '+' || c == '-') && part == EXPONENT) {
+                state.aux = EXP_SIGN;
+                return true;
+            }
+            // Any other character ends the number and is read after it
+            if (!numberComplete(part)) return false;
+            closeValue(state);
+            return advance(state, c);
+        }
+
+        case LITERAL: {
+            const char* literal = kLiterals[state.aux];
+            if (literal[state.pos] != c) return false;
+            if (literal[++state.pos] == '\0') {
+                state.pos = 0;
+                return closeValue(state);
+            }
+            return true;
+        }
+
+        case DONE:
+            // Nothing may follow the document, so generation has to stop
+            return false;
+    }
+    return false;
+}
+
+bool JsonGrammar::complete(const JsonState& state) const {
+    return state.mode == DONE ||
+        (state.mode == NUMBER && state.stack.empty() && numberComplete(state.aux));
+}
+
+mlx::core::array JsonGrammar::allowedTokens(const JsonState& state) {
+    auto key = cacheKey(state);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = mask_cache_.find(key);
+        if (it != mask_cache_.end()) {
+            return it->second;
+        }
+    }
+
+    std::vector<uint8_t> allowed(token_texts_.size(), 0);
+    JsonState walk = state;
+    collect(TokenTrie::kRoot, walk, allowed);
+    if (complete(state)) {
+        for (int id : eos_token_ids_) {
+            if (id >= 0 && id < static_cast<int>(allowed.size())) {
+                allowed[id] = 1;
+            }
+        }
+    }
+
+    // Sampling from an all-false mask would silently pick a disallowed token
+    if (std::find(allowed.begin(), allowed.end(), 1) == allowed.end()) {
+        throw std::runtime_error(
+            "No token in the vocabulary can continue the JSON document" +
+            std::string(complete(state) ? " (it is complete, but no EOS token is in the vocabulary)" : ""));
+    }
+
+    auto mask = mlx::core::array(allowed.begin(), {static_cast<int>(allowed.size())}, mlx::core::bool_);
+    mask.eval();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (mask_cache_.size() >= options_.max_cached_states) {
+        mask_cache_.clear();
+    }
+    return mask_cache_.emplace(key, mask).first->second;
+}
+
+void JsonGrammar::collect(int node, JsonState& state, std::vector<uint8_t>& allowed) const {
+    for (const auto& [c, child] : trie_.node(node).children) {
+        // One character pushes or pops at most one bracket, so saving the
+        // scalar fields and the top of the stack is enough to undo it
+        uint8_t mode = state.mode;
+        uint8_t aux = state.aux;
+        uint8_t pos = state.pos;
+        bool in_key = state.in_key;
+        size_t depth = state.stack.size();
+        char top = depth > 0 ? state.stack.back() : '\0';
+
+        if (advance(state, c)) {
+            for (int id : trie_.node(child).tokens) {
+                allowed[id] = 1;
+            }
+            collect(child, state, allowed);
+        }
+
+        state.mode = mode;
+        state.aux = aux;
+        state.pos = pos;
+        state.in_key = in_key;
+        if (state.stack.size() > depth) {
+            state.stack.pop_back();
+        } else if (state.stack.size() < depth) {
+            state.stack.push_back(top);
+        }
+    }
+}
+
+const std::string& JsonGrammar::tokenText(int token_id) const {
+    return token_texts_.at(token_id);
+}
+
+bool JsonGrammar::isEos(int token_id) const {
+    return std::find(eos_token_ids_.begin(), eos_token_ids_.end(), token_id) != eos_token_ids_.end();
+}
+
+const std::vector<int>& JsonGrammar::eosTokenIds() const {
+    return eos_token_ids_;
+}
+
+size_t JsonGrammar::cachedStates() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return mask_cache_.size();
+}
+
+JsonConstraint::JsonConstraint(std::shared_ptr<JsonGrammar> grammar)
+    : grammar_(std::move(grammar)), state_(grammar_->initialState()) {
+}
+
+mlx::core::array JsonConstraint::allowedTokens() {
+    return grammar_->allowedTokens(state_);
+}
+
+void JsonConstraint::accept(int token_id) {
+    if (grammar_->isEos(token_id)) {
+        if (!complete()) {
+            throw std::logic_error("End of sequence before the JSON document is complete");
+        }
+        return;
+    }
+
+    JsonState next = state_;
+    for (char c : grammar_->tokenText(token_id)) {
+        if (!grammar_->advance(next, c)) {
+            throw std::logic_error("Token " + std::to_string(token_id) + " is not allowed by the JSON grammar");
+        }
+    }
+    state_ = std::move(next);
+}
+
+bool JsonConstraint::complete() const {
+    return grammar_->complete(state_);
+}
+
+} // namespace mlx_transformer
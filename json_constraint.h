@@ -0,0 +1,125 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <mlx/array.h>
+
+namespace mlx_transformer {
+
+// Prefix tree over the text of every token in the vocabulary. Walking it
+// alongside an automaton visits each shared prefix once, so the cost of
+// finding all tokens a state accepts grows with the accepted prefixes rather
+// than with vocab_size * token_length.
+class TokenTrie {
+public:
+    // token_texts[id] is the text of token id; empty texts are skipped
+    explicit TokenTrie(const std::vector<std::string>& token_texts);
+
+    struct Node {
+        std::vector<std::pair<char, int>> children;
+        std::vector<int> tokens;  // Tokens whose text ends here
+    };
+
+    const Node& node(int index) const;
+    static constexpr int kRoot = 0;
+
+private:
+    std::vector<Node> nodes_;
+};
+
+struct JsonGrammarOptions {
+    // Only accept an object at the top level
+    bool require_object = false;
+    // Deepest allowed nesting of objects and arrays
+    int max_depth = 32;
+    // Masks kept by the grammar; the cache is emptied when it is full
+    size_t max_cached_states = 4096;
+};
+
+// Character-level pushdown automaton for JSON text. The stack holds the open
+// '{' and '[' of enclosing containers.
+struct JsonState {
+    uint8_t mode = 0;
+    uint8_t aux = 0;     // Number part, literal index or unicode digits left
+    uint8_t pos = 0;     // Position inside a literal
+    bool in_key = false;
+    std::string stack;
+};
+
+// JSON grammar compiled against one vocabulary. Allowed-token masks are
+// computed per automaton state on first use and cached, so after warm-up a
+// decode step costs one hash lookup plus a vectorized where() on the logits.
+// States that differ only below the stack entries a single token can reach
+// share a mask.
+class JsonGrammar {
+public:
+    JsonGrammar(
+        const std::vector<std::string>& token_texts,
+        std::vector<int> eos_token_ids,
+        const JsonGrammarOptions& options = {});
+
+    const JsonGrammarOptions& options() const;
+    JsonState initialState() const;
+
+    // Feeds one character; false if it would make the text invalid
+    bool advance(JsonState& state, char c) const;
+
+    // Whether the text so far is a complete JSON document
+    bool complete(const JsonState& state) const;
+
+    // Bool [vocab] array of the tokens allowed next; EOS tokens are allowed
+    // once the document is complete. Throws if no token of the vocabulary
+    // can continue the document.
+    mlx::core::array allowedTokens(const JsonState& state);
+
+    const std::string& tokenText(int token_id) const;
+    bool isEos(int token_id) const;
+    const std::vector<int>& eosTokenIds() const;
+
+    // Number of distinct states whose masks have been computed
+    size_t cachedStates() const;
+
+private:
+    std::vector<std::string> token_texts_;
+    std::vector<int> eos_token_ids_;
+    JsonGrammarOptions options_;
+    TokenTrie trie_;
+    // The most brackets any one token's text closes (or opens) below (or
+    // above) the depth it starts at
+    size_t max_closes_ = 0;
+    size_t max_opens_ = 0;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, mlx::core::array> mask_cache_;
+
+    bool closeValue(JsonState& state) const;
+    // Mask cache key: the fields the mode uses and the part of the stack
+    // that a single token can reach
+    std::string cacheKey(const JsonState& state) const;
+    // Walks the trie from node, advancing state per character and undoing
+    // it on the way back
+    void collect(int node, JsonState& state, std::vector<uint8_t>& allowed) const;
+};
+
+// One sequence's progress through a JsonGrammar
+class JsonConstraint {
+public:
+    explicit JsonConstraint(std::shared_ptr<JsonGrammar> grammar);
+
+    // Bool [vocab] mask for the next token
+    mlx::core::array allowedTokens();
+
+    // Advances over a sampled token; throws if the grammar does not allow it
+    void accept(int token_id);
+
+    bool complete() const;
+
+private:
+    std::shared_ptr<JsonGrammar> grammar_;
+    JsonState state_;
+};
+
+} // namespace mlx_transformer
@@ -0,0 +1,296 @@
+#include "kv_cache.h"
+
+#include <mlx/ops.h>
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace mlx_transformer {
+
+KVCache::KVCache(const KVCacheOptions& options)
+    : options_(options), tokens_seen_(0), evicted_(0) {
+}
+
+const KVCacheOptions& KVCache::options() const {
+    return options_;
+}
+
+bool KVCache::empty() const {
+    return keys_.size() == 0;
+}
+
+int64_t KVCache::length() const {
+    return (empty() ? 0 : keys_.shape()[2]) + suffix_length_;
+}
+
+int64_t KVCache::tokensSeen() const {
+    return tokens_seen_;
+}
+
+int64_t KVCache::evicted() const {
+    return evicted_;
+}
+
+int64_t KVCache::retainedLength(int64_t incoming) const {
+    if (!options_.bounded()) {
+        return length();
+    }
+    int64_t room = options_.sink_tokens + std::max<int64_t>(0, options_.window_size - incoming);
+    return std::min(length(), room);
+}
+
+void KVCache::append(
+    const mlx::core::array& key,
+    const mlx::core::array& value,
+    const RotaryEmbedding& rope) {
+
+    int64_t incoming = key.shape()[2];
+    if (shared_) {
+        appendShared(key, value);
+        tokens_seen_ += incoming;
+        return;
+    }
+
+    std::vector<mlx::core::array> key_parts;
+    std::vector<mlx::core::array> value_parts;
+    if (!empty()) {
+        int64_t count = length() - retainedLength(incoming);
+        if (count > 0) {
+            evictInto(count, rope, key_parts, value_parts);
+        } else {
+            key_parts.push_back(keys_);
+            value_parts.push_back(values_);
+        }
+    }
+    key_parts.push_back(key);
+    value_parts.push_back(value);
+
+    // A single concatenation covers both the eviction and the append
+    keys_ = key_parts.size() == 1 ? key_parts[0] : mlx::core::concatenate(key_parts, 2);
+    values_ = value_parts.size() == 1 ? value_parts[0] : mlx::core::concatenate(value_parts, 2);
+    tokens_seen_ += incoming;
+}
+
+void KVCache::trim(const RotaryEmbedding& rope) {
+    if (shared_ || !options_.bounded() || length() <= options_.capacity()) {
+        return;
+    }
+
+    std::vector<mlx::core::array> key_parts;
+    std::vector<mlx::core::array> value_parts;
+    evictInto(length() - options_.capacity(), rope, key_parts, value_parts);
+    keys_ = mlx::core::concatenate(key_parts, 2);
+    values_ = mlx::core::concatenate(value_parts, 2);
+}
+
+void KVCache::reset() {
+    keys_ = mlx::core::array();
+    values_ = mlx::core::array();
+    sink_keys_ = mlx::core::array();
+    tokens_seen_ = 0;
+    evicted_ = 0;
+    shared_ = false;
+    rows_.clear();
+    suffix_length_ = 0;
+}
+
+void KVCache::selectRows(const mlx::core::array& indices) {
+    if (empty()) {
+        return;
+    }
+    if (!shared_) {
+        keys_ = mlx::core::take(keys_, indices, 0);
+        values_ = mlx::core::take(values_, indices, 0);
+        if (sink_keys_.size() != 0) {
+            sink_keys_ = mlx::core::take(sink_keys_, indices, 0);
+        }
+        return;
+    }
+
+    auto rows = mlx::core::astype(indices, mlx::core::int32);
+    rows.eval();
+    const int32_t* row_ids = rows.data<int32_t>();
+
+    std::vector<std::vector<Block>> selected;
+    for (size_t i = 0; i < rows.size(); i++) {
+        selected.push_back(rows_.at(row_ids[i]));
+    }
+    rows_ = std::move(selected);
+}
+
+void KVCache::fork(int64_t num_rows) {
+    if (options_.bounded()) {
+        throw std::invalid_argument("Shared-prefix KV caches need an unbounded cache");
+    }
+    if (shared_ || empty() || keys_.shape()[0] != 1) {
+        throw std::logic_error("Only a non-empty single-row cache can be forked");
+    }
+    shared_ = true;
+    rows_.assign(num_rows, {});
+    suffix_length_ = 0;
+}
+
+bool KVCache::shared() const {
+    return shared_;
+}
+
+int64_t KVCache::batchSize() const {
+    if (shared_) {
+        return rows_.size();
+    }
+    return empty() ? 0 : keys_.shape()[0];
+}
+
+const mlx::core::array& KVCache::prefixKeys() const {
+    return keys_;
+}
+
+const mlx::core::array& KVCache::prefixValues() const {
+    return values_;
+}
+
+int64_t KVCache::suffixLength() const {
+    return suffix_length_;
+}
+
+int64_t KVCache::suffixBlocks() const {
+    return rows_.empty() ? 0 : rows_[0].size();
+}
+
+const mlx::core::array& KVCache::suffixBlockKeys(int64_t row, int64_t block) const {
+    return rows_.at(row).at(block).keys;
+}
+
+const mlx::core::array& KVCache::suffixBlockValues(int64_t row, int64_t block) const {
+    return rows_.at(row).at(block).values;
+}
+
+size_t KVCache::independentBytes() const {
+    if (!shared_) {
+        return nbytes();
+    }
+    size_t bytes = rows_.size() * (keys_.nbytes() + values_.nbytes());
+    for (const auto& row : rows_) {
+        for (const auto& block : row) {
+            bytes += block.keys.nbytes() + block.values.nbytes();
+        }
+    }
+    return bytes;
+}
+
+void KVCache::restore(
+    const mlx::core::array& keys,
+    const mlx::core::array& values,
+    int64_t tokens_seen,
+    int64_t evicted,
+    const RotaryEmbedding& rope) {
+
+    keys_ = keys;
+    values_ = values;
+    tokens_seen_ = tokens_seen;
+    evicted_ = evicted;
+    
+    // Saved sinks sit shifted by the evictions so far; recover their
+    // original rotation once so later evictions start from it
+    sink_keys_ = mlx::core::array();
+    int sinks = static_cast<int>(std::min(options_.sink_tokens, length()));
+    if (evicted_ > 0 && sinks > 0) {
+        auto shape = keys_.shape();
+        sink_keys_ = rope.shift(mlx::core::slice(keys_, {0, 0, 0, 0}, {shape[0], shape[1], sinks, shape[3]}), -evicted_);
+    }
+}
+
+const mlx::core::array& KVCache::keys() const {
+    return keys_;
+}
+
+const mlx::core::array& KVCache::values() const {
+    return values_;
+}
+
+size_t KVCache::nbytes() const {
+    if (empty()) {
+        return 0;
+    }
+    size_t bytes = keys_.nbytes() + values_.nbytes() + sink_keys_.nbytes();
+
+    // Blocks referenced by several rows are the same array
+    std::unordered_set<std::uintptr_t> seen;
+    for (const auto& row : rows_) {
+        for (const auto& block : row) {
+            if (seen.insert(block.keys.id()).second) {
+                bytes += block.keys.nbytes() + block.values.nbytes();
+            }
+        }
+    }
+    return bytes;
+}
+
+void KVCache::appendShared(const mlx::core::array& key, const mlx::core::array& value) {
+    auto shape = key.shape();
+    if (shape[0] != static_cast<int>(rows_.size())) {
+        throw std::invalid_argument("Appended batch does not match the forked rows");
+    }
+
+    for (int r = 0; r < shape[0]; r++) {
+        auto& blocks = rows_[r];
+        int position = 0;
+        while (position < shape[2]) {
+            if (blocks.empty() || blocks.back().length == options_.block_size) {
+                blocks.push_back({});
+            }
+
+            // Replacing the last block's arrays leaves any other row that
+            // shares the old block untouched
+            auto& last = blocks.back();
+            int count = static_cast<int>(std::min<int64_t>(options_.block_size - last.length, shape[2] - position));
+            mlx::core::Shape start = {r, 0, position, 0};
+            mlx::core::Shape stop = {r + 1, shape[1], position + count, shape[3]};
+            auto key_part = mlx::core::slice(key, start, stop);
+            auto value_part = mlx::core::slice(value, start, stop);
+
+            if (last.length == 0) {
+                last.keys = mlx::core::contiguous(key_part);
+                last.values = mlx::core::contiguous(value_part);
+            } else {
+                last.keys = mlx::core::concatenate({last.keys, key_part}, 2);
+                last.values = mlx::core::concatenate({last.values, value_part}, 2);
+            }
+            last.length += count;
+            position += count;
+        }
+    }
+    suffix_length_ += shape[2];
+}
+
+void KVCache::evictInto(
+    int64_t count,
+    const RotaryEmbedding& rope,
+    std::vector<mlx::core::array>& key_parts,
+    std::vector<mlx::core::array>& value_parts) {
+
+    auto shape = keys_.shape();
+    int sinks = static_cast<int>(std::min(options_.sink_tokens, length()));
+    int tail_start = sinks + static_cast<int>(count);
+
+    if (sinks > 0) {
+        // Before the first eviction the cached sinks are still at their
+        // original positions
+        if (sink_keys_.size() == 0) {
+            sink_keys_ = mlx::core::slice(keys_, {0, 0, 0, 0}, {shape[0], shape[1], sinks, shape[3]});
+        }
+        // Move the sinks forward so they stay adjacent to the surviving
+        // window. They are always rotated from the originals by the total
+        // evicted count, so rounding does not accumulate across evictions.
+        key_parts.push_back(rope.shift(sink_keys_, evicted_ + count));
+        value_parts.push_back(mlx::core::slice(values_, {0, 0, 0, 0}, {shape[0], shape[1], sinks, shape[3]}));
+    }
+    if (tail_start < shape[2]) {
+        key_parts.push_back(mlx::core::slice(keys_, {0, 0, tail_start, 0}, shape));
+        value_parts.push_back(mlx::core::slice(values_, {0, 0, tail_start, 0}, shape));
+    }
+
+    evicted_ += count;
+}
+
+} // namespace mlx_transformer
\ No newline at end of file
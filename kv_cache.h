@@ -0,0 +1,147 @@
+#pragma once
+
+#include <mlx/array.h>
+#include <vector>
+
+#include "rotary_embedding.h"
+
+namespace mlx_transformer {
+
+struct KVCacheOptions {
+    // Leading "attention sink" tokens that are never evicted
+    int64_t sink_tokens = 4;
+    // Most recent tokens kept after the sinks; 0 keeps the full history
+    int64_t window_size = 0;
+    // Positions per block when forked rows share a prefix; rows that diverge
+    // copy at most one partially filled block
+    int64_t block_size = 16;
+
+    bool bounded() const { return window_size > 0; }
+    int64_t capacity() const { return sink_tokens + window_size; }
+};
+
+// Per-layer key/value cache laid out as [batch, heads, seq, head_dim].
+//
+// In bounded mode the cache keeps the first sink_tokens positions plus a
+// sliding window of the most recent window_size positions and evicts the
+// middle. Keys are stored already rotated; on eviction the sinks are shifted
+// forward so they sit directly before the window, which keeps the relative
+// positions seen by attention identical to a contiguous cache. The shift is
+// always applied to the sinks' original rotation, by the total evicted
+// count, so half-precision rounding does not compound over long streams.
+//
+// fork() switches to shared-prefix mode for n-best sampling and beam search:
+// the positions cached so far become a single [1, heads, prefix, head_dim]
+// prefix referenced by every row, and each row appends into its own table of
+// immutable blocks. Selecting rows copies block references only; a row that
+// appends after its blocks were shared replaces just its partially filled
+// last block, so rows share everything up to the block where they diverge.
+// Sharing saves resident memory, not per-step work: attention reads the
+// per-row suffixes as one dense tensor, so every decode step gathers all
+// rows' blocks into a transient [rows, heads, suffix, head_dim] copy, the
+// same traffic as appending to an unshared cache. Only the prefix is read
+// without any per-row copy.
+class KVCache {
+public:
+    KVCache(const KVCacheOptions& options = {});
+
+    const KVCacheOptions& options() const;
+
+    bool empty() const;
+
+    // Number of cached positions
+    int64_t length() const;
+
+    // Tokens appended since the last reset, including evicted ones. This is
+    // the absolute position of the next token.
+    int64_t tokensSeen() const;
+
+    // Number of positions evicted from the middle since the last reset
+    int64_t evicted() const;
+
+    // Number of existing positions that survive appending `incoming` tokens
+    int64_t retainedLength(int64_t incoming) const;
+
+    // Appends new keys/values, evicting old window positions first so the
+    // cache does not grow past capacity
+    void append(const mlx::core::array& key, const mlx::core::array& value, const RotaryEmbedding& rope);
+
+    // Drops window positions until the cache fits its capacity again. Only
+    // needed after a prefill longer than the window.
+    void trim(const RotaryEmbedding& rope);
+
+    void reset();
+
+    // Keeps (or duplicates) the given batch rows, e.g. to retire finished
+    // sequences from a batch. In shared mode only block references move.
+    void selectRows(const mlx::core::array& indices);
+
+    // Turns a single-row cache into num_rows rows sharing it as a prefix.
+    // Needs an unbounded cache.
+    void fork(int64_t num_rows);
+
+    bool shared() const;
+    int64_t batchSize() const;
+
+    // Shared mode: the common prefix [1, heads, prefix, head_dim]
+    const mlx::core::array& prefixKeys() const;
+    const mlx::core::array& prefixValues() const;
+
+    // Shared mode: the per-row suffix as blocks [1, heads, length, head_dim],
+    // read in place. Rows append in lockstep, so block j covers the same
+    // positions in every row.
+    int64_t suffixLength() const;
+    int64_t suffixBlocks() const;
+    const mlx::core::array& suffixBlockKeys(int64_t row, int64_t block) const;
+    const mlx::core::array& suffixBlockValues(int64_t row, int64_t block) const;
+
+    // Bytes the same rows would hold as independent, unshared caches
+    size_t independentBytes() const;
+
+    // Replaces the cache contents with previously saved state; rope
+    // recovers the original rotation of the saved (shifted) sinks
+    void restore(
+        const mlx::core::array& keys,
+        const mlx::core::array& values,
+        int64_t tokens_seen,
+        int64_t evicted,
+        const RotaryEmbedding& rope);
+
+    // Dense mode only
+    const mlx::core::array& keys() const;
+    const mlx::core::array& values() const;
+
+    // Bytes actually held; shared blocks are counted once
+    size_t nbytes() const;
+
+private:
+    KVCacheOptions options_;
+    mlx::core::array keys_;
+    mlx::core::array values_;
+    int64_t tokens_seen_;
+    int64_t evicted_;
+    // Bounded mode, after the first eviction: the sink keys at their
+    // original rotation. keys_ holds them shifted by evicted_.
+    mlx::core::array sink_keys_;
+
+    // Shared mode: keys_/values_ hold the prefix, rows_ the per-row blocks
+    struct Block {
+        mlx::core::array keys;
+        mlx::core::array values;
+        int64_t length = 0;
+    };
+    bool shared_ = false;
+    std::vector<std::vector<Block>> rows_;
+    int64_t suffix_length_ = 0;
+
+    void appendShared(const mlx::core::array& key, const mlx::core::array& value);
+
+    // Collects the parts left after evicting `count` window positions
+    void evictInto(
+        int64_t count,
+        const RotaryEmbedding& rope,
+        std::vector<mlx::core::array>& key_parts,
+        std::vector<mlx::core::array>& value_parts);
+};
+
+} // namespace mlx_transformer
\ No newline at end of file
@@ -0,0 +1,166 @@
+#include "kv_snapshot.h"
+
+#include <mlx/ops.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "memory_mapped_file.h"
+
+namespace mlx_transformer {
+
+namespace {
+
+const char kMagic[8] = {'M', 'L', 'X', 'K', 'V', 'S', 'N', 'P'};
+const uint32_t kVersion = 1;
+const size_t kDataAlignment = 64;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t compute_dtype;
+    uint32_t num_layers;
+    uint32_t batch_size;
+    uint32_t num_heads;
+    uint32_t head_dim;
+    uint64_t positions;
+    uint64_t tokens_seen;
+    uint64_t evicted;
+    uint64_t num_tokens;
+};
+
+size_t dataOffset(const SnapshotHeader& header) {
+    size_t end = sizeof(SnapshotHeader) + header.num_tokens * sizeof(int32_t);
+    return (end + kDataAlignment - 1) / kDataAlignment * kDataAlignment;
+}
+
+// Copies one tensor out of the mapping into memory owned by MLX
+mlx::core::array copyTensor(const char* data, const mlx::core::Shape& shape, ComputeDtype dtype) {
+    switch (dtype) {
+        case ComputeDtype::FLOAT16:
+            return mlx::core::array(reinterpret_cast<const mlx::core::float16_t*>(data), shape, mlx::core::float16);
+        case ComputeDtype::BFLOAT16:
+            return mlx::core::array(reinterpret_cast<const mlx::core::bfloat16_t*>(data), shape, mlx::core::bfloat16);
+        default:
+            return mlx::core::array(reinterpret_cast<const float*>(data), shape, mlx::core::float32);
+    }
+}
+
+} // namespace
+
+void saveKVSnapshot(
+    const std::string& path,
+    const TransformerModel& model,
+    const std::vector<int>& tokens) {
+    
+    const auto& config = model.config();
+    const auto& first = model.kvCache();
+    if (first.empty()) {
+        throw std::runtime_error("No KV cache to save");
+    }
+    if (first.shared()) {
+        throw std::runtime_error("Forked (shared-prefix) KV caches cannot be saved");
+    }
+    
+    auto shape = first.keys().shape();
+    SnapshotHeader header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.compute_dtype = static_cast<uint32_t>(config.compute_dtype);
+    header.num_layers = static_cast<uint32_t>(config.num_hidden_layers);
+    header.batch_size = static_cast<uint32_t>(shape[0]);
+    header.num_heads = static_cast<uint32_t>(shape[1]);
+    header.positions = static_cast<uint64_t>(shape[2]);
+    header.head_dim = static_cast<uint32_t>(shape[3]);
+    header.tokens_seen = static_cast<uint64_t>(first.tokensSeen());
+    header.evicted = static_cast<uint64_t>(first.evicted());
+    header.num_tokens = tokens.size();
+    
+    std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Failed to open snapshot for writing: " + tmp_path);
+    }
+    
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    std::vector<int32_t> token_ids(tokens.begin(), tokens.end());
+    out.write(reinterpret_cast<const char*>(token_ids.data()), token_ids.size() * sizeof(int32_t));
+    
+    std::vector<char> padding(dataOffset(header) - sizeof(header) - token_ids.size() * sizeof(int32_t), 0);
+    out.write(padding.data(), padding.size());
+    
+    for (int layer = 0; layer < header.num_layers; layer++) {
+        const auto& cache = model.kvCache(layer);
+        for (auto tensor : {cache.keys(), cache.values()}) {
+            // Row-major bytes; the cache may hold strided views after eviction
+            tensor = mlx::core::contiguous(tensor);
+            tensor.eval();
+            out.write(tensor.data<char>(), tensor.nbytes());
+        }
+    }
+    
+    out.close();
+    if (!out) {
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Failed to write snapshot: " + tmp_path);
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Failed to move snapshot into place: " + path);
+    }
+}
+
+std::vector<int> loadKVSnapshot(const std::string& path, TransformerModel& model) {
+    // Read once, front to back
+    MappingOptions mapping;
+    mapping.policy = AccessPolicy::SEQUENTIAL;
+    MemoryMappedFile file(path, mapping);
+    const char* data = static_cast<const char*>(file.data());
+    
+    SnapshotHeader header;
+    if (file.size() < sizeof(header)) {
+        throw std::runtime_error("Truncated KV snapshot: " + path);
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion) {
+        throw std::runtime_error("Not a KV snapshot (or unsupported version): " + path);
+    }
+    
+    const auto& config = model.config();
+    if (header.compute_dtype != static_cast<uint32_t>(config.compute_dtype) ||
+        header.num_layers != config.num_hidden_layers ||
+        header.num_heads != config.num_attention_heads ||
+        header.head_dim != config.hidden_size / config.num_attention_heads) {
+        throw std::runtime_error("KV snapshot does not match the loaded model: " + path);
+    }
+    
+    mlx::core::Shape shape = {
+        static_cast<int>(header.batch_size),
+        static_cast<int>(header.num_heads),
+        static_cast<int>(header.positions),
+        static_cast<int>(header.head_dim)
+    };
+    size_t tensor_bytes = static_cast<size_t>(header.batch_size) * header.num_heads *
+        header.positions * header.head_dim * toMlxDtype(config.compute_dtype).size();
+    
+    size_t offset = dataOffset(header);
+    if (file.size() < offset + 2 * tensor_bytes * header.num_layers) {
+        throw std::runtime_error("Truncated KV snapshot: " + path);
+    }
+    
+    const int32_t* token_ids = reinterpret_cast<const int32_t*>(data + sizeof(header));
+    std::vector<int> tokens(token_ids, token_ids + header.num_tokens);
+    
+    for (int layer = 0; layer < header.num_layers; layer++) {
+        auto keys = copyTensor(data + offset, shape, config.compute_dtype);
+        auto values = copyTensor(data + offset + tensor_bytes, shape, config.compute_dtype);
+        model.restoreKVCache(layer, keys, values, header.tokens_seen, header.evicted);
+        offset += 2 * tensor_bytes;
+    }
+    
+    return tokens;
+}
+
+} // namespace mlx_transformer
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "transformer_model.h"
+
+namespace mlx_transformer {
+
+// Session snapshots: the KV caches of every layer plus the token ids that
+// produced them, in a flat binary file.
+//
+// Layout: a fixed header, the token ids as int32, then for each layer the
+// raw keys followed by the raw values ([batch, heads, positions, head_dim] in
+// the model's compute dtype). Tensor data starts at a 64-byte boundary.
+// Restoring is a straight copy out of the mapped file, so its cost scales
+// with the snapshot size rather than with the prefill FLOPs it replaces.
+
+// Writes the model's current KV caches and the session's tokens to path.
+// The file is written under a temporary name and renamed into place.
+void saveKVSnapshot(
+    const std::string& path,
+    const TransformerModel& model,
+    const std::vector<int>& tokens);
+
+// Replaces the model's KV caches with a snapshot and returns its tokens.
+// Throws if the snapshot was written for a different model shape or dtype.
+std::vector<int> loadKVSnapshot(const std::string& path, TransformerModel& model);
+
+} // namespace mlx_transformer
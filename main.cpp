@@ -10,26 +10,55 @@ void printToken(const std::string& token) {
 
 int main(int argc, char** argv) {
     if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <model_path> [quantization_mode]" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " <model_path> [quantization_mode] [kv_window] [fp32|fp16|bf16]" << std::endl;
         return 1;
     }
     
     std::string model_path = argv[1];
     int quantization_mode = 0;  // Default to no quantization
+    int kv_window = 0;          // Default to an unbounded KV cache
+    std::string compute_dtype = "fp32";
     
     if (argc >= 3) {
         quantization_mode = std::stoi(argv[2]);
     }
+    if (argc >= 4) {
+        kv_window = std::stoi(argv[3]);
+    }
+    if (argc >= 5) {
+        compute_dtype = argv[4];
+    }
     
     try {
         // Set up quantization options
         mlx_transformer::QuantizationOptions quant_options;
         quant_options.mode = static_cast<mlx_transformer::QuantizationMode>(quantization_mode);
         
+        // Bounded-context mode keeps 4 sink tokens plus the most recent kv_window tokens
+        mlx_transformer::KVCacheOptions kv_options;
+        kv_options.window_size = kv_window;
+        
+        // Memory budgets come from MLX_TRANSFORMER_*_BUDGET_MB
+        mlx_transformer::MemoryAccountant::global().setBudget(
+            mlx_transformer::MemoryBudget::fromEnvironment());
+        
         std::cout << "Loading model from: " << model_path << std::endl;
         
-        // Create inference pipeline
-        mlx_transformer::InferencePipeline pipeline(model_path, quant_options);
+        // Create inference pipeline; packed weights are mapped according to
+        // MLX_TRANSFORMER_MMAP_*
+        mlx_transformer::InferencePipeline pipeline(
+            model_path,
+            quant_options,
+            kv_options,
+            mlx_transformer::parseComputeDtype(compute_dtype),
+            mlx_transformer::MappingOptions::fromEnvironment());
+        
+        auto startup = pipeline.stats().startup;
+        std::cout << "Startup: config " << startup.config_ms << " ms, construct "
+                  << startup.construct_ms << " ms, load weights "
+                  << startup.load_weights_ms << " ms, warmup "
+                  << startup.warmup_ms << " ms (" << startup.warmup_major_faults
+                  << " major faults), total " << startup.total_ms << " ms" << std::endl;
         
         // Example 1: Basic text generation
         std::string prompt = "Once upon a time in a galaxy far, far away";
@@ -58,6 +87,13 @@ int main(int argc, char** argv) {
         
         std::cout << "\n\nGeneration complete!" << std::endl;
         
+        auto stats = pipeline.stats();
+        std::cout << "\nKV cache: " << stats.kv_cache_positions << " positions ("
+                  << stats.kv_tokens_seen << " tokens seen, "
+                  << stats.kv_tokens_evicted << " evicted)" << std::endl;
+        std::cout << "Major page faults since startup: " << stats.major_faults << std::endl;
+        std::cout << stats.memory.toString() << std::endl;
+        
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
@@ -0,0 +1,266 @@
+#include "memory_accountant.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+
+namespace mlx_transformer {
+
+namespace {
+
+const MemoryCategory kCategories[] = {
+    MemoryCategory::WEIGHTS,
+    MemoryCategory::KV_CACHE,
+    MemoryCategory::ACTIVATIONS,
+    MemoryCategory::TOKENIZER
+};
+
+size_t megabytesFromEnv(const char* name) {
+    const char* value = std::getenv(name);
+    if (value == nullptr || *value == '\0') {
+        return 0;
+    }
+    return static_cast<size_t>(std::stoull(value)) * 1024 * 1024;
+}
+
+std::string formatBytes(size_t bytes) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1) << bytes / (1024.0 * 1024.0) << " MB";
+    return out.str();
+}
+
+} // namespace
+
+const char* memoryCategoryName(MemoryCategory category) {
+    switch (category) {
+        case MemoryCategory::WEIGHTS: return "weights";
+        case MemoryCategory::KV_CACHE: return "kv_cache";
+        case MemoryCategory::ACTIVATIONS: return "activations";
+        case MemoryCategory::TOKENIZER: return "tokenizer";
+    }
+    return "unknown";
+}
+
+MemoryBudget MemoryBudget::fromEnvironment() {
+    MemoryBudget budget;
+    budget.total_bytes = megabytesFromEnv("MLX_TRANSFORMER_TOTAL_BUDGET_MB");
+    budget.weights_bytes = megabytesFromEnv("MLX_TRANSFORMER_WEIGHTS_BUDGET_MB");
+    budget.kv_cache_bytes = megabytesFromEnv("MLX_TRANSFORMER_KV_BUDGET_MB");
+    budget.activations_bytes = megabytesFromEnv("MLX_TRANSFORMER_ACTIVATIONS_BUDGET_MB");
+    budget.tokenizer_bytes = megabytesFromEnv("MLX_TRANSFORMER_TOKENIZER_BUDGET_MB");
+
+    const char* admission = std::getenv("MLX_TRANSFORMER_ADMISSION");
+    if (admission != nullptr && std::string(admission) == "queue") {
+        budget.admission = AdmissionPolicy::QUEUE;
+    }
+    return budget;
+}
+
+std::string MemoryReport::toString() const {
+    std::ostringstream out;
+    out << "Memory usage: " << formatBytes(total_bytes)
+        << " (peak " << formatBytes(peak_bytes) << ")";
+    if (budget.total_bytes > 0) {
+        out << " of " << formatBytes(budget.total_bytes);
+    }
+    out << "\n";
+
+    for (MemoryCategory category : kCategories) {
+        auto it = category_bytes.find(category);
+        size_t bytes = it != category_bytes.end() ? it->second : 0;
+        out << "  " << std::left << std::setw(12) << memoryCategoryName(category)
+            << formatBytes(bytes) << "\n";
+        for (const auto& entry : entries) {
+            if (entry.category == category) {
+                out << "    " << std::left << std::setw(28) << entry.name
+                    << formatBytes(entry.bytes) << "\n";
+            }
+        }
+    }
+
+    out << "  reservations queued: " << queued_reservations
+        << ", rejected: " << rejected_reservations;
+    return out.str();
+}
+
+MemoryAccountant& MemoryAccountant::global() {
+    static MemoryAccountant accountant;
+    return accountant;
+}
+
+void MemoryAccountant::setBudget(const MemoryBudget& budget) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_ = budget;
+    // A larger budget may admit queued reservations
+    released_.notify_all();
+}
+
+MemoryBudget MemoryAccountant::budget() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return budget_;
+}
+
+void MemoryAccountant::record(MemoryCategory category, const std::string& name, size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t before = total_bytes_;
+    setLocked({category, name}, bytes);
+    if (total_bytes_ < before) {
+        released_.notify_all();
+    }
+}
+
+void MemoryAccountant::reserve(MemoryCategory category, const std::string& name, size_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Key key{category, name};
+
+    auto extra = [&]() {
+        auto it = entries_.find(key);
+        size_t current = it != entries_.end() ? it->second : 0;
+        return bytes > current ? bytes - current : 0;
+    };
+
+    if (!fitsLocked(category, extra())) {
+        // A request larger than the limit itself can never be admitted
+        size_t limit = categoryLimit(category);
+        bool impossible = (limit > 0 && bytes > limit) ||
+                          (budget_.total_bytes > 0 && bytes > budget_.total_bytes);
+
+        if (budget_.admission == AdmissionPolicy::REJECT || impossible) {
+            rejected_reservations_++;
+            throw MemoryBudgetExceeded(
+                std::string("Memory budget exceeded for ") + memoryCategoryName(category) +
+                " reservation '" + name + "' of " + formatBytes(bytes));
+        }
+
+        queued_reservations_++;
+        bool admitted = released_.wait_for(lock, budget_.queue_timeout, [&]() {
+            return fitsLocked(category, extra());
+        });
+        if (!admitted) {
+            rejected_reservations_++;
+            throw MemoryBudgetExceeded(
+                std::string("Timed out waiting for ") + memoryCategoryName(category) +
+                " memory for reservation '" + name + "' of " + formatBytes(bytes));
+        }
+    }
+
+    setLocked(key, bytes);
+}
+
+void MemoryAccountant::release(MemoryCategory category, const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find({category, name});
+    if (it == entries_.end()) {
+        return;
+    }
+    category_bytes_[category] -= it->second;
+    total_bytes_ -= it->second;
+    entries_.erase(it);
+    released_.notify_all();
+}
+
+size_t MemoryAccountant::used(MemoryCategory category) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = category_bytes_.find(category);
+    return it != category_bytes_.end() ? it->second : 0;
+}
+
+size_t MemoryAccountant::used() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return total_bytes_;
+}
+
+MemoryReport MemoryAccountant::report() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    MemoryReport report;
+    for (const auto& [key, bytes] : entries_) {
+        report.entries.push_back({key.first, key.second, bytes});
+    }
+    report.category_bytes = category_bytes_;
+    report.total_bytes = total_bytes_;
+    report.peak_bytes = peak_bytes_;
+    report.queued_reservations = queued_reservations_;
+    report.rejected_reservations = rejected_reservations_;
+    report.budget = budget_;
+    return report;
+}
+
+void MemoryAccountant::setLocked(const Key& key, size_t bytes) {
+    size_t& current = entries_[key];
+    category_bytes_[key.first] += bytes;
+    category_bytes_[key.first] -= current;
+    total_bytes_ += bytes;
+    total_bytes_ -= current;
+    current = bytes;
+    peak_bytes_ = std::max(peak_bytes_, total_bytes_);
+}
+
+bool MemoryAccountant::fitsLocked(MemoryCategory category, size_t extra) const {
+    size_t limit = categoryLimit(category);
+    if (limit > 0) {
+        auto it = category_bytes_.find(category);
+        size_t current = it != category_bytes_.end() ? it->second : 0;
+        if (current + extra > limit) {
+            return false;
+        }
+    }
+    return budget_.total_bytes == 0 || total_bytes_ + extra <= budget_.total_bytes;
+}
+
+size_t MemoryAccountant::categoryLimit(MemoryCategory category) const {
+    switch (category) {
+        case MemoryCategory::WEIGHTS: return budget_.weights_bytes;
+        case MemoryCategory::KV_CACHE: return budget_.kv_cache_bytes;
+        case MemoryCategory::ACTIVATIONS: return budget_.activations_bytes;
+        case MemoryCategory::TOKENIZER: return budget_.tokenizer_bytes;
+    }
+    return 0;
+}
+
+MemoryReservation::MemoryReservation(MemoryCategory category, std::string name, size_t bytes)
+    : category_(category), name_(std::move(name)) {
+    MemoryAccountant::global().reserve(category_, name_, bytes);
+    active_ = true;
+}
+
+MemoryReservation::~MemoryReservation() {
+    reset();
+}
+
+MemoryReservation::MemoryReservation(MemoryReservation&& other) noexcept
+    : category_(other.category_), name_(std::move(other.name_)), active_(other.active_) {
+    other.active_ = false;
+}
+
+MemoryReservation& MemoryReservation::operator=(MemoryReservation&& other) noexcept {
+    if (this != &other) {
+        reset();
+        category_ = other.category_;
+        name_ = std::move(other.name_);
+        active_ = other.active_;
+        other.active_ = false;
+    }
+    return *this;
+}
+
+void MemoryReservation::update(size_t bytes) {
+    if (active_) {
+        MemoryAccountant::global().record(category_, name_, bytes);
+    }
+}
+
+void MemoryReservation::resize(size_t bytes) {
+    if (active_) {
+        MemoryAccountant::global().reserve(category_, name_, bytes);
+    }
+}
+
+void MemoryReservation::reset() {
+    if (active_) {
+        MemoryAccountant::global().release(category_, name_);
+        active_ = false;
+    }
+}
+
+} // namespace mlx_transformer
\ No newline at end of file
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace mlx_transformer {
+
+enum class MemoryCategory {
+    WEIGHTS,
+    KV_CACHE,
+    ACTIVATIONS,
+    TOKENIZER
+};
+
+const char* memoryCategoryName(MemoryCategory category);
+
+enum class AdmissionPolicy {
+    REJECT,  // Fail immediately when a reservation does not fit
+    QUEUE    // Wait until enough memory is released or the timeout expires
+};
+
+// Byte limits; 0 means unlimited
+struct MemoryBudget {
+    size_t total_bytes = 0;
+    size_t weights_bytes = 0;
+    size_t kv_cache_bytes = 0;
+    size_t activations_bytes = 0;
+    size_t tokenizer_bytes = 0;
+    AdmissionPolicy admission = AdmissionPolicy::REJECT;
+    std::chrono::milliseconds queue_timeout{30000};
+
+    // Reads MLX_TRANSFORMER_{TOTAL,WEIGHTS,KV,ACTIVATIONS,TOKENIZER}_BUDGET_MB
+    // and MLX_TRANSFORMER_ADMISSION=queue|reject
+    static MemoryBudget fromEnvironment();
+};
+
+struct MemoryReport {
+    struct Entry {
+        MemoryCategory category;
+        std::string name;
+        size_t bytes;
+    };
+
+    std::vector<Entry> entries;
+    std::map<MemoryCategory, size_t> category_bytes;
+    size_t total_bytes = 0;
+    size_t peak_bytes = 0;
+    size_t queued_reservations = 0;
+    size_t rejected_reservations = 0;
+    MemoryBudget budget;
+
+    std::string toString() const;
+};
+
+class MemoryBudgetExceeded : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Process-wide accounting of the bytes held by weights, KV caches,
+// activations and tokenizers. Entries are keyed by (category, name); owners
+// prefix their names (e.g. "model0/layer.3") so several pipelines can share
+// one accountant and one budget.
+class MemoryAccountant {
+public:
+    static MemoryAccountant& global();
+
+    void setBudget(const MemoryBudget& budget);
+    MemoryBudget budget() const;
+
+    // Sets an entry to an exact size for memory that already exists, e.g.
+    // after a KV cache grew or shrank; never blocks or throws
+    void record(MemoryCategory category, const std::string& name, size_t bytes);
+
+    // Admits a new allocation of `bytes` under `name` before it is made.
+    // Depending on the admission policy this throws MemoryBudgetExceeded or
+    // waits for other owners to release memory.
+    void reserve(MemoryCategory category, const std::string& name, size_t bytes);
+
+    // Removes an entry and wakes up queued reservations
+    void release(MemoryCategory category, const std::string& name);
+
+    size_t used(MemoryCategory category) const;
+    size_t used() const;
+
+    MemoryReport report() const;
+
+private:
+    using Key = std::pair<MemoryCategory, std::string>;
+
+    mutable std::mutex mutex_;
+    std::condition_variable released_;
+    MemoryBudget budget_;
+    std::map<Key, size_t> entries_;
+    std::map<MemoryCategory, size_t> category_bytes_;
+    size_t total_bytes_ = 0;
+    size_t peak_bytes_ = 0;
+    size_t queued_reservations_ = 0;
+    size_t rejected_reservations_ = 0;
+
+    // Caller holds mutex_
+    void setLocked(const Key& key, size_t bytes);
+    bool fitsLocked(MemoryCategory category, size_t extra) const;
+    size_t categoryLimit(MemoryCategory category) const;
+};
+
+// Releases a reservation when it goes out of scope, so aborted or failed
+// requests hand their memory back immediately
+class MemoryReservation {
+public:
+    MemoryReservation() = default;
+    MemoryReservation(MemoryCategory category, std::string name, size_t bytes);
+    ~MemoryReservation();
+
+    MemoryReservation(MemoryReservation&& other) noexcept;
+    MemoryReservation& operator=(MemoryReservation&& other) noexcept;
+    MemoryReservation(const MemoryReservation&) = delete;
+    MemoryReservation& operator=(const MemoryReservation&) = delete;
+
+    // Replaces the reserved amount with the actual size without blocking
+    void update(size_t bytes);
+    
+    // Admits a new size for an active reservation; like the constructor,
+    // this throws or waits when the growth does not fit
+    void resize(size_t bytes);
+    void reset();
+
+private:
+    MemoryCategory category_ = MemoryCategory::KV_CACHE;
+    std::string name_;
+    bool active_ = false;
+};
+
+} // namespace mlx_transformer
\ No newline at end of file
@@ -1,13 +1,69 @@
 #include "memory_mapped_file.h"
 
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
 
 namespace mlx_transformer {
 
-MemoryMappedFile::MemoryMappedFile(const std::string& path) : fd_(-1), data_(nullptr), size_(0) {
+namespace {
+
+const size_t kHugePageSize = 2 * 1024 * 1024;
+
+int adviceFor(AccessPolicy policy) {
+    switch (policy) {
+        case AccessPolicy::SEQUENTIAL: return MADV_SEQUENTIAL;
+        case AccessPolicy::RANDOM: return MADV_RANDOM;
+        case AccessPolicy::WILLNEED: return MADV_WILLNEED;
+        default: return MADV_NORMAL;
+    }
+}
+
+bool flagFromEnv(const char* name) {
+    const char* value = std::getenv(name);
+    return value != nullptr && std::string(value) == "1";
+}
+
+size_t pageSize() {
+    static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return page_size;
+}
+
+} // namespace
+
+MappingOptions MappingOptions::fromEnvironment() {
+    MappingOptions options;
+    const char* policy = std::getenv("MLX_TRANSFORMER_MMAP_POLICY");
+    if (policy != nullptr) {
+        std::string name(policy);
+        if (name == "sequential") {
+            options.policy = AccessPolicy::SEQUENTIAL;
+        } else if (name == "random") {
+            options.policy = AccessPolicy::RANDOM;
+        } else if (name == "willneed") {
+            options.policy = AccessPolicy::WILLNEED;
+        }
+    }
+    options.huge_pages = flagFromEnv("MLX_TRANSFORMER_MMAP_HUGEPAGES");
+    options.populate = flagFromEnv("MLX_TRANSFORMER_MMAP_POPULATE");
+    options.lock = flagFromEnv("MLX_TRANSFORMER_MMAP_LOCK");
+    return options;
+}
+
+PageFaultStats pageFaults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return {usage.ru_majflt, usage.ru_minflt};
+}
+
+MemoryMappedFile::MemoryMappedFile(const std::string& path, const MappingOptions& options)
+    : fd_(-1), data_(nullptr), size_(0), locked_(false) {
     fd_ = open(path.c_str(), O_RDONLY);
     if (fd_ == -1) {
         throw std::runtime_error("Failed to open file: " + path);
@@ -21,19 +77,66 @@ MemoryMappedFile::MemoryMappedFile(const std::string& path) : fd_(-1), data_(nul
     }
     size_ = sb.st_size;
 
+    // Populating or locking a writable private mapping faults every page in
+    // for write, giving each one a private copy and doubling resident memory,
+    // so those mappings stay read-only
+    bool writable = options.copy_on_write && !options.populate && !options.lock;
+    int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    int flags = MAP_PRIVATE | (options.populate ? MAP_POPULATE : 0);
+
+    void* address = nullptr;
+    if (options.huge_pages) {
+        // Reserve an oversized region and map the file at its first 2 MB
+        // boundary, then give back the slack on both sides
+        size_t mapped_length = (size_ + pageSize() - 1) / pageSize() * pageSize();
+        size_t reserved_length = mapped_length + kHugePageSize;
+        void* reserved = mmap(nullptr, reserved_length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (reserved == MAP_FAILED) {
+            close(fd_);
+            throw std::runtime_error("Failed to reserve address space for: " + path);
+        }
+        uintptr_t start = reinterpret_cast<uintptr_t>(reserved);
+        uintptr_t aligned = (start + kHugePageSize - 1) & ~(kHugePageSize - 1);
+        if (aligned > start) {
+            munmap(reserved, aligned - start);
+        }
+        size_t tail = (start + reserved_length) - (aligned + mapped_length);
+        if (tail > 0) {
+            munmap(reinterpret_cast<void*>(aligned + mapped_length), tail);
+        }
+        address = reinterpret_cast<void*>(aligned);
+        flags |= MAP_FIXED;
+    }
+
     // Memory map the file
-    data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    data_ = mmap(address, size_, protection, flags, fd_, 0);
     if (data_ == MAP_FAILED) {
+        if (address != nullptr) {
+            munmap(address, size_);
+        }
         close(fd_);
         throw std::runtime_error("Failed to memory map file: " + path);
     }
 
-    // Advise the kernel that we'll access the data sequentially
-    madvise(data_, size_, MADV_SEQUENTIAL);
+    if (options.huge_pages) {
+        madvise(data_, size_, MADV_HUGEPAGE);
+    }
+    madvise(data_, size_, adviceFor(options.policy));
+
+    if (options.lock) {
+        locked_ = mlock(data_, size_) == 0;
+        if (!locked_) {
+            std::cerr << "Warning: Failed to lock " << path
+                      << " in memory (check RLIMIT_MEMLOCK); continuing unlocked" << std::endl;
+        }
+    }
 }
 
 MemoryMappedFile::~MemoryMappedFile() {
     if (data_ != nullptr && data_ != MAP_FAILED) {
+        if (locked_) {
+            munlock(data_, size_);
+        }
         munmap(data_, size_);
     }
     if (fd_ != -1) {
@@ -49,4 +152,34 @@ size_t MemoryMappedFile::size() const {
     return size_;
 }
 
-} // namespace mlx_transformer
\ No newline at end of file
+void MemoryMappedFile::advise(size_t offset, size_t length, AccessPolicy policy) {
+    if (offset >= size_ || length == 0) {
+        return;
+    }
+    length = std::min(length, size_ - offset);
+
+    // madvise needs a page-aligned start
+    size_t aligned = offset / pageSize() * pageSize();
+    madvise(static_cast<char*>(data_) + aligned, length + (offset - aligned), adviceFor(policy));
+}
+
+void MemoryMappedFile::prefetch(size_t offset, size_t length) {
+    advise(offset, length, AccessPolicy::WILLNEED);
+}
+
+void MemoryMappedFile::touch(size_t offset, size_t length) const {
+    if (offset >= size_) {
+        return;
+    }
+    size_t end = std::min(size_, offset + length);
+    const volatile char* bytes = static_cast<const volatile char*>(data_);
+    for (size_t position = offset; position < end; position += pageSize()) {
+        (void)bytes[position];
+    }
+}
+
+bool MemoryMappedFile::locked() const {
+    return locked_;
+}
+
+} // namespace mlx_transformer
@@ -5,14 +5,63 @@
 
 namespace mlx_transformer {
 
+// Access pattern hints passed to madvise
+enum class AccessPolicy {
+    NORMAL,      // Kernel default readahead
+    SEQUENTIAL,  // Read once front to back; aggressive readahead, pages dropped early
+    RANDOM,      // No readahead
+    WILLNEED     // Start reading the whole range in the background now
+};
+
+struct MappingOptions {
+    AccessPolicy policy = AccessPolicy::NORMAL;
+    // Map pages writable but private, so consumers that write into a buffer
+    // (e.g. MLX donating an input buffer to an output) get their own copy
+    // instead of faulting. Ignored when populate or lock is set: both would
+    // fault every page in for write and copy the whole file.
+    bool copy_on_write = false;
+    // Align the mapping to 2 MB and ask for transparent huge pages. File-backed
+    // THP needs kernel support; without it this only costs the alignment.
+    bool huge_pages = false;
+    // Fault every page in at map time (MAP_POPULATE)
+    bool populate = false;
+    // Pin the mapping in RAM (mlock); falls back to unlocked with a warning
+    // when RLIMIT_MEMLOCK is too small
+    bool lock = false;
+
+    // Reads MLX_TRANSFORMER_MMAP_POLICY=normal|sequential|random|willneed and
+    // MLX_TRANSFORMER_MMAP_{HUGEPAGES,POPULATE,LOCK}=1
+    static MappingOptions fromEnvironment();
+};
+
+// Process-wide page fault counters from getrusage
+struct PageFaultStats {
+    long major_faults = 0;  // Needed disk I/O
+    long minor_faults = 0;  // Served from the page cache
+};
+
+PageFaultStats pageFaults();
+
 class MemoryMappedFile {
 public:
-    MemoryMappedFile(const std::string& path);
+    MemoryMappedFile(const std::string& path, const MappingOptions& options = {});
     ~MemoryMappedFile();
 
     void* data() const;
     size_t size() const;
 
+    // Applies a policy to part of the file, e.g. to prefetch the next layer.
+    // The range is widened to page boundaries.
+    void advise(size_t offset, size_t length, AccessPolicy policy);
+
+    // Starts reading a range in the background (WILLNEED)
+    void prefetch(size_t offset, size_t length);
+
+    // Faults a range in now by reading one byte per page
+    void touch(size_t offset, size_t length) const;
+
+    bool locked() const;
+
     // Delete copy constructors to prevent accidental copies
     MemoryMappedFile(const MemoryMappedFile&) = delete;
     MemoryMappedFile& operator=(const MemoryMappedFile&) = delete;
@@ -21,6 +70,7 @@ private:
     int fd_;
     void* data_;
     size_t size_;
+    bool locked_;
 };
 
-} // namespace mlx_transformer
\ No newline at end of file
+} // namespace mlx_transformer
@@ -1,22 +1,231 @@
 #include "model_loader.h"
 
 #include <mlx/io.h>
+#include <mlx/ops.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
 
-#include "memory_mapped_file.h"
+#include "memory_accountant.h"
+#include "packed_model.h"
 
 namespace mlx_transformer {
 
-ModelLoader::ModelLoader(const std::string& model_path, const QuantizationOptions& quant_options)
-    : model_path_(model_path), quant_options_(quant_options) {
+mlx::core::Dtype toMlxDtype(ComputeDtype dtype) {
+    switch (dtype) {
+        case ComputeDtype::FLOAT16: return mlx::core::float16;
+        case ComputeDtype::BFLOAT16: return mlx::core::bfloat16;
+        default: return mlx::core::float32;
+    }
+}
+
+ComputeDtype parseComputeDtype(const std::string& name) {
+    if (name == "fp32" || name == "float32") {
+        return ComputeDtype::FLOAT32;
+    }
+    if (name == "fp16" || name == "float16") {
+        return ComputeDtype::FLOAT16;
+    }
+    if (name == "bf16" || name == "bfloat16") {
+        return ComputeDtype::BFLOAT16;
+    }
+    throw std::invalid_argument("Unknown compute dtype: " + name);
+}
+
+namespace {
+
+// A top-level config.json value: a string, a literal as written (number,
+// true, false, null), or a flat array of those
+struct ConfigValue {
+    std::string text;
+    std::vector<std::string> items;
+    bool is_array = false;
+};
+
+// Reads the top-level key/value pairs of a JSON object. Nested objects and
+// arrays of objects (e.g. rope_scaling) are left out; the model config only
+// needs scalars and flat arrays.
+class ConfigJsonParser {
+public:
+    explicit ConfigJsonParser(const std::string& text) : text_(text) {}
+    
+    std::unordered_map<std::string, ConfigValue> parse() {
+        std::unordered_map<std::string, ConfigValue> values;
+        expect('{');
+        if (peek() == '}') {
+            return values;
+        }
+        while (true) {
+            std::string key = parseString();
+            expect(':');
+            
+            ConfigValue value;
+            bool keep = true;
+            char c = peek();
+            if (c == '{') {
+                skipValue();
+                keep = false;
+            } else if (c == '[') {
+                keep = value.is_array = parseArray(value.items);
+            } else {
+                value.text = c == '"' ? parseString() : parseLiteral();
+            }
+            if (keep) {
+                values[key] = std::move(value);
+            }
+            
+            if (peek() == ',') {
+                pos_++;
+                continue;
+            }
+            expect('}');
+            return values;
+        }
+    }
+    
+private:
+    const std::string& text_;
+    size_t pos_ = 0;
+    
+    [[noreturn]] void fail(const std::string& what) const {
+        throw std::runtime_error("Invalid config.json at offset " + std::to_string(pos_) + ": " + what);
+    }
+    
+    char peek() {
+        while (pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_]))) {
+            pos_++;
+        }
+        if (pos_ >= text_.size()) {
+            fail("unexpected end of file");
+        }
+        return text_[pos_];
+    }
+    
+    void expect(char c) {
+        if (peek() != c) {
+            fail(std::string("expected '") + c + "'");
+        }
+        pos_++;
+    }
+    
+    std::string parseString() {
+        expect('"');
+        std::string result;
+        while (pos_ < text_.size() && text_[pos_] != '"') {
+            if (text_[pos_] == '\\' && pos_ + 1 < text_.size()) {
+                pos_++;
+            }
+            result += text_[pos_++];
+        }
+        expect('"');
+        return result;
+    }
+    
+    std::string parseLiteral() {
+        size_t start = pos_;
+        while (pos_ < text_.size() && text_[pos_] != ',' && text_[pos_] != '}' && text_[pos_] != ']' &&
+               !std::isspace(static_cast<unsigned char>(text_[pos_]))) {
+            pos_++;
+        }
+        if (pos_ == start) {
+            fail("expected a value");
+        }
+        return text_.substr(start, pos_ - start);
+    }
+    
+    // Returns false (and skips the array) if it holds objects or arrays
+    bool parseArray(std::vector<std::string>& items) {
+        size_t start = pos_;
+        expect('[');
+        if (peek() == ']') {
+            pos_++;
+            return true;
+        }
+        while (true) {
+            char c = peek();
+            if (c == '{' || c == '[') {
+                pos_ = start;
+                skipValue();
+                items.clear();
+                return false;
+            }
+            items.push_back(c == '"' ? parseString() : parseLiteral());
+            if (peek() == ',') {
+                pos_++;
+                continue;
+            }
+            expect(']');
+            return true;
+        }
+    }
+    
+    void skipValue() {
+        int depth = 0;
+        do {
+            char c = peek();
+            if (c == '"') {
+                parseString();
+                continue;
+            }
+            if (c == '{' || c == '[') {
+                depth++;
+            } else if (c == '}' || c == ']') {
+                depth--;
+            }
+            pos_++;
+        } while (depth > 0);
+    }
+};
+
+std::unordered_map<std::string, ConfigValue> parseConfigJson(const std::string& text) {
+    return ConfigJsonParser(text).parse();
+}
+
+} // namespace
+
+ModelLoader::ModelLoader(
+    const std::string& model_path,
+    const QuantizationOptions& quant_options,
+    ComputeDtype compute_dtype,
+    const MappingOptions& mapping_options)
+    : model_path_(model_path), quant_options_(quant_options), compute_dtype_(compute_dtype) {
+    static std::atomic<int> next_id{0};
+    accounting_name_ = "model" + std::to_string(next_id++);
+    
     // Ensure the model path exists
     if (!std::filesystem::exists(model_path)) {
         throw std::runtime_error("Model path does not exist: " + model_path);
     }
     
+    // A packed file fixes the dtype and quantization it was converted with
+    std::string packed_path = model_path_ + "/" + kPackedModelFileName;
+    if (std::filesystem::exists(packed_path)) {
+        packed_ = std::make_unique<PackedModelFile>(packed_path, mapping_options);
+        compute_dtype_ = packed_->computeDtype();
+        quant_options_.mode = packed_->quantization();
+    }
+    
     // Load model configuration
+    auto start = std::chrono::steady_clock::now();
     loadConfig();
+    load_stats_.config_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+ModelLoader::~ModelLoader() {
+    // Modules keep their own references to loaded weights, so the bytes stay
+    // accounted until the loader itself goes away
+    for (const auto& [group, bytes] : accounted_groups_) {
+        MemoryAccountant::global().release(MemoryCategory::WEIGHTS, group);
+    }
 }
 
 const ModelConfig& ModelLoader::config() const {
@@ -29,51 +238,109 @@ mlx::core::array ModelLoader::loadWeight(const std::string& name) {
         return it->second;
     }
     
-    // Load the weight from disk
-    std::string weight_path = model_path_ + "/weights/" + name + ".safetensors";
-    if (!std::filesystem::exists(weight_path)) {
-        throw std::runtime_error("Weight file not found: " + weight_path);
-    }
-    
-    // Memory map the file
-    MemoryMappedFile mmapped_file(weight_path);
+    auto start = std::chrono::steady_clock::now();
+    auto weight = packed_ ? packed_->tensor(name) : readWeight(name);
     
-    // Parse safetensors format and extract array
-    // This is a simplified implementation for Phase 1
-    mlx::core::array weight = mlx::io::load_safetensors(weight_path)[name];
+    // Admit the weight against the weights budget before caching it
+    account(name, weight.nbytes(), start);
+    record(name, weight);
+    weight_cache_[name] = weight;
+    return weight;
+}
+
+LinearWeight ModelLoader::loadLinear(const std::string& name, const std::vector<std::string>& parts) {
+    auto start = std::chrono::steady_clock::now();
     
-    // Apply quantization if needed
-    if (quant_options_.mode == QuantizationMode::INT4) {
-        // For phase 1, we're just storing the weights as-is
-        // In a real implementation, weights would be loaded in quantized format
-        // and dequantized on demand
-        weight_cache_[name] = weight;
+    LinearWeight weight;
+    if (packed_) {
+        weight = packed_->linear(name);
     } else {
-        weight_cache_[name] = weight;
+        std::vector<mlx::core::array> arrays;
+        for (const auto& part : parts) {
+            arrays.push_back(readWeight(part));
+        }
+        auto dense = arrays.size() == 1 ? arrays[0] : mlx::core::concatenate(arrays, 1);
+        mlx::core::eval(dense);
+        weight = Quantizer::quantize(dense, quant_options_.mode, quant_options_.group_size);
     }
     
-    return weight_cache_[name];
+    account(name, weight.nbytes(), start);
+    record(name + ".weight", weight.weight, weight.bits, weight.group_size);
+    if (weight.quantized()) {
+        record(name + ".scales", weight.scales);
+        record(name + ".biases", weight.biases);
+    }
+    return weight;
 }
 
-void ModelLoader::preloadCommonWeights() {
-    std::vector<std::string> common_weights = {
-        "embedding.weight",
-        "lm_head.weight"
-    };
+mlx::core::array ModelLoader::loadTransposed(const std::string& name) {
+    auto start = std::chrono::steady_clock::now();
     
-    for (int i = 0; i < std::min(2, config_.num_hidden_layers); i++) {
-        common_weights.push_back("transformer.layers." + std::to_string(i) + ".attention.wq.weight");
-        common_weights.push_back("transformer.layers." + std::to_string(i) + ".attention.wk.weight");
-        common_weights.push_back("transformer.layers." + std::to_string(i) + ".attention.wv.weight");
-        common_weights.push_back("transformer.layers." + std::to_string(i) + ".attention.wo.weight");
+    mlx::core::array weight = packed_ ? packed_->tensor(name) : mlx::core::array();
+    if (!packed_) {
+        weight = mlx::core::contiguous(mlx::core::transpose(readWeight(name), {1, 0}));
+        mlx::core::eval(weight);
     }
     
-    for (const auto& name : common_weights) {
-        try {
-            loadWeight(name);
-        } catch (const std::exception& e) {
-            std::cerr << "Warning: Failed to preload weight " << name << ": " << e.what() << std::endl;
-        }
+    account(name, weight.nbytes(), start);
+    record(name, weight);
+    return weight;
+}
+
+bool ModelLoader::hasWeight(const std::string& name) const {
+    if (packed_) {
+        return packed_->contains(name) || packed_->contains(name + ".weight");
+    }
+    return weight_cache_.count(name) > 0 || std::filesystem::exists(weightPath(name));
+}
+
+bool ModelLoader::isPacked() const {
+    return packed_ != nullptr;
+}
+
+void ModelLoader::recordTensors(std::vector<PackedTensor>* recorder) {
+    recorder_ = recorder;
+}
+
+void ModelLoader::releaseWeight(const std::string& name) {
+    weight_cache_.erase(name);
+}
+
+const LoadStats& ModelLoader::loadStats() const {
+    return load_stats_;
+}
+
+void ModelLoader::prefetch(const std::string& prefix) {
+    if (packed_) {
+        packed_->prefetch(prefix);
+    }
+}
+
+void ModelLoader::warmup() {
+    warmup(0, static_cast<int>(config_.num_hidden_layers));
+}
+
+void ModelLoader::warmup(int first_layer, int end_layer) {
+    if (!packed_) {
+        return;
+    }
+    
+    auto layer = [](int64_t i) { return "transformer.layers." + std::to_string(i) + "."; };
+    bool last_stage = end_layer == config_.num_hidden_layers;
+    
+    packed_->prefetch(layer(first_layer));
+    if (first_layer == 0) {
+        packed_->touch("embedding.");
+    }
+    for (int64_t i = first_layer; i < end_layer; i++) {
+        // Keep the disk busy with the next layer while this one faults in
+        packed_->prefetch(i + 1 < end_layer ? layer(i + 1) : "transformer.ln_f.");
+        packed_->touch(layer(i));
+    }
+    if (last_stage) {
+        packed_->prefetch("lm_head.");
+        packed_->touch("transformer.ln_f.");
+        packed_->touch("lm_head.");
     }
 }
 
@@ -87,18 +354,155 @@ void ModelLoader::loadConfig() {
         throw std::runtime_error("Model configuration file not found: " + config_path);
     }
     
-    // In a real implementation, parse the JSON file
-    // For Phase 1, we'll use a simplified approach with hardcoded defaults
-    config_.vocab_size = 32000;
-    config_.hidden_size = 4096;
-    config_.intermediate_size = 11008;
-    config_.num_hidden_layers = 32;
-    config_.num_attention_heads = 32;
-    config_.max_position_embeddings = 4096;
-    config_.layer_norm_epsilon = 1e-5;
-    config_.model_type = "llama";
+    std::ifstream file(config_path);
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    auto values = parseConfigJson(buffer.str());
+    
+    // The first of keys present in the file (and not null), or nullptr
+    auto locate = [&](std::initializer_list<const char*> keys) -> const char* {
+        for (const char* key : keys) {
+            auto it = values.find(key);
+            if (it != values.end() && !it->second.is_array && it->second.text != "null") {
+                return key;
+            }
+        }
+        return nullptr;
+    };
+    auto find = [&](std::initializer_list<const char*> keys) -> const ConfigValue* {
+        const char* key = locate(keys);
+        return key ? &values.at(key) : nullptr;
+    };
+    
+    // Errors name the key and its value as written in the file
+    auto parseNumber = [](const std::string& key, const std::string& text) {
+        size_t used = 0;
+        double result = 0.0;
+        try {
+            result = std::stod(text, &used);
+        } catch (const std::exception&) {
+            used = 0;
+        }
+        if (used == 0 || used != text.size()) {
+            throw std::runtime_error("config.json: " + key + " is not a number: " + text);
+        }
+        return result;
+    };
+    auto parseInteger = [&](const std::string& key, const std::string& text) {
+        double result = parseNumber(key, text);
+        if (result != std::floor(result) || std::abs(result) > static_cast<double>(std::numeric_limits<int32_t>::max())) {
+            throw std::runtime_error("config.json: " + key + " must be an integer, got " + text);
+        }
+        return static_cast<int64_t>(result);
+    };
+    auto number = [&](std::initializer_list<const char*> keys, double fallback) {
+        const char* key = locate(keys);
+        return key ? parseNumber(key, values.at(key).text) : fallback;
+    };
+    auto integer = [&](std::initializer_list<const char*> keys, int64_t fallback) {
+        const char* key = locate(keys);
+        return key ? parseInteger(key, values.at(key).text) : fallback;
+    };
+    
+    // Keys missing from the file keep the defaults of the original 7B config
+    config_.vocab_size = integer({"vocab_size"}, 32000);
+    config_.hidden_size = integer({"hidden_size", "n_embd"}, 4096);
+    config_.intermediate_size = integer({"intermediate_size", "n_inner"}, 11008);
+    config_.num_hidden_layers = integer({"num_hidden_layers", "n_layer"}, 32);
+    config_.num_attention_heads = integer({"num_attention_heads", "n_head"}, 32);
+    config_.max_position_embeddings = integer({"max_position_embeddings", "n_positions"}, 4096);
+    config_.layer_norm_epsilon = static_cast<float>(
+        number({"layer_norm_epsilon", "layer_norm_eps", "rms_norm_eps"}, 1e-5));
+    config_.rope_theta = static_cast<float>(number({"rope_theta"}, 10000.0));
+    config_.model_type = find({"model_type"}) ? find({"model_type"})->text : "llama";
+    config_.tie_word_embeddings = find({"tie_word_embeddings"}) && find({"tie_word_embeddings"})->text == "true";
+    config_.compute_dtype = compute_dtype_;
+    
+    // eos_token_id is either one id or a list of them
+    config_.eos_token_ids = {2};
+    auto eos = values.find("eos_token_id");
+    if (eos != values.end() && eos->second.is_array) {
+        config_.eos_token_ids.clear();
+        for (const auto& item : eos->second.items) {
+            config_.eos_token_ids.push_back(static_cast<int>(parseInteger("eos_token_id", item)));
+        }
+    } else if (const ConfigValue* value = find({"eos_token_id"})) {
+        config_.eos_token_ids = {static_cast<int>(parseInteger("eos_token_id", value->text))};
+    }
+    
+    if (config_.vocab_size <= 0 || config_.hidden_size <= 0 || config_.intermediate_size <= 0 ||
+        config_.num_hidden_layers <= 0 || config_.num_attention_heads <= 0) {
+        throw std::runtime_error("config.json: model dimensions must be positive");
+    }
+    if (config_.hidden_size % config_.num_attention_heads != 0) {
+        throw std::runtime_error("config.json: hidden_size must be a multiple of num_attention_heads");
+    }
+    // Attention has one key/value head per query head
+    if (integer({"num_key_value_heads"}, config_.num_attention_heads) != config_.num_attention_heads) {
+        throw std::runtime_error("config.json: grouped-query attention (num_key_value_heads) is not supported");
+    }
+}
+
+std::string ModelLoader::weightPath(const std::string& name) const {
+    return model_path_ + "/weights/" + name + ".safetensors";
+}
+
+std::string ModelLoader::accountingGroup(const std::string& weight_name) const {
+    // "transformer.layers.<i>.*" weights are grouped per layer, everything
+    // else (embedding, LM head, final norm) is reported on its own
+    const std::string layer_prefix = "transformer.layers.";
+    if (weight_name.compare(0, layer_prefix.size(), layer_prefix) == 0) {
+        auto end = weight_name.find('.', layer_prefix.size());
+        return accounting_name_ + "/layer." + weight_name.substr(layer_prefix.size(), end - layer_prefix.size());
+    }
+    
+    auto suffix = weight_name.rfind(".weight");
+    return accounting_name_ + "/" + (suffix != std::string::npos ? weight_name.substr(0, suffix) : weight_name);
+}
+
+mlx::core::array ModelLoader::readWeight(const std::string& name) {
+    std::string weight_path = weightPath(name);
+    if (!std::filesystem::exists(weight_path)) {
+        throw std::runtime_error("Weight file not found: " + weight_path);
+    }
+    
+    // Parse safetensors format and extract array
+    // This is a simplified implementation for Phase 1
+    mlx::core::array weight = mlx::io::load_safetensors(weight_path)[name];
+    
+    // Convert once at load time: matrices go to the compute dtype, 1-D
+    // parameters (norm gains and biases) stay float32 because normalization
+    // runs in float32. Evaluating here drops the source buffer right away.
+    if (mlx::core::issubdtype(weight.dtype(), mlx::core::floating)) {
+        auto target = weight.ndim() >= 2 ? toMlxDtype(compute_dtype_) : mlx::core::float32;
+        if (weight.dtype() != target) {
+            weight = mlx::core::astype(weight, target);
+            mlx::core::eval(weight);
+        }
+    }
+    return weight;
+}
+
+void ModelLoader::account(
+    const std::string& name,
+    size_t bytes,
+    std::chrono::steady_clock::time_point start) {
+    
+    auto group = accountingGroup(name);
+    size_t group_bytes = accounted_groups_[group] + bytes;
+    MemoryAccountant::global().reserve(MemoryCategory::WEIGHTS, group, group_bytes);
+    accounted_groups_[group] = group_bytes;
     
-    // In a real implementation, read these values from the config file
+    load_stats_.weights_loaded++;
+    load_stats_.bytes_loaded += bytes;
+    load_stats_.weights_ms += std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+void ModelLoader::record(const std::string& name, const mlx::core::array& tensor, int bits, int group_size) {
+    if (recorder_ != nullptr) {
+        recorder_->push_back({name, tensor, bits, group_size});
+    }
 }
 
-} // namespace mlx_transformer
\ No newline at end of file
+} // namespace mlx_transformer
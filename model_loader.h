@@ -1,13 +1,33 @@
 #pragma once
 
+#include <chrono>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include <mlx/array.h>
 
+#include "memory_mapped_file.h"
 #include "quantizer.h"
 
 namespace mlx_transformer {
 
+class PackedModelFile;
+struct PackedTensor;
+
+// Dtype weight matrices are stored in and activations run in. Normalization
+// parameters and the softmax inputs always stay float32.
+enum class ComputeDtype {
+    FLOAT32,
+    FLOAT16,
+    BFLOAT16
+};
+
+mlx::core::Dtype toMlxDtype(ComputeDtype dtype);
+
+// Parses "fp32", "fp16" or "bf16"
+ComputeDtype parseComputeDtype(const std::string& name);
+
 struct ModelConfig {
     int64_t vocab_size;
     int64_t hidden_size;
@@ -16,20 +36,80 @@ struct ModelConfig {
     int64_t num_attention_heads;
     int64_t max_position_embeddings;
     float layer_norm_epsilon;
+    float rope_theta;
     std::string model_type;
+    bool tie_word_embeddings;
+    // eos_token_id; any of these ends a sequence
+    std::vector<int> eos_token_ids;
+    ComputeDtype compute_dtype;
 };
 
+struct LoadStats {
+    double config_ms = 0.0;
+    double weights_ms = 0.0;
+    size_t weights_loaded = 0;
+    size_t bytes_loaded = 0;
+};
+
+// Loads weights either from per-tensor safetensors files under weights/,
+// converting, fusing and quantizing them on the way, or from a packed
+// model.mlxpack file written by mlx_transformer_convert, whose tensors are
+// already in their final layout and are mapped without any transformation.
 class ModelLoader {
 public:
-    ModelLoader(const std::string& model_path, const QuantizationOptions& quant_options = {});
+    ModelLoader(
+        const std::string& model_path,
+        const QuantizationOptions& quant_options = {},
+        ComputeDtype compute_dtype = ComputeDtype::FLOAT32,
+        const MappingOptions& mapping_options = {});
+    ~ModelLoader();
+    
+    ModelLoader(const ModelLoader&) = delete;
+    ModelLoader& operator=(const ModelLoader&) = delete;
     
     const ModelConfig& config() const;
     
     // Lazy loading of weights - only loads when requested
     mlx::core::array loadWeight(const std::string& name);
     
-    // Preload common weights to improve initial inference time
-    void preloadCommonWeights();
+    // Linear projection ready for linear(). The parts, [in, out] each, are
+    // concatenated along the output axis (e.g. wq/wk/wv into one fused
+    // projection) and quantized according to the quantization options.
+    LinearWeight loadLinear(const std::string& name, const std::vector<std::string>& parts);
+    
+    // A [rows, cols] weight laid out as its contiguous [cols, rows] transpose
+    mlx::core::array loadTransposed(const std::string& name);
+    
+    // Whether a weight exists, without loading it
+    bool hasWeight(const std::string& name) const;
+    
+    // Whether weights come from a packed model file
+    bool isPacked() const;
+    
+    // Appends every tensor handed out, in its final layout and in load
+    // order, to `recorder`; used by the converter to write a packed file
+    void recordTensors(std::vector<PackedTensor>* recorder);
+    
+    // Drops a weight from the cache once a module has taken a transformed
+    // copy of it, so the original buffer can be freed
+    void releaseWeight(const std::string& name);
+    
+    // Time spent reading the config and loading weights
+    const LoadStats& loadStats() const;
+    
+    // Starts reading the packed tensors under prefix (e.g.
+    // "transformer.layers.3.") in the background. Safetensors weights are
+    // read eagerly by loadWeight, so this is a no-op for them.
+    void prefetch(const std::string& prefix);
+    
+    // Faults every packed weight in, in execution order, prefetching layer
+    // i + 1 while layer i is being faulted in, so the first token does not
+    // pay for disk reads. No-op for safetensors weights.
+    void warmup();
+    
+    // Same for a pipeline stage running layers [first_layer, end_layer); the
+    // embedding and LM head are only touched by the stages that use them
+    void warmup(int first_layer, int end_layer);
     
     // Clear the weight cache to free memory
     void clearWeightCache();
@@ -37,10 +117,29 @@ public:
 private:
     std::string model_path_;
     QuantizationOptions quant_options_;
+    ComputeDtype compute_dtype_;
     ModelConfig config_;
+    LoadStats load_stats_;
     std::unordered_map<std::string, mlx::core::array> weight_cache_;
     
+    // Weight bytes are reported to the global MemoryAccountant per layer
+    std::string accounting_name_;
+    std::unordered_map<std::string, size_t> accounted_groups_;
+    
+    std::unique_ptr<PackedModelFile> packed_;
+    std::vector<PackedTensor>* recorder_ = nullptr;
+    
     void loadConfig();
+    std::string weightPath(const std::string& name) const;
+    std::string accountingGroup(const std::string& weight_name) const;
+    
+    // Reads one safetensors weight, converted to its compute dtype
+    mlx::core::array readWeight(const std::string& name);
+    
+    // Admits `bytes` more against the weights budget and updates the stats
+    void account(const std::string& name, size_t bytes, std::chrono::steady_clock::time_point start);
+    
+    void record(const std::string& name, const mlx::core::array& tensor, int bits = 0, int group_size = 0);
 };
 
 } // namespace mlx_transformer
\ No newline at end of file
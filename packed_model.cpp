@@ -0,0 +1,280 @@
+#include "packed_model.h"
+
+#include <mlx/ops.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace mlx_transformer {
+
+const char* const kPackedModelFileName = "model.mlxpack";
+
+namespace {
+
+const char kMagic[8] = {'M', 'L', 'X', 'P', 'A', 'C', 'K', '1'};
+const uint32_t kVersion = 1;
+const uint64_t kTensorAlignment = 4096;
+
+struct PackHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t compute_dtype;
+    uint32_t quantization;
+    uint32_t num_tensors;
+    uint64_t index_bytes;
+    uint64_t data_offset;
+};
+
+// Dtypes are stored as small stable codes rather than MLX's internal values
+uint32_t dtypeCode(mlx::core::Dtype dtype) {
+    if (dtype == mlx::core::float32) return 0;
+    if (dtype == mlx::core::float16) return 1;
+    if (dtype == mlx::core::bfloat16) return 2;
+    if (dtype == mlx::core::uint32) return 3;
+    if (dtype == mlx::core::int32) return 4;
+    if (dtype == mlx::core::uint8) return 5;
+    throw std::runtime_error("Unsupported dtype in packed model");
+}
+
+mlx::core::Dtype dtypeFromCode(uint32_t code) {
+    switch (code) {
+        case 0: return mlx::core::float32;
+        case 1: return mlx::core::float16;
+        case 2: return mlx::core::bfloat16;
+        case 3: return mlx::core::uint32;
+        case 4: return mlx::core::int32;
+        case 5: return mlx::core::uint8;
+    }
+    throw std::runtime_error("Unknown dtype code in packed model: " + std::to_string(code));
+}
+
+uint64_t alignUp(uint64_t value) {
+    return (value + kTensorAlignment - 1) / kTensorAlignment * kTensorAlignment;
+}
+
+template <typename T>
+void put(std::string& buffer, T value) {
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+T get(const char*& cursor, const char* end) {
+    if (cursor + sizeof(T) > end) {
+        throw std::runtime_error("Truncated packed model index");
+    }
+    T value;
+    std::memcpy(&value, cursor, sizeof(T));
+    cursor += sizeof(T);
+    return value;
+}
+
+} // namespace
+
+void writePackedModel(
+    const std::string& path,
+    const std::vector<PackedTensor>& tensors,
+    ComputeDtype compute_dtype,
+    QuantizationMode quantization) {
+    
+    // Row-major bytes of every tensor
+    std::vector<mlx::core::array> contiguous;
+    for (const auto& tensor : tensors) {
+        contiguous.push_back(mlx::core::contiguous(tensor.data));
+    }
+    mlx::core::eval(contiguous);
+    
+    // The index size does not depend on offsets, so compute it first
+    std::string index;
+    auto appendEntry = [&](size_t i, uint64_t offset) {
+        const auto& tensor = tensors[i];
+        put<uint32_t>(index, static_cast<uint32_t>(tensor.name.size()));
+        index.append(tensor.name);
+        put<uint32_t>(index, dtypeCode(contiguous[i].dtype()));
+        put<uint32_t>(index, static_cast<uint32_t>(contiguous[i].ndim()));
+        for (auto dim : contiguous[i].shape()) {
+            put<int64_t>(index, dim);
+        }
+        put<uint64_t>(index, offset);
+        put<uint64_t>(index, contiguous[i].nbytes());
+        put<int32_t>(index, tensor.bits);
+        put<int32_t>(index, tensor.group_size);
+    };
+    for (size_t i = 0; i < tensors.size(); i++) {
+        appendEntry(i, 0);
+    }
+    
+    PackHeader header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.compute_dtype = static_cast<uint32_t>(compute_dtype);
+    header.quantization = static_cast<uint32_t>(quantization);
+    header.num_tensors = static_cast<uint32_t>(tensors.size());
+    header.index_bytes = index.size();
+    header.data_offset = alignUp(sizeof(header) + index.size());
+    
+    // Lay the tensors out back to back on page boundaries
+    std::vector<uint64_t> offsets;
+    uint64_t offset = header.data_offset;
+    index.clear();
+    for (size_t i = 0; i < tensors.size(); i++) {
+        offsets.push_back(offset);
+        appendEntry(i, offset);
+        offset = alignUp(offset + contiguous[i].nbytes());
+    }
+    
+    std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Failed to open packed model for writing: " + tmp_path);
+    }
+    
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(index.data(), index.size());
+    uint64_t written = sizeof(header) + index.size();
+    
+    std::vector<char> padding;
+    for (size_t i = 0; i < tensors.size(); i++) {
+        padding.assign(offsets[i] - written, 0);
+        out.write(padding.data(), padding.size());
+        out.write(contiguous[i].data<char>(), contiguous[i].nbytes());
+        written = offsets[i] + contiguous[i].nbytes();
+    }
+    
+    out.close();
+    if (!out) {
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Failed to write packed model: " + tmp_path);
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Failed to move packed model into place: " + path);
+    }
+}
+
+namespace {
+
+MappingOptions copyOnWrite(MappingOptions options) {
+    options.copy_on_write = true;
+    return options;
+}
+
+} // namespace
+
+PackedModelFile::PackedModelFile(const std::string& path, const MappingOptions& options)
+    : file_(std::make_shared<MemoryMappedFile>(path, copyOnWrite(options))) {
+    
+    const char* data = static_cast<const char*>(file_->data());
+    const char* end = data + file_->size();
+    
+    PackHeader header;
+    if (file_->size() < sizeof(header)) {
+        throw std::runtime_error("Truncated packed model: " + path);
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion) {
+        throw std::runtime_error("Not a packed model (or unsupported version): " + path);
+    }
+    compute_dtype_ = static_cast<ComputeDtype>(header.compute_dtype);
+    quantization_ = static_cast<QuantizationMode>(header.quantization);
+    
+    const char* cursor = data + sizeof(header);
+    const char* index_end = cursor + header.index_bytes;
+    if (index_end > end) {
+        throw std::runtime_error("Truncated packed model index: " + path);
+    }
+    
+    for (uint32_t i = 0; i < header.num_tensors; i++) {
+        auto name_length = get<uint32_t>(cursor, index_end);
+        if (cursor + name_length > index_end) {
+            throw std::runtime_error("Truncated packed model index: " + path);
+        }
+        std::string name(cursor, name_length);
+        cursor += name_length;
+        
+        Entry entry;
+        entry.dtype = dtypeFromCode(get<uint32_t>(cursor, index_end));
+        auto ndim = get<uint32_t>(cursor, index_end);
+        for (uint32_t d = 0; d < ndim; d++) {
+            entry.shape.push_back(static_cast<int>(get<int64_t>(cursor, index_end)));
+        }
+        entry.offset = get<uint64_t>(cursor, index_end);
+        entry.nbytes = get<uint64_t>(cursor, index_end);
+        entry.bits = get<int32_t>(cursor, index_end);
+        entry.group_size = get<int32_t>(cursor, index_end);
+        
+        if (entry.offset + entry.nbytes > file_->size()) {
+            throw std::runtime_error("Tensor " + name + " lies outside the packed model: " + path);
+        }
+        index_.emplace(std::move(name), std::move(entry));
+    }
+}
+
+ComputeDtype PackedModelFile::computeDtype() const {
+    return compute_dtype_;
+}
+
+QuantizationMode PackedModelFile::quantization() const {
+    return quantization_;
+}
+
+bool PackedModelFile::contains(const std::string& name) const {
+    return index_.count(name) > 0;
+}
+
+mlx::core::array PackedModelFile::tensor(const std::string& name) const {
+    const auto& e = entry(name);
+    char* data = static_cast<char*>(file_->data()) + e.offset;
+    
+    // The deleter owns a reference to the mapping, not to the bytes
+    auto file = file_;
+    return mlx::core::array(data, e.shape, e.dtype, [file](void*) {});
+}
+
+LinearWeight PackedModelFile::linear(const std::string& name) const {
+    const auto& e = entry(name + ".weight");
+    
+    LinearWeight weight;
+    weight.weight = tensor(name + ".weight");
+    weight.bits = e.bits;
+    weight.group_size = e.group_size;
+    if (weight.quantized()) {
+        weight.scales = tensor(name + ".scales");
+        weight.biases = tensor(name + ".biases");
+    }
+    return weight;
+}
+
+std::pair<uint64_t, uint64_t> PackedModelFile::range(const std::string& prefix) const {
+    uint64_t begin = UINT64_MAX;
+    uint64_t end = 0;
+    for (const auto& [name, e] : index_) {
+        if (name.compare(0, prefix.size(), prefix) == 0) {
+            begin = std::min(begin, e.offset);
+            end = std::max(end, e.offset + e.nbytes);
+        }
+    }
+    return begin < end ? std::make_pair(begin, end) : std::make_pair<uint64_t, uint64_t>(0, 0);
+}
+
+void PackedModelFile::prefetch(const std::string& prefix) {
+    auto [begin, end] = range(prefix);
+    file_->prefetch(begin, end - begin);
+}
+
+void PackedModelFile::touch(const std::string& prefix) const {
+    auto [begin, end] = range(prefix);
+    file_->touch(begin, end - begin);
+}
+
+const PackedModelFile::Entry& PackedModelFile::entry(const std::string& name) const {
+    auto it = index_.find(name);
+    if (it == index_.end()) {
+        throw std::runtime_error("Tensor not found in packed model: " + name);
+    }
+    return it->second;
+}
+
+} // namespace mlx_transformer
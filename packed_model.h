@@ -0,0 +1,94 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <mlx/array.h>
+
+#include "memory_mapped_file.h"
+#include "model_loader.h"
+
+namespace mlx_transformer {
+
+// Single-file model format written by mlx_transformer_convert.
+//
+// Layout: a fixed header, an index with one entry per tensor (name, dtype,
+// shape, offset, size and quantization parameters), then the tensor data.
+// Every tensor starts on a page boundary and tensors are stored in the order
+// the model executes, so a forward pass streams through the file front to
+// back. Tensors are stored exactly as modules consume them: fused,
+// transposed, converted to the compute dtype and quantized, so loading is a
+// plain mmap with no transformation.
+//
+// Linear weights are stored as "<name>.weight", plus "<name>.scales" and
+// "<name>.biases" when quantized.
+
+// Default file name inside a model directory
+extern const char* const kPackedModelFileName;
+
+// One tensor to write, in its final layout
+struct PackedTensor {
+    std::string name;
+    mlx::core::array data;
+    // Quantization of a linear weight; 0 bits for dense tensors
+    int bits = 0;
+    int group_size = 0;
+};
+
+void writePackedModel(
+    const std::string& path,
+    const std::vector<PackedTensor>& tensors,
+    ComputeDtype compute_dtype,
+    QuantizationMode quantization);
+
+class PackedModelFile {
+public:
+    // Maps the file copy-on-write (regardless of options.copy_on_write)
+    // unless options.populate or options.lock asks for a read-only mapping;
+    // tensors are views into the mapping
+    explicit PackedModelFile(const std::string& path, const MappingOptions& options = {});
+
+    ComputeDtype computeDtype() const;
+    QuantizationMode quantization() const;
+
+    bool contains(const std::string& name) const;
+
+    // Zero-copy array over the mapped bytes; the mapping stays alive as long
+    // as any returned array does
+    mlx::core::array tensor(const std::string& name) const;
+
+    // Linear weight stored under "<name>.weight" (+ scales/biases)
+    LinearWeight linear(const std::string& name) const;
+
+    // Byte range spanned by all tensors whose name starts with prefix, e.g.
+    // "transformer.layers.3."; tensors of one layer are stored together.
+    // Returns {0, 0} when nothing matches.
+    std::pair<uint64_t, uint64_t> range(const std::string& prefix) const;
+
+    // Starts reading the tensors under prefix in the background
+    void prefetch(const std::string& prefix);
+
+    // Faults the tensors under prefix in now
+    void touch(const std::string& prefix) const;
+
+private:
+    struct Entry {
+        mlx::core::Dtype dtype;
+        mlx::core::Shape shape;
+        uint64_t offset;
+        uint64_t nbytes;
+        int bits;
+        int group_size;
+    };
+
+    std::shared_ptr<MemoryMappedFile> file_;
+    std::unordered_map<std::string, Entry> index_;
+    ComputeDtype compute_dtype_;
+    QuantizationMode quantization_;
+
+    const Entry& entry(const std::string& name) const;
+};
+
+} // namespace mlx_transformer
@@ -0,0 +1,640 @@
+#include "pipeline_parallel.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <mlx/ops.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+extern char** environ;
+
+namespace mlx_transformer {
+
+namespace {
+
+constexpr char kMagic[4] = {'M', 'L', 'P', 'P'};
+constexpr uint32_t kAbsentTensor = 0xffffffff;
+constexpr int kMaxDims = 4;
+
+struct WireHeader {
+    char magic[4];
+    uint32_t type;
+    int32_t micro_batch;
+    uint32_t reset;
+    uint32_t num_tensors;
+};
+
+struct WireTensor {
+    uint32_t dtype;  // kAbsentTensor for an empty array
+    uint32_t ndim;
+    int32_t dims[kMaxDims];
+    uint64_t nbytes;
+};
+
+uint32_t dtypeCode(mlx::core::Dtype dtype) {
+    if (dtype == mlx::core::float32) return 0;
+    if (dtype == mlx::core::float16) return 1;
+    if (dtype == mlx::core::bfloat16) return 2;
+    if (dtype == mlx::core::int32) return 3;
+    throw std::runtime_error("Unsupported dtype for a pipeline stage message");
+}
+
+mlx::core::Dtype dtypeFromCode(uint32_t code) {
+    switch (code) {
+        case 0: return mlx::core::float32;
+        case 1: return mlx::core::float16;
+        case 2: return mlx::core::bfloat16;
+        case 3: return mlx::core::int32;
+    }
+    throw std::runtime_error("Unknown dtype code in pipeline stage message: " + std::to_string(code));
+}
+
+sockaddr_un socketAddress(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::invalid_argument("Socket path too long: " + path);
+    }
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+std::string systemError(const std::string& what) {
+    return what + ": " + std::strerror(errno);
+}
+
+const char* dtypeName(ComputeDtype dtype) {
+    switch (dtype) {
+        case ComputeDtype::FLOAT32: return "fp32";
+        case ComputeDtype::FLOAT16: return "fp16";
+        case ComputeDtype::BFLOAT16: return "bf16";
+    }
+    return "fp32";
+}
+
+} // namespace
+
+StageChannel::StageChannel(int fd) : fd_(fd) {
+}
+
+StageChannel::~StageChannel() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+StageChannel::StageChannel(StageChannel&& other) noexcept : fd_(other.fd_) {
+    other.fd_ = -1;
+}
+
+StageChannel& StageChannel::operator=(StageChannel&& other) noexcept {
+    if (this != &other) {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+        fd_ = other.fd_;
+        other.fd_ = -1;
+    }
+    return *this;
+}
+
+StageChannel StageChannel::connect(const std::string& path, int timeout_ms) {
+    auto channel = tryConnect(path, timeout_ms);
+    if (!channel.valid()) {
+        throw std::runtime_error("Timed out connecting to pipeline stage at " + path);
+    }
+    return channel;
+}
+
+StageChannel StageChannel::tryConnect(const std::string& path, int timeout_ms) {
+    auto address = socketAddress(path);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    // The peer may still be starting up
+    while (true) {
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            throw std::runtime_error(systemError("Cannot create socket"));
+        }
+        if (::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0) {
+            return StageChannel(fd);
+        }
+        int error = errno;
+        ::close(fd);
+
+        if (error != ENOENT && error != ECONNREFUSED) {
+            errno = error;
+            throw std::runtime_error(systemError("Cannot connect to pipeline stage at " + path));
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return StageChannel();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+}
+
+void StageChannel::send(const StageMessage& message) {
+    WireHeader header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.type = static_cast<uint32_t>(message.type);
+    header.micro_batch = message.micro_batch;
+    header.reset = message.reset ? 1 : 0;
+    header.num_tensors = static_cast<uint32_t>(message.tensors.size());
+    writeAll(&header, sizeof(header));
+
+    for (const auto& tensor : message.tensors) {
+        WireTensor info{};
+        if (tensor.size() == 0) {
+            info.dtype = kAbsentTensor;
+            writeAll(&info, sizeof(info));
+            continue;
+        }
+        if (tensor.ndim() > kMaxDims) {
+            throw std::invalid_argument("Pipeline stage messages carry at most 4-d tensors");
+        }
+
+        auto contiguous = mlx::core::contiguous(tensor);
+        contiguous.eval();
+        info.dtype = dtypeCode(contiguous.dtype());
+        info.ndim = contiguous.ndim();
+        for (int d = 0; d < contiguous.ndim(); d++) {
+            info.dims[d] = contiguous.shape(d);
+        }
+        info.nbytes = contiguous.nbytes();
+        writeAll(&info, sizeof(info));
+        writeAll(contiguous.data<char>(), contiguous.nbytes());
+    }
+}
+
+StageMessage StageChannel::receive() {
+    WireHeader header;
+    readAll(&header, sizeof(header));
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+        throw std::runtime_error("Corrupt pipeline stage message");
+    }
+
+    StageMessage message;
+    message.type = static_cast<StageMessageType>(header.type);
+    message.micro_batch = header.micro_batch;
+    message.reset = header.reset != 0;
+
+    for (uint32_t i = 0; i < header.num_tensors; i++) {
+        WireTensor info;
+        readAll(&info, sizeof(info));
+        if (info.dtype == kAbsentTensor) {
+            message.tensors.push_back(mlx::core::array());
+            continue;
+        }
+        if (info.ndim > kMaxDims) {
+            throw std::runtime_error("Corrupt pipeline stage message");
+        }
+
+        // Received straight into the buffer the array will own
+        mlx::core::Shape shape(info.dims, info.dims + info.ndim);
+        void* buffer = std::malloc(std::max<uint64_t>(1, info.nbytes));
+        if (buffer == nullptr) {
+            throw std::bad_alloc();
+        }
+        try {
+            readAll(buffer, info.nbytes);
+        } catch (...) {
+            std::free(buffer);
+            throw;
+        }
+        message.tensors.push_back(mlx::core::array(
+            buffer, shape, dtypeFromCode(info.dtype), [](void* data) { std::free(data); }));
+    }
+    return message;
+}
+
+bool StageChannel::valid() const {
+    return fd_ >= 0;
+}
+
+void StageChannel::writeAll(const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        // MSG_NOSIGNAL: a vanished peer is reported as an error, not SIGPIPE
+        ssize_t written = ::send(fd_, bytes, size, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(systemError("Pipeline stage send failed"));
+        }
+        bytes += written;
+        size -= written;
+    }
+}
+
+void StageChannel::readAll(void* data, size_t size) {
+    char* bytes = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t count = ::recv(fd_, bytes, size, 0);
+        if (count == 0) {
+            throw std::runtime_error("Pipeline stage connection closed");
+        }
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(systemError("Pipeline stage receive failed"));
+        }
+        bytes += count;
+        size -= count;
+    }
+}
+
+StageListener::StageListener(const std::string& path) : path_(path) {
+    auto address = socketAddress(path);
+    ::unlink(path.c_str());
+
+    fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_ < 0) {
+        throw std::runtime_error(systemError("Cannot create socket"));
+    }
+    if (::bind(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::listen(fd_, 1) != 0) {
+        int error = errno;
+        ::close(fd_);
+        errno = error;
+        throw std::runtime_error(systemError("Cannot listen on " + path));
+    }
+}
+
+StageListener::~StageListener() {
+    ::close(fd_);
+    ::unlink(path_.c_str());
+}
+
+StageChannel StageListener::accept(int timeout_ms) {
+    while (true) {
+        pollfd request{fd_, POLLIN, 0};
+        int ready = ::poll(&request, 1, timeout_ms);
+        if (ready == 0) {
+            return StageChannel();
+        }
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(systemError("Cannot wait on " + path_));
+        }
+
+        int fd = ::accept(fd_, nullptr, nullptr);
+        if (fd >= 0) {
+            return StageChannel(fd);
+        }
+        if (errno != EINTR) {
+            throw std::runtime_error(systemError("Cannot accept on " + path_));
+        }
+    }
+}
+
+const std::string& StageListener::path() const {
+    return path_;
+}
+
+std::vector<LayerRange> partitionLayers(int num_layers, int num_stages) {
+    if (num_stages < 1 || num_stages > num_layers) {
+        throw std::invalid_argument("Need between 1 and num_layers pipeline stages");
+    }
+
+    std::vector<LayerRange> stages;
+    int first = 0;
+    for (int i = 0; i < num_stages; i++) {
+        // The first num_layers % num_stages stages take one extra layer
+        int count = num_layers / num_stages + (i < num_layers % num_stages ? 1 : 0);
+        stages.push_back({first, first + count});
+        first += count;
+    }
+    return stages;
+}
+
+PipelineStage::PipelineStage(
+    const std::string& model_path,
+    LayerRange layers,
+    const QuantizationOptions& quant_options,
+    const KVCacheOptions& kv_options,
+    ComputeDtype compute_dtype,
+    const MappingOptions& mapping_options)
+    : loader_(model_path, quant_options, compute_dtype, mapping_options),
+      model_(loader_.config(), kv_options),
+      kv_options_(kv_options) {
+
+    model_.loadWeights(loader_, layers.first_layer, layers.end_layer);
+    loader_.warmup(layers.first_layer, layers.end_layer);
+}
+
+void PipelineStage::serve(StageChannel& upstream, StageChannel& downstream) {
+    bool last_stage = model_.endLayer() == model_.numLayers();
+
+    while (true) {
+        auto message = upstream.receive();
+        switch (message.type) {
+            case StageMessageType::FORWARD: {
+                // Install this micro-batch's caches for the duration of the
+                // step; swapping only exchanges array references
+                auto& caches = caches_[message.micro_batch];
+                if (message.reset) {
+                    caches.clear();
+                }
+                model_.swapKVCaches(caches);
+                auto output = model_.forwardStage(message.tensors.at(0), message.tensors.at(1), true);
+                output.eval();
+                model_.swapKVCaches(caches);
+
+                StageMessage next;
+                next.type = last_stage ? StageMessageType::RESULT : StageMessageType::FORWARD;
+                next.micro_batch = message.micro_batch;
+                next.reset = message.reset;
+                next.tensors = {output, message.tensors.at(1)};
+                downstream.send(next);
+                break;
+            }
+            case StageMessageType::RELEASE:
+                caches_.erase(message.micro_batch);
+                downstream.send(message);
+                break;
+            case StageMessageType::SHUTDOWN:
+                downstream.send(message);
+                return;
+            case StageMessageType::RESULT:
+                throw std::runtime_error("Pipeline stage received a result message");
+        }
+    }
+}
+
+PipelineParallelGenerator::PipelineParallelGenerator(
+    const std::string& model_path,
+    const PipelineParallelOptions& options)
+    : options_(options) {
+
+    if (options.micro_batch_size < 1) {
+        throw std::invalid_argument("micro_batch_size must be at least 1");
+    }
+
+    // Only the config is read here; the stages load the weights
+    config_ = ModelLoader(model_path).config();
+    stages_ = partitionLayers(static_cast<int>(config_.num_hidden_layers), options.num_stages);
+
+    std::string base = options.socket_dir + "/mlx-pp-" + std::to_string(::getpid()) + "-";
+    auto stage_socket = [&](int i) { return base + std::to_string(i) + ".sock"; };
+    results_listener_ = std::make_unique<StageListener>(base + "results.sock");
+
+    try {
+        for (size_t i = 0; i < stages_.size(); i++) {
+            std::vector<std::string> args;
+            if (options.numa_nodes > 0) {
+                std::string node = std::to_string(i % options.numa_nodes);
+                args = {"numactl", "--cpunodebind=" + node, "--membind=" + node};
+            }
+            args.insert(args.end(), {
+                options.stage_executable,
+                model_path,
+                std::to_string(stages_[i].first_layer),
+                std::to_string(stages_[i].end_layer),
+                stage_socket(static_cast<int>(i)),
+                i + 1 < stages_.size() ? stage_socket(static_cast<int>(i + 1)) : results_listener_->path(),
+                std::to_string(static_cast<int>(options.quantization)),
+                dtypeName(options.compute_dtype)});
+
+            std::vector<char*> argv;
+            for (auto& arg : args) {
+                argv.push_back(arg.data());
+            }
+            argv.push_back(nullptr);
+
+            pid_t pid;
+            int error = ::posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ);
+            if (error != 0) {
+                errno = error;
+                throw std::runtime_error(systemError("Cannot start pipeline stage " + args[0]));
+            }
+            processes_.push_back(pid);
+        }
+
+        // A stage that dies before the ring is connected (bad path, failed
+        // load) would otherwise leave connect() and accept() waiting until
+        // they time out, or forever
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+        while (!to_first_stage_.valid()) {
+            to_first_stage_ = StageChannel::tryConnect(stage_socket(0), 100);
+            if (!to_first_stage_.valid()) {
+                checkStages();
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    throw std::runtime_error("Timed out waiting for the first pipeline stage to listen");
+                }
+            }
+        }
+        while (!from_last_stage_.valid()) {
+            from_last_stage_ = results_listener_->accept(100);
+            if (!from_last_stage_.valid()) {
+                checkStages();
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    throw std::runtime_error("Timed out waiting for the last pipeline stage to connect");
+                }
+            }
+        }
+    } catch (...) {
+        shutdown();
+        throw;
+    }
+
+    receiver_ = std::thread([this]() { receiveResults(); });
+}
+
+PipelineParallelGenerator::~PipelineParallelGenerator() {
+    shutdown();
+}
+
+std::vector<std::vector<int>> PipelineParallelGenerator::generate(
+    const std::vector<std::vector<int>>& prompts,
+    int max_length,
+    float temperature,
+    int top_k) {
+
+    struct MicroBatch {
+        std::vector<size_t> prompts;  // Indices into `prompts`
+        mlx::core::array padding;
+        std::vector<bool> finished;
+    };
+
+    // Sort by length so each micro-batch needs little left padding
+    std::vector<size_t> order(prompts.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return prompts[a].size() < prompts[b].size();
+    });
+
+    std::vector<std::vector<int>> generated(prompts.size());
+    std::vector<MicroBatch> batches;
+    for (size_t start = 0; start < order.size(); start += options_.micro_batch_size) {
+        MicroBatch batch;
+        size_t end = std::min(order.size(), start + static_cast<size_t>(options_.micro_batch_size));
+        batch.prompts.assign(order.begin() + start, order.begin() + end);
+        batch.finished.assign(batch.prompts.size(), false);
+
+        size_t length = 1;
+        for (size_t index : batch.prompts) {
+            length = std::max(length, prompts[index].size());
+        }
+        int rows = static_cast<int>(batch.prompts.size());
+        std::vector<int> ids(rows * length, 0);
+        std::vector<int> padding(rows * length, 0);
+        for (int r = 0; r < rows; r++) {
+            const auto& prompt = prompts[batch.prompts[r]];
+            size_t pad = length - prompt.size();
+            for (size_t i = 0; i < prompt.size(); i++) {
+                ids[r * length + pad + i] = prompt[i];
+                padding[r * length + pad + i] = 1;
+            }
+        }
+        batch.padding = mlx::core::array(padding.begin(), {rows, static_cast<int>(length)}, mlx::core::int32);
+
+        // Every micro-batch's prefill goes out at once, filling the pipeline
+        StageMessage message;
+        message.micro_batch = static_cast<int32_t>(batches.size());
+        message.reset = true;
+        message.tensors = {
+            mlx::core::array(ids.begin(), {rows, static_cast<int>(length)}, mlx::core::int32),
+            batch.padding};
+        to_first_stage_.send(message);
+        batches.push_back(std::move(batch));
+    }
+
+    const auto& eos_token_ids = config_.eos_token_ids;
+    size_t in_flight = batches.size();
+    while (in_flight > 0) {
+        auto result = nextResult();
+        auto& batch = batches.at(result.micro_batch);
+
+        auto next_token = TransformerModel::sample(
+            mlx::core::squeeze(result.tensors.at(0), 1), temperature, top_k);
+        next_token = mlx::core::astype(next_token, mlx::core::int32);
+        next_token.eval();
+        const int32_t* tokens = next_token.data<int32_t>();
+
+        bool all_finished = true;
+        std::vector<int> step_ids(batch.prompts.size());
+        for (size_t r = 0; r < batch.prompts.size(); r++) {
+            step_ids[r] = tokens[r];
+            if (batch.finished[r]) {
+                continue;
+            }
+            auto& output = generated[batch.prompts[r]];
+            output.push_back(tokens[r]);
+            bool eos = std::find(eos_token_ids.begin(), eos_token_ids.end(), tokens[r]) != eos_token_ids.end();
+            batch.finished[r] = eos || static_cast<int>(output.size()) >= max_length;
+            all_finished = all_finished && batch.finished[r];
+        }
+
+        StageMessage message;
+        message.micro_batch = result.micro_batch;
+        if (all_finished) {
+            message.type = StageMessageType::RELEASE;
+            to_first_stage_.send(message);
+            in_flight--;
+            continue;
+        }
+
+        // Finished rows keep stepping with the rest of their micro-batch;
+        // their tokens are discarded
+        int rows = static_cast<int>(batch.prompts.size());
+        batch.padding = mlx::core::concatenate({batch.padding, mlx::core::ones({rows, 1}, mlx::core::int32)}, 1);
+        message.tensors = {mlx::core::array(step_ids.begin(), {rows, 1}, mlx::core::int32), batch.padding};
+        to_first_stage_.send(message);
+    }
+
+    return generated;
+}
+
+const std::vector<LayerRange>& PipelineParallelGenerator::stages() const {
+    return stages_;
+}
+
+void PipelineParallelGenerator::receiveResults() {
+    try {
+        while (true) {
+            auto message = from_last_stage_.receive();
+            if (message.type == StageMessageType::SHUTDOWN) {
+                return;
+            }
+            if (message.type != StageMessageType::RESULT) {
+                continue;  // Releases coming back around the ring
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            results_.push_back(std::move(message));
+            result_ready_.notify_one();
+        }
+    } catch (const std::exception&) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        receiver_failed_ = true;
+        result_ready_.notify_all();
+    }
+}
+
+StageMessage PipelineParallelGenerator::nextResult() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    result_ready_.wait(lock, [&]() { return !results_.empty() || receiver_failed_; });
+    if (results_.empty()) {
+        throw std::runtime_error("A pipeline stage exited");
+    }
+    auto message = std::move(results_.front());
+    results_.pop_front();
+    return message;
+}
+
+void PipelineParallelGenerator::checkStages() {
+    for (size_t i = 0; i < processes_.size(); i++) {
+        int status;
+        if (::waitpid(processes_[i], &status, WNOHANG) == processes_[i]) {
+            processes_.erase(processes_.begin() + i);
+            throw std::runtime_error(
+                "Pipeline stage " + std::to_string(i) + " exited during startup (status " +
+                std::to_string(WIFEXITED(status) ? WEXITSTATUS(status) : -1) + ")");
+        }
+    }
+}
+
+void PipelineParallelGenerator::shutdown() {
+    if (to_first_stage_.valid()) {
+        try {
+            StageMessage message;
+            message.type = StageMessageType::SHUTDOWN;
+            to_first_stage_.send(message);
+        } catch (const std::exception&) {
+            // The ring is already broken; the stages exit on their own
+        }
+        to_first_stage_ = StageChannel();
+    }
+
+    if (receiver_.joinable()) {
+        receiver_.join();
+    } else if (!from_last_stage_.valid()) {
+        // Startup failed before the ring was connected
+        for (pid_t pid : processes_) {
+            ::kill(pid, SIGTERM);
+        }
+    }
+    from_last_stage_ = StageChannel();
+
+    for (pid_t pid : processes_) {
+        int status;
+        ::waitpid(pid, &status, 0);
+    }
+    processes_.clear();
+}
+
+} // namespace mlx_transformer
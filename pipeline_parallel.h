@@ -0,0 +1,192 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <mlx/array.h>
+
+#include "model_loader.h"
+#include "transformer_model.h"
+
+namespace mlx_transformer {
+
+// Pipeline-parallel execution: the transformer layers are split into
+// contiguous stages, each hosted by its own process (mlx_transformer_stage)
+// with its own weights, KV caches and memory budget. Stages are chained over
+// Unix domain sockets into a ring:
+//
+//   coordinator -> stage 0 -> stage 1 -> ... -> stage n-1 -> coordinator
+//
+// Prompts are split into micro-batches that are in flight at the same time,
+// so while stage 1 runs micro-batch 0, stage 0 already runs micro-batch 1.
+// Each stage keeps one set of KV caches per micro-batch.
+
+enum class StageMessageType : uint32_t {
+    FORWARD,   // tensors: input (token ids or hidden states), padding mask
+    RESULT,    // tensors: float32 logits [batch, 1, vocab] of the last stage
+    RELEASE,   // The micro-batch is finished; drop its KV caches
+    SHUTDOWN   // Stop serving; passed along the ring before exiting
+};
+
+struct StageMessage {
+    StageMessageType type = StageMessageType::FORWARD;
+    int32_t micro_batch = 0;
+    // FORWARD: the micro-batch starts over with empty KV caches
+    bool reset = false;
+    std::vector<mlx::core::array> tensors;
+};
+
+// Connected Unix domain stream socket carrying StageMessages. Tensors are
+// sent as a small header plus their raw row-major bytes.
+class StageChannel {
+public:
+    StageChannel() = default;
+    explicit StageChannel(int fd);
+    ~StageChannel();
+
+    StageChannel(StageChannel&& other) noexcept;
+    StageChannel& operator=(StageChannel&& other) noexcept;
+    StageChannel(const StageChannel&) = delete;
+    StageChannel& operator=(const StageChannel&) = delete;
+
+    // Connects to a listening socket, retrying until it exists or the
+    // timeout expires
+    static StageChannel connect(const std::string& path, int timeout_ms = 60000);
+
+    // Like connect, but returns an invalid channel when the timeout expires
+    // before the socket accepts
+    static StageChannel tryConnect(const std::string& path, int timeout_ms);
+
+    void send(const StageMessage& message);
+
+    // Blocks for the next message; throws if the peer has gone away
+    StageMessage receive();
+
+    bool valid() const;
+
+private:
+    int fd_ = -1;
+
+    void writeAll(const void* data, size_t size);
+    void readAll(void* data, size_t size);
+};
+
+// Listening Unix domain socket; the socket file is removed on destruction
+class StageListener {
+public:
+    explicit StageListener(const std::string& path);
+    ~StageListener();
+
+    StageListener(const StageListener&) = delete;
+    StageListener& operator=(const StageListener&) = delete;
+
+    // Waits up to timeout_ms for a connection (forever if negative);
+    // returns an invalid channel on timeout
+    StageChannel accept(int timeout_ms = -1);
+    const std::string& path() const;
+
+private:
+    std::string path_;
+    int fd_ = -1;
+};
+
+struct LayerRange {
+    int first_layer = 0;
+    int end_layer = 0;
+};
+
+// Contiguous, as even as possible split of num_layers layers into num_stages
+std::vector<LayerRange> partitionLayers(int num_layers, int num_stages);
+
+// One stage: loads only its layers and serves FORWARD messages from
+// upstream, sending hidden states (or logits, from the last stage) downstream
+class PipelineStage {
+public:
+    PipelineStage(
+        const std::string& model_path,
+        LayerRange layers,
+        const QuantizationOptions& quant_options = {},
+        const KVCacheOptions& kv_options = {},
+        ComputeDtype compute_dtype = ComputeDtype::FLOAT32,
+        const MappingOptions& mapping_options = {});
+
+    // Runs until a SHUTDOWN message arrives
+    void serve(StageChannel& upstream, StageChannel& downstream);
+
+private:
+    ModelLoader loader_;
+    TransformerModel model_;
+    KVCacheOptions kv_options_;
+
+    // KV caches of the micro-batches not currently running
+    std::unordered_map<int32_t, std::vector<KVCache>> caches_;
+};
+
+struct PipelineParallelOptions {
+    int num_stages = 2;
+    // Prompts per micro-batch; at least num_stages micro-batches are needed
+    // to keep every stage busy
+    int micro_batch_size = 4;
+    std::string stage_executable = "mlx_transformer_stage";
+    // Directory for the stages' socket files
+    std::string socket_dir = "/tmp";
+    // When > 0, stage i is started under numactl and bound to NUMA node
+    // i % numa_nodes (CPU and memory)
+    int numa_nodes = 0;
+    QuantizationMode quantization = QuantizationMode::NONE;
+    ComputeDtype compute_dtype = ComputeDtype::FLOAT32;
+};
+
+// Starts the stage processes and drives generation through them. The
+// coordinator holds no weights; it only samples from the last stage's logits.
+class PipelineParallelGenerator {
+public:
+    PipelineParallelGenerator(const std::string& model_path, const PipelineParallelOptions& options = {});
+    ~PipelineParallelGenerator();
+
+    PipelineParallelGenerator(const PipelineParallelGenerator&) = delete;
+    PipelineParallelGenerator& operator=(const PipelineParallelGenerator&) = delete;
+
+    // Continuation token ids for each prompt, in order. Rows stop at the
+    // model's EOS tokens or after max_length tokens.
+    std::vector<std::vector<int>> generate(
+        const std::vector<std::vector<int>>& prompts,
+        int max_length = 100,
+        float temperature = 0.7,
+        int top_k = 50);
+
+    const std::vector<LayerRange>& stages() const;
+
+private:
+    PipelineParallelOptions options_;
+    ModelConfig config_;
+    std::vector<LayerRange> stages_;
+    std::vector<pid_t> processes_;
+
+    std::unique_ptr<StageListener> results_listener_;
+    StageChannel to_first_stage_;
+    StageChannel from_last_stage_;
+
+    // Results arrive on their own thread, so sending to stage 0 never
+    // blocks the ring while the last stage waits to deliver logits
+    std::thread receiver_;
+    std::mutex mutex_;
+    std::condition_variable result_ready_;
+    std::deque<StageMessage> results_;
+    bool receiver_failed_ = false;
+
+    void receiveResults();
+    StageMessage nextResult();
+    // Throws if a stage process has already exited
+    void checkStages();
+    void shutdown();
+};
+
+} // namespace mlx_transformer
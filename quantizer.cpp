@@ -1,8 +1,64 @@
 #include "quantizer.h"
 #include <mlx/ops.h>
+#include <stdexcept>
+#include <string>
 
 namespace mlx_transformer {
 
+int quantizationBits(QuantizationMode mode) {
+    switch (mode) {
+        case QuantizationMode::INT4: return 4;
+        case QuantizationMode::INT8: return 8;
+        default: return 0;
+    }
+}
+
+size_t LinearWeight::nbytes() const {
+    size_t bytes = weight.nbytes();
+    if (quantized()) {
+        bytes += scales.nbytes() + biases.nbytes();
+    }
+    return bytes;
+}
+
+mlx::core::array linear(const mlx::core::array& x, const LinearWeight& weight) {
+    if (!weight.quantized()) {
+        return mlx::core::matmul(x, weight.weight);
+    }
+    return mlx::core::quantized_matmul(
+        x, weight.weight, weight.scales, weight.biases, true, weight.group_size, weight.bits);
+}
+
+LinearWeight Quantizer::quantize(
+    const mlx::core::array& weight,
+    QuantizationMode mode,
+    int group_size) {
+    
+    LinearWeight result;
+    result.bits = quantizationBits(mode);
+    result.group_size = group_size;
+    if (!result.quantized()) {
+        result.weight = weight;
+        return result;
+    }
+    
+    if (weight.shape()[0] % group_size != 0) {
+        throw std::invalid_argument(
+            "Input size " + std::to_string(weight.shape()[0]) +
+            " is not a multiple of the quantization group size " + std::to_string(group_size));
+    }
+    
+    // quantize() groups along the last axis, so quantize the [out, in] transpose
+    auto [quantized, scales, biases] = mlx::core::quantize(
+        mlx::core::transpose(weight, {1, 0}), group_size, result.bits);
+    mlx::core::eval({quantized, scales, biases});
+    
+    result.weight = quantized;
+    result.scales = scales;
+    result.biases = biases;
+    return result;
+}
+
 mlx::core::array Quantizer::dequantize_int4(
     const mlx::core::array& quantized_weights,
     const mlx::core::array& scales,
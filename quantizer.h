@@ -15,10 +15,38 @@ struct QuantizationOptions {
     QuantizationMode mode = QuantizationMode::NONE;
     bool use_zero_point = true;
     bool per_channel = true;
+    // Input features sharing one scale/bias in group-wise quantization
+    int group_size = 64;
 };
 
+// Bits per weight for a mode; 0 for NONE
+int quantizationBits(QuantizationMode mode);
+
+// Weight of a linear projection. Dense weights are [in, out] and used with
+// matmul. Quantized weights come from mlx::core::quantize on the [out, in]
+// transpose and are used with quantized_matmul(transpose = true).
+struct LinearWeight {
+    mlx::core::array weight;
+    mlx::core::array scales;
+    mlx::core::array biases;
+    int bits = 0;
+    int group_size = 64;
+
+    bool quantized() const { return bits > 0; }
+    size_t nbytes() const;
+};
+
+// x @ W for either representation
+mlx::core::array linear(const mlx::core::array& x, const LinearWeight& weight);
+
 class Quantizer {
 public:
+    // Group-wise quantization of a dense [in, out] weight for linear()
+    static LinearWeight quantize(
+        const mlx::core::array& weight,
+        QuantizationMode mode,
+        int group_size = 64);
+    
     static mlx::core::array dequantize_int4(
         const mlx::core::array& quantized_weights,
         const mlx::core::array& scales,
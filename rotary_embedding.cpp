@@ -0,0 +1,65 @@
+#include "rotary_embedding.h"
+
+#include <mlx/ops.h>
+#include <cmath>
+
+namespace mlx_transformer {
+
+RotaryEmbedding::RotaryEmbedding(int64_t head_dim, float base)
+    : head_dim_(head_dim) {
+    inv_freq_.reserve(head_dim_ / 2);
+    for (int64_t i = 0; i < head_dim_ / 2; i++) {
+        inv_freq_.push_back(std::pow(static_cast<double>(base), -2.0 * i / head_dim_));
+    }
+}
+
+mlx::core::array RotaryEmbedding::apply(const mlx::core::array& x, int64_t offset) const {
+    std::vector<double> positions(x.shape()[2]);
+    for (size_t i = 0; i < positions.size(); i++) {
+        positions[i] = static_cast<double>(offset + i);
+    }
+    return rotate(x, positions);
+}
+
+mlx::core::array RotaryEmbedding::shift(const mlx::core::array& x, int64_t delta) const {
+    std::vector<double> positions(x.shape()[2], static_cast<double>(delta));
+    return rotate(x, positions);
+}
+
+mlx::core::array RotaryEmbedding::rotate(
+    const mlx::core::array& x,
+    const std::vector<double>& positions) const {
+
+    auto batch_size = x.shape()[0];
+    auto num_heads = x.shape()[1];
+    int64_t seq_length = positions.size();
+    int64_t half = head_dim_ / 2;
+
+    // Angles are computed in double precision on the host so that long-running
+    // streams with very large absolute positions keep exact rotations
+    std::vector<float> cos_table(seq_length * half);
+    std::vector<float> sin_table(seq_length * half);
+    for (int64_t p = 0; p < seq_length; p++) {
+        for (int64_t i = 0; i < half; i++) {
+            double angle = positions[p] * inv_freq_[i];
+            cos_table[p * half + i] = static_cast<float>(std::cos(angle));
+            sin_table[p * half + i] = static_cast<float>(std::sin(angle));
+        }
+    }
+
+    auto cos = mlx::core::array(cos_table.begin(), {1, 1, static_cast<int>(seq_length), static_cast<int>(half)}, mlx::core::float32);
+    auto sin = mlx::core::array(sin_table.begin(), {1, 1, static_cast<int>(seq_length), static_cast<int>(half)}, mlx::core::float32);
+
+    // Rotate-half formulation: (x1, x2) -> (x1 cos - x2 sin, x1 sin + x2 cos)
+    auto x1 = mlx::core::slice(x, {0, 0, 0, 0}, {batch_size, num_heads, static_cast<int>(seq_length), static_cast<int>(half)});
+    auto x2 = mlx::core::slice(x, {0, 0, 0, static_cast<int>(half)}, {batch_size, num_heads, static_cast<int>(seq_length), static_cast<int>(head_dim_)});
+
+    auto rotated = mlx::core::concatenate({
+        mlx::core::subtract(mlx::core::multiply(x1, cos), mlx::core::multiply(x2, sin)),
+        mlx::core::add(mlx::core::multiply(x1, sin), mlx::core::multiply(x2, cos))
+    }, 3);
+
+    return mlx::core::astype(rotated, x.dtype());
+}
+
+} // namespace mlx_transformer
\ No newline at end of file
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <mlx/array.h>
+#include <vector>
+
+namespace mlx_transformer {
+
+class RotaryEmbedding {
+public:
+    RotaryEmbedding(int64_t head_dim, float base = 10000.0);
+
+    // Rotates x [batch, heads, seq, head_dim] so that index i along the
+    // sequence axis sits at absolute position offset + i
+    mlx::core::array apply(const mlx::core::array& x, int64_t offset) const;
+
+    // Moves every position of x by the same delta. Attention scores only depend
+    // on relative positions, so this relocates a block of already-rotated keys
+    mlx::core::array shift(const mlx::core::array& x, int64_t delta) const;
+
+private:
+    int64_t head_dim_;
+    std::vector<double> inv_freq_;
+
+    mlx::core::array rotate(const mlx::core::array& x, const std::vector<double>& positions) const;
+};
+
+} // namespace mlx_transformer
\ No newline at end of file
@@ -0,0 +1,58 @@
+#include <iostream>
+#include <string>
+
+#include "pipeline_parallel.h"
+
+// One pipeline-parallel stage process. Started by PipelineParallelGenerator:
+// it listens for its upstream neighbour, connects to its downstream one,
+// loads layers [first_layer, end_layer) and serves until shut down.
+int main(int argc, char** argv) {
+    if (argc < 6) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <model_path> <first_layer> <end_layer> <listen_socket> <next_socket>"
+                  << " [quantization_mode] [fp32|fp16|bf16]" << std::endl;
+        return 1;
+    }
+
+    std::string model_path = argv[1];
+    mlx_transformer::LayerRange layers{std::stoi(argv[2]), std::stoi(argv[3])};
+    std::string listen_socket = argv[4];
+    std::string next_socket = argv[5];
+    int quantization_mode = 0;
+    std::string compute_dtype = "fp32";
+
+    if (argc >= 7) {
+        quantization_mode = std::stoi(argv[6]);
+    }
+    if (argc >= 8) {
+        compute_dtype = argv[7];
+    }
+
+    try {
+        // Listen and connect before loading, so neighbours are not kept
+        // waiting on this stage's weights
+        mlx_transformer::StageListener listener(listen_socket);
+        auto downstream = mlx_transformer::StageChannel::connect(next_socket);
+
+        mlx_transformer::QuantizationOptions quant_options;
+        quant_options.mode = static_cast<mlx_transformer::QuantizationMode>(quantization_mode);
+
+        mlx_transformer::PipelineStage stage(
+            model_path,
+            layers,
+            quant_options,
+            {},
+            mlx_transformer::parseComputeDtype(compute_dtype),
+            mlx_transformer::MappingOptions::fromEnvironment());
+
+        auto upstream = listener.accept();
+        stage.serve(upstream, downstream);
+
+    } catch (const std::exception& e) {
+        std::cerr << "Stage [" << layers.first_layer << ", " << layers.end_layer
+                  << "): " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include "stopping_criteria.h"
+
+#include <algorithm>
+#include <queue>
+
+namespace mlx_transformer {
+
+const char* finishReasonName(FinishReason reason) {
+    switch (reason) {
+        case FinishReason::LENGTH: return "length";
+        case FinishReason::EOS: return "eos";
+        case FinishReason::STOP_STRING: return "stop_string";
+        case FinishReason::DEADLINE: return "deadline";
+        case FinishReason::CANCELLED: return "cancelled";
+    }
+    return "unknown";
+}
+
+void CancellationToken::cancel() {
+    cancelled_.store(true, std::memory_order_relaxed);
+}
+
+bool CancellationToken::cancelled() const {
+    return cancelled_.load(std::memory_order_relaxed);
+}
+
+StopStringMatcher::StopStringMatcher(const std::vector<std::string>& stop_strings) {
+    Node root;
+    root.next.fill(-1);
+    nodes_.push_back(root);
+
+    // Trie of the stop strings
+    for (const auto& stop : stop_strings) {
+        if (stop.empty()) {
+            continue;
+        }
+        int current = 0;
+        for (char c : stop) {
+            auto byte = static_cast<unsigned char>(c);
+            if (nodes_[current].next[byte] < 0) {
+                Node node;
+                node.next.fill(-1);
+                node.depth = nodes_[current].depth + 1;
+                nodes_[current].next[byte] = static_cast<int>(nodes_.size());
+                nodes_.push_back(node);
+            }
+            current = nodes_[current].next[byte];
+        }
+        nodes_[current].match_length = static_cast<int>(stop.size());
+    }
+
+    // Breadth-first pass turning the trie into a full transition table:
+    // missing edges follow the failure link, so matching never backtracks
+    std::vector<int> fail(nodes_.size(), 0);
+    std::queue<int> queue;
+    for (int& child : nodes_[0].next) {
+        if (child < 0) {
+            child = 0;
+        } else {
+            queue.push(child);
+        }
+    }
+    while (!queue.empty()) {
+        int node = queue.front();
+        queue.pop();
+        nodes_[node].match_length = std::max(nodes_[node].match_length, nodes_[fail[node]].match_length);
+
+        for (int byte = 0; byte < 256; byte++) {
+            int child = nodes_[node].next[byte];
+            int fallback = nodes_[fail[node]].next[byte];
+            if (child < 0) {
+                nodes_[node].next[byte] = fallback;
+            } else {
+                fail[child] = fallback;
+                queue.push(child);
+            }
+        }
+    }
+}
+
+void StopStringMatcher::feed(const std::string& text) {
+    for (char c : text) {
+        if (matched_) {
+            return;
+        }
+        pending_.push_back(c);
+        state_ = nodes_[state_].next[static_cast<unsigned char>(c)];
+
+        // The held-back suffix always covers the match, since it is at
+        // least as long as the current node's depth
+        int length = nodes_[state_].match_length;
+        if (length > 0) {
+            pending_.resize(pending_.size() - length);
+            matched_ = true;
+        }
+    }
+}
+
+bool StopStringMatcher::matched() const {
+    return matched_;
+}
+
+std::string StopStringMatcher::release() {
+    if (matched_) {
+        return flush();
+    }
+    size_t ready = pending_.size() - nodes_[state_].depth;
+    std::string text = pending_.substr(0, ready);
+    pending_.erase(0, ready);
+    return text;
+}
+
+std::string StopStringMatcher::flush() {
+    std::string text;
+    text.swap(pending_);
+    return text;
+}
+
+} // namespace mlx_transformer
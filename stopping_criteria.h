@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace mlx_transformer {
+
+// Why a generation request stopped
+enum class FinishReason {
+    LENGTH,       // max_length tokens were generated
+    EOS,          // The model produced an end-of-sequence token
+    STOP_STRING,  // The output reached one of the request's stop strings
+    DEADLINE,     // The request's deadline passed
+    CANCELLED     // The client cancelled the request
+};
+
+const char* finishReasonName(FinishReason reason);
+
+// Cooperative cancellation. The client keeps a shared_ptr and calls cancel(),
+// e.g. when its connection drops; the decode loop checks it every step.
+class CancellationToken {
+public:
+    void cancel();
+    bool cancelled() const;
+
+private:
+    std::atomic<bool> cancelled_{false};
+};
+
+// Aho-Corasick automaton over a set of stop strings, fed the generated text
+// as it is streamed. Each character costs one table lookup however many stop
+// strings there are. Text that could still turn into a stop string is held
+// back, so released text never contains any part of a matched stop string.
+class StopStringMatcher {
+public:
+    explicit StopStringMatcher(const std::vector<std::string>& stop_strings);
+
+    // Appends generated text. Once a stop string is completed the matcher
+    // drops the stop string and anything after it.
+    void feed(const std::string& text);
+
+    bool matched() const;
+
+    // Text that is safe to emit now
+    std::string release();
+
+    // Everything still held back; called when generation ends without a match
+    std::string flush();
+
+private:
+    struct Node {
+        std::array<int, 256> next;
+        int depth = 0;
+        // Length of the longest stop string ending at this node, 0 if none
+        int match_length = 0;
+    };
+
+    std::vector<Node> nodes_;
+    int state_ = 0;
+    bool matched_ = false;
+    std::string pending_;
+};
+
+} // namespace mlx_transformer
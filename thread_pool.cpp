@@ -0,0 +1,113 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+
+namespace mlx_transformer {
+
+ThreadPool::ThreadPool(size_t num_threads) {
+    // The caller works too, so one thread fewer is spawned
+    for (size_t i = 1; i < num_threads; i++) {
+        workers_.emplace_back([this]() { workerLoop(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+ThreadPool& ThreadPool::global() {
+    static ThreadPool pool([]() -> size_t {
+        const char* value = std::getenv("MLX_TRANSFORMER_CPU_THREADS");
+        if (value != nullptr && *value != '\0') {
+            return std::max(1, std::stoi(value));
+        }
+        return std::max(1u, std::thread::hardware_concurrency());
+    }());
+    return pool;
+}
+
+size_t ThreadPool::size() const {
+    return workers_.size() + 1;
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& fn) {
+    if (count <= 0) {
+        return;
+    }
+    if (count == 1 || workers_.empty()) {
+        for (int i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    std::lock_guard<std::mutex> call(call_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        job_ = &fn;
+        count_ = count;
+        done_ = 0;
+        next_.store(0);
+        generation_++;
+    }
+    wake_.notify_all();
+
+    runJob(fn, count);
+
+    // Workers must have left the job too, or a late one could pick up the
+    // next job's indices with this job's function
+    std::unique_lock<std::mutex> lock(mutex_);
+    finished_.wait(lock, [&]() { return done_ == count_ && active_workers_ == 0; });
+    job_ = nullptr;
+}
+
+void ThreadPool::workerLoop() {
+    uint64_t seen = 0;
+    while (true) {
+        const std::function<void(int)>* job;
+        int count;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&]() { return stop_ || (job_ != nullptr && generation_ != seen); });
+            if (stop_) {
+                return;
+            }
+            seen = generation_;
+            job = job_;
+            count = count_;
+            active_workers_++;
+        }
+
+        runJob(*job, count);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        active_workers_--;
+        finished_.notify_all();
+    }
+}
+
+void ThreadPool::runJob(const std::function<void(int)>& fn, int count) {
+    int finished = 0;
+    for (int i = next_.fetch_add(1); i < count; i = next_.fetch_add(1)) {
+        fn(i);
+        finished++;
+    }
+    if (finished > 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ += finished;
+        if (done_ == count_) {
+            finished_.notify_all();
+        }
+    }
+}
+
+} // namespace mlx_transformer
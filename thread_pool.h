@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mlx_transformer {
+
+// Persistent worker threads for the custom CPU kernels. Spawning threads per
+// call would cost more than a decode step's attention for short contexts.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t num_threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // One thread per hardware thread, or MLX_TRANSFORMER_CPU_THREADS
+    static ThreadPool& global();
+
+    // Threads available to a parallelFor, including the caller
+    size_t size() const;
+
+    // Runs fn(0) .. fn(count - 1) across the workers and the calling thread
+    // and returns once all calls have finished. Calls from several threads
+    // are serialized.
+    void parallelFor(int count, const std::function<void(int)>& fn);
+
+private:
+    std::vector<std::thread> workers_;
+
+    std::mutex call_mutex_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable finished_;
+
+    // Current job, guarded by mutex_ except for the index counter
+    const std::function<void(int)>* job_ = nullptr;
+    int count_ = 0;
+    int done_ = 0;
+    int active_workers_ = 0;
+    uint64_t generation_ = 0;
+    bool stop_ = false;
+    std::atomic<int> next_{0};
+
+    void workerLoop();
+    void runJob(const std::function<void(int)>& fn, int count);
+};
+
+} // namespace mlx_transformer
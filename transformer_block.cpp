@@ -1,6 +1,10 @@
 #include "transformer_block.h"
 
+#include <mlx/ops.h>
 #include <mlx/nn/layers.h>
+#include <tuple>
+
+#include "fused_ops.h"
 
 namespace mlx_transformer {
 
@@ -9,63 +13,64 @@ TransformerBlock::TransformerBlock(
     int64_t intermediate_size,
     int64_t num_attention_heads,
     float layer_norm_epsilon,
-    float dropout_prob)
+    float dropout_prob,
+    float rope_theta,
+    const KVCacheOptions& kv_options)
     : hidden_size_(hidden_size),
       layer_norm_epsilon_(layer_norm_epsilon) {
     
     // Initialize components
     attention_ = std::make_unique<AttentionImplementation>(
-        hidden_size, num_attention_heads, dropout_prob);
+        hidden_size, num_attention_heads, dropout_prob, rope_theta, kv_options);
     
     feed_forward_ = std::make_unique<FeedForward>(
         hidden_size, intermediate_size, dropout_prob);
     
-    // Layer normalization parameters
-    attention_ln_weight_ = mlx::core::ones({hidden_size_}, mlx::core::float32);
-    attention_ln_bias_ = mlx::core::zeros({hidden_size_}, mlx::core::float32);
-    
-    ffn_ln_weight_ = mlx::core::ones({hidden_size_}, mlx::core::float32);
-    ffn_ln_bias_ = mlx::core::zeros({hidden_size_}, mlx::core::float32);
+    // Layer normalization parameters are assigned in loadWeights
 }
 
 void TransformerBlock::loadWeights(ModelLoader& loader, const std::string& prefix) {
+    // Loaded in execution order, which is also the order of a packed file.
+    // Layer norm weights are kept in float32; some models have no norm bias,
+    // and only then is a zero bias created.
+    attention_ln_weight_ = loader.loadWeight(prefix + ".attention_norm.weight");
+    attention_ln_bias_ = loader.hasWeight(prefix + ".attention_norm.bias")
+        ? loader.loadWeight(prefix + ".attention_norm.bias")
+        : mlx::core::zeros({static_cast<int>(hidden_size_)}, mlx::core::float32);
+    
     // Load attention weights
     attention_->loadWeights(loader, prefix + ".attention");
     
+    ffn_ln_weight_ = loader.loadWeight(prefix + ".mlp_norm.weight");
+    ffn_ln_bias_ = loader.hasWeight(prefix + ".mlp_norm.bias")
+        ? loader.loadWeight(prefix + ".mlp_norm.bias")
+        : mlx::core::zeros({static_cast<int>(hidden_size_)}, mlx::core::float32);
+    
     // Load feed-forward weights
     feed_forward_->loadWeights(loader, prefix + ".mlp");
-    
-    // Load layer norm weights
-    attention_ln_weight_ = loader.loadWeight(prefix + ".attention_norm.weight");
-    // Some models might not have bias
-    try {
-        attention_ln_bias_ = loader.loadWeight(prefix + ".attention_norm.bias");
-    } catch (...) {
-        // Bias not present, use zeros
-    }
-    
-    ffn_ln_weight_ = loader.loadWeight(prefix + ".mlp_norm.weight");
-    try {
-        ffn_ln_bias_ = loader.loadWeight(prefix + ".mlp_norm.bias");
-    } catch (...) {
-        // Bias not present, use zeros
-    }
 }
 
 mlx::core::array TransformerBlock::forward(
     const mlx::core::array& hidden_states,
-    const mlx::core::array& attention_mask) {
+    const mlx::core::array& attention_mask,
+    bool use_cache) {
     
     // First sublayer: Self-attention with residual connection
-    auto norm_input = mlx::nn::layer_norm(
-        hidden_states, attention_ln_weight_, attention_ln_bias_, layer_norm_epsilon_);
+    auto norm_input = normalize(hidden_states, attention_ln_weight_, attention_ln_bias_);
     
-    auto attn_output = attention_->forward(norm_input, attention_mask);
-    auto residual = mlx::core::add(hidden_states, attn_output);
+    auto attn_output = attention_->forward(norm_input, attention_mask, use_cache);
     
-    // Second sublayer: Feed-forward network with residual connection
-    auto ffn_norm_input = mlx::nn::layer_norm(
-        residual, ffn_ln_weight_, ffn_ln_bias_, layer_norm_epsilon_);
+    // Second sublayer: Feed-forward network with residual connection. On the
+    // CPU the residual add and the norm run as one pass writing both results.
+    mlx::core::array residual;
+    mlx::core::array ffn_norm_input;
+    if (fusedOpsAvailable() && attn_output.dtype() == hidden_states.dtype()) {
+        std::tie(residual, ffn_norm_input) = addLayerNorm(
+            attn_output, hidden_states, ffn_ln_weight_, ffn_ln_bias_, layer_norm_epsilon_);
+    } else {
+        residual = mlx::core::add(hidden_states, attn_output);
+        ffn_norm_input = normalize(residual, ffn_ln_weight_, ffn_ln_bias_);
+    }
     
     auto ffn_output = feed_forward_->forward(ffn_norm_input);
     auto output = mlx::core::add(residual, ffn_output);
@@ -81,4 +86,43 @@ void TransformerBlock::updateKVCache(const mlx::core::array& key, const mlx::cor
     attention_->updateKVCache(key, value);
 }
 
+void TransformerBlock::clearKVCache() {
+    attention_->clearKVCache();
+}
+
+void TransformerBlock::swapKVCache(KVCache& cache) {
+    attention_->swapKVCache(cache);
+}
+
+void TransformerBlock::selectKVRows(const mlx::core::array& indices) {
+    attention_->selectKVRows(indices);
+}
+
+void TransformerBlock::forkKVCache(int64_t num_rows) {
+    attention_->forkKVCache(num_rows);
+}
+
+void TransformerBlock::restoreKVCache(
+    const mlx::core::array& keys,
+    const mlx::core::array& values,
+    int64_t tokens_seen,
+    int64_t evicted) {
+    
+    attention_->restoreKVCache(keys, values, tokens_seen, evicted);
+}
+
+const KVCache& TransformerBlock::kvCache() const {
+    return attention_->kvCache();
+}
+
+mlx::core::array TransformerBlock::normalize(
+    const mlx::core::array& x,
+    const mlx::core::array& weight,
+    const mlx::core::array& bias) const {
+    
+    auto normed = mlx::nn::layer_norm(
+        mlx::core::astype(x, mlx::core::float32), weight, bias, layer_norm_epsilon_);
+    return mlx::core::astype(normed, x.dtype());
+}
+
 } // namespace mlx_transformer
\ No newline at end of file
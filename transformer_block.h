@@ -18,19 +18,43 @@ public:
         int64_t intermediate_size,
         int64_t num_attention_heads,
         float layer_norm_epsilon = 1e-5,
-        float dropout_prob = 0.0);
+        float dropout_prob = 0.0,
+        float rope_theta = 10000.0,
+        const KVCacheOptions& kv_options = {});
     
     void loadWeights(ModelLoader& loader, const std::string& prefix);
     
     mlx::core::array forward(
         const mlx::core::array& hidden_states,
-        const mlx::core::array& attention_mask = {});
+        const mlx::core::array& attention_mask = {},
+        bool use_cache = false);
     
     // Get KV cache for this layer
     std::pair<mlx::core::array, mlx::core::array> getKVCache() const;
     
     // Update KV cache for this layer
     void updateKVCache(const mlx::core::array& key, const mlx::core::array& value);
+    
+    // Clear KV cache for this layer
+    void clearKVCache();
+    
+    // Keep only the given batch rows of this layer's KV cache
+    void selectKVRows(const mlx::core::array& indices);
+    
+    // Switch this layer's KV cache to shared-prefix mode with num_rows rows
+    void forkKVCache(int64_t num_rows);
+    
+    // Replace this layer's KV cache with saved state
+    void restoreKVCache(
+        const mlx::core::array& keys,
+        const mlx::core::array& values,
+        int64_t tokens_seen,
+        int64_t evicted);
+    
+    // Exchange this layer's KV cache with `cache`
+    void swapKVCache(KVCache& cache);
+    
+    const KVCache& kvCache() const;
 
 private:
     int64_t hidden_size_;
@@ -43,6 +67,12 @@ private:
     mlx::core::array attention_ln_bias_;
     mlx::core::array ffn_ln_weight_;
     mlx::core::array ffn_ln_bias_;
+    
+    // Layer norm computed in float32, returned in the input's dtype
+    mlx::core::array normalize(
+        const mlx::core::array& x,
+        const mlx::core::array& weight,
+        const mlx::core::array& bias) const;
 };
 
 } // namespace mlx_transformer
\ No newline at end of file
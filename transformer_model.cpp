@@ -3,14 +3,74 @@
 #include <mlx/ops.h>
 #include <mlx/nn/layers.h>
 #include <mlx/random.h>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
 
 namespace mlx_transformer {
 
-TransformerModel::TransformerModel(const ModelConfig& config)
-    : config_(config) {
+namespace {
+
+// Large negative score that is still finite in the mask dtype
+float maskValue(mlx::core::Dtype dtype) {
+    return dtype == mlx::core::float16 ? -6e4f : -1e9f;
+}
+
+// Row/column cache indices for seq_length new queries appended after
+// past_length cached positions
+std::pair<mlx::core::array, mlx::core::array> maskIndices(int64_t seq_length, int64_t past_length) {
+    auto rows = mlx::core::reshape(
+        mlx::core::arange(static_cast<int>(past_length), static_cast<int>(past_length + seq_length)),
+        {static_cast<int>(seq_length), 1});
+    auto cols = mlx::core::reshape(
+        mlx::core::arange(static_cast<int>(past_length + seq_length)),
+        {1, static_cast<int>(past_length + seq_length)});
+    return {rows, cols};
+}
+
+// Additive causal mask: query i may see cache entries 0..past_length + i
+mlx::core::array causalMask(int64_t seq_length, int64_t past_length, mlx::core::Dtype dtype) {
+    auto [rows, cols] = maskIndices(seq_length, past_length);
+    return mlx::core::astype(
+        mlx::core::where(
+            mlx::core::less_equal(cols, rows),
+            mlx::core::array(0.0f),
+            mlx::core::array(maskValue(dtype))),
+        dtype);
+}
+
+// Causal mask that also hides padded keys. key_padding is [batch, keys] with
+// 1 for real tokens. Every query keeps its own position visible so rows for
+// padding queries never end up fully masked.
+mlx::core::array paddedCausalMask(
+    const mlx::core::array& key_padding,
+    int64_t seq_length,
+    int64_t past_length,
+    mlx::core::Dtype dtype) {
+    
+    auto [rows, cols] = maskIndices(seq_length, past_length);
+    auto batch_size = key_padding.shape()[0];
+    auto valid = mlx::core::reshape(
+        mlx::core::astype(key_padding, mlx::core::bool_),
+        {batch_size, 1, 1, key_padding.shape()[1]});
+    
+    auto visible = mlx::core::logical_and(
+        mlx::core::less_equal(cols, rows),
+        mlx::core::logical_or(valid, mlx::core::equal(cols, rows)));
+    
+    return mlx::core::astype(
+        mlx::core::where(visible, mlx::core::array(0.0f), mlx::core::array(maskValue(dtype))),
+        dtype);
+}
+
+} // namespace
+
+TransformerModel::TransformerModel(const ModelConfig& config, const KVCacheOptions& kv_options)
+    : config_(config), kv_options_(kv_options) {
     
-    // Initialize embedding layers
-    token_embedding_ = mlx::core::zeros({config.vocab_size, config.hidden_size}, mlx::core::float32);
+    // Only the module structure is created here. Embedding, LM head and norm
+    // tensors are bound directly to the loaded weights in loadWeights, so no
+    // throwaway vocab- or layer-sized placeholders are allocated.
     
     // Initialize transformer layers
     layers_.reserve(config.num_hidden_layers);
@@ -19,113 +79,343 @@ TransformerModel::TransformerModel(const ModelConfig& config)
             config.hidden_size,
             config.intermediate_size,
             config.num_attention_heads,
-            config.layer_norm_epsilon));
+            config.layer_norm_epsilon,
+            0.0,
+            config.rope_theta,
+            kv_options));
     }
-    
-    // Initialize LM head (projection to vocabulary)
-    lm_head_weight_ = mlx::core::zeros({config.hidden_size, config.vocab_size}, mlx::core::float32);
-    
-    // Initialize final layer norm
-    final_ln_weight_ = mlx::core::ones({config.hidden_size}, mlx::core::float32);
-    final_ln_bias_ = mlx::core::zeros({config.hidden_size}, mlx::core::float32);
+    end_layer_ = static_cast<int>(layers_.size());
 }
 
 void TransformerModel::loadWeights(ModelLoader& loader) {
+    loadWeights(loader, 0, numLayers());
+}
+
+void TransformerModel::loadWeights(ModelLoader& loader, int first_layer, int end_layer) {
+    if (first_layer < 0 || first_layer >= end_layer || end_layer > numLayers()) {
+        throw std::invalid_argument("Invalid layer range for loading weights");
+    }
+    first_layer_ = first_layer;
+    end_layer_ = end_layer;
+    
+    bool last_stage = end_layer == numLayers();
+    bool tied = config_.tie_word_embeddings || !loader.hasWeight("lm_head.weight");
+    
     // Load embedding
-    token_embedding_ = loader.loadWeight("embedding.weight");
+    if (first_layer == 0 || (last_stage && tied)) {
+        token_embedding_ = loader.loadWeight("embedding.weight");
+    }
     
     // Load transformer layers
-    for (int i = 0; i < config_.num_hidden_layers; i++) {
+    for (int i = first_layer; i < end_layer; i++) {
         layers_[i]->loadWeights(loader, "transformer.layers." + std::to_string(i));
     }
     
-    // Load LM head
-    lm_head_weight_ = loader.loadWeight("lm_head.weight");
+    if (!last_stage) {
+        return;
+    }
     
     // Load final layer norm
     final_ln_weight_ = loader.loadWeight("transformer.ln_f.weight");
-    try {
-        final_ln_bias_ = loader.loadWeight("transformer.ln_f.bias");
-    } catch (...) {
-        // Bias not present, use zeros
+    final_ln_bias_ = loader.hasWeight("transformer.ln_f.bias")
+        ? loader.loadWeight("transformer.ln_f.bias")
+        : mlx::core::zeros({static_cast<int>(config_.hidden_size)}, mlx::core::float32);
+    
+    // Load LM head last, the order the forward pass uses it in. Tied
+    // checkpoints (or ones without a separate head) share the embedding
+    // tensor; otherwise the [vocab, hidden] checkpoint layout is transposed
+    // once at load (or by the converter) instead of on every forward call.
+    tied_lm_head_ = tied;
+    if (tied_lm_head_) {
+        lm_head_weight_ = token_embedding_;
+    } else {
+        lm_head_weight_ = loader.loadTransposed("lm_head.weight");
     }
 }
 
 mlx::core::array TransformerModel::forward(
     const mlx::core::array& input_ids,
-    const mlx::core::array& attention_mask) {
+    const mlx::core::array& attention_mask,
+    bool use_cache,
+    LogitsMode logits_mode) {
+    
+    auto hidden_states = forwardHidden(input_ids, attention_mask, use_cache);
+    
+    // The vocab projection is the largest matmul of a decode step; skip it
+    // for positions whose logits nobody reads
+    if (logits_mode == LogitsMode::LAST) {
+        auto shape = hidden_states.shape();
+        hidden_states = mlx::core::slice(
+            hidden_states, {0, shape[1] - 1, 0}, {shape[0], shape[1], shape[2]});
+    }
+    
+    return computeLogits(hidden_states);
+}
+
+mlx::core::array TransformerModel::forwardHidden(
+    const mlx::core::array& input_ids,
+    const mlx::core::array& attention_mask,
+    bool use_cache,
+    int num_layers) {
+    
+    if (num_layers < 0 || num_layers > static_cast<int>(layers_.size())) {
+        num_layers = static_cast<int>(layers_.size());
+    }
+    
+    auto seq_length = input_ids.shape()[1];
+    auto mask = attentionMask(attention_mask, seq_length, use_cache);
     
     // Get input embeddings
     auto hidden_states = mlx::core::take(token_embedding_, input_ids, 0);
     
     // Pass through transformer layers
-    for (int i = 0; i < layers_.size(); i++) {
-        hidden_states = layers_[i]->forward(hidden_states, attention_mask);
+    for (int i = 0; i < num_layers; i++) {
+        hidden_states = layers_[i]->forward(hidden_states, mask, use_cache);
+    }
+    
+    return hidden_states;
+}
+
+mlx::core::array TransformerModel::forwardStage(
+    const mlx::core::array& input,
+    const mlx::core::array& attention_mask,
+    bool use_cache,
+    LogitsMode logits_mode) {
+    
+    auto seq_length = input.shape()[1];
+    auto mask = attentionMask(attention_mask, seq_length, use_cache);
+    
+    auto hidden_states = first_layer_ == 0 ? mlx::core::take(token_embedding_, input, 0) : input;
+    for (int i = first_layer_; i < end_layer_; i++) {
+        hidden_states = layers_[i]->forward(hidden_states, mask, use_cache);
     }
     
-    // Apply final layer norm
-    hidden_states = mlx::nn::layer_norm(
-        hidden_states, final_ln_weight_, final_ln_bias_, config_.layer_norm_epsilon);
+    if (end_layer_ < numLayers()) {
+        return hidden_states;
+    }
+    if (logits_mode == LogitsMode::LAST) {
+        auto shape = hidden_states.shape();
+        hidden_states = mlx::core::slice(
+            hidden_states, {0, shape[1] - 1, 0}, {shape[0], shape[1], shape[2]});
+    }
+    return computeLogits(hidden_states);
+}
+
+int TransformerModel::firstLayer() const {
+    return first_layer_;
+}
+
+int TransformerModel::endLayer() const {
+    return end_layer_;
+}
+
+mlx::core::array TransformerModel::finalNorm(const mlx::core::array& hidden_states) {
+    auto normed = mlx::nn::layer_norm(
+        mlx::core::astype(hidden_states, mlx::core::float32),
+        final_ln_weight_, final_ln_bias_, config_.layer_norm_epsilon);
+    return mlx::core::astype(normed, hidden_states.dtype());
+}
+
+mlx::core::array TransformerModel::computeLogits(const mlx::core::array& hidden_states) {
+    // Apply final layer norm in float32
+    auto normed = finalNorm(hidden_states);
+    
+    // Project to vocabulary in the compute dtype; logits are returned as
+    // float32 so sampling and softmax stay full precision. The tied embedding
+    // is used through a transposed view, which matmul consumes without a copy.
+    auto logits = tied_lm_head_
+        ? mlx::core::matmul(normed, mlx::core::transpose(lm_head_weight_, {1, 0}))
+        : mlx::core::matmul(normed, lm_head_weight_);
+    
+    return mlx::core::astype(logits, mlx::core::float32);
+}
+
+mlx::core::array TransformerModel::scoreTokens(
+    const mlx::core::array& input_ids,
+    const mlx::core::array& attention_mask,
+    bool use_cache) {
+    
+    auto hidden_states = forwardHidden(input_ids, attention_mask, use_cache);
     
-    // Project to vocabulary
-    auto logits = mlx::core::matmul(hidden_states, mlx::core::transpose(lm_head_weight_, {1, 0}));
+    // Position i predicts token i + 1; the last position predicts nothing
+    auto shape = hidden_states.shape();
+    hidden_states = mlx::core::slice(hidden_states, {0, 0, 0}, {shape[0], shape[1] - 1, shape[2]});
+    auto targets = mlx::core::slice(input_ids, {0, 1}, {shape[0], shape[1]});
     
-    return logits;
+    return tokenLogprobs(computeLogits(hidden_states), targets);
+}
+
+mlx::core::array TransformerModel::tokenLogprobs(const mlx::core::array& logits, const mlx::core::array& targets) {
+    auto target_logits = mlx::core::take_along_axis(
+        logits, mlx::core::expand_dims(mlx::core::astype(targets, mlx::core::int32), -1), -1);
+    return mlx::core::subtract(
+        mlx::core::squeeze(target_logits, -1),
+        mlx::core::logsumexp(logits, -1));
 }
 
 mlx::core::array TransformerModel::generate_next_token(
     const mlx::core::array& input_ids,
     float temperature,
-    int top_k) {
-    
-    // Forward pass to get logits for the last token
-    auto logits = forward(input_ids);
+    int top_k,
+    const mlx::core::array& attention_mask,
+    const mlx::core::array& allowed_tokens) {
     
-    // Get logits for the last token in the sequence
-    auto last_token_logits = mlx::core::take(
-        logits,
-        mlx::core::array({logits.shape()[1] - 1}),
-        1);
+    // Forward pass over the new tokens, reusing cached keys/values, with the
+    // LM head applied to the last position only
+    auto logits = forward(input_ids, attention_mask, true, LogitsMode::LAST);
+    return sample(mlx::core::squeeze(logits, 1), temperature, top_k, allowed_tokens);
+}
+
+mlx::core::array TransformerModel::sample(
+    const mlx::core::array& logits,
+    float temperature,
+    int top_k,
+    const mlx::core::array& allowed_tokens) {
+    auto last_token_logits = logits;
     
-    last_token_logits = mlx::core::squeeze(last_token_logits, 1);
+    // Apply the constraint mask first so top-k picks among allowed tokens only
+    if (allowed_tokens.size() != 0) {
+        last_token_logits = mlx::core::where(
+            allowed_tokens,
+            last_token_logits,
+            mlx::core::array(-std::numeric_limits<float>::infinity()));
+    }
     
     // Apply temperature
     if (temperature > 0) {
-        last_token_logits = mlx::core::divide(last_token_logits, temperature);
-    }
-    
-    // Apply top-k sampling if specified
-    if (top_k > 0) {
-        // Sort logits in descending order and keep only top-k
-        auto sorted_indices = mlx::core::argsort(last_token_logits, -1, true);
-        sorted_indices = mlx::core::slice(sorted_indices, {0}, {top_k});
-        
-        // Create a mask for top-k indices
-        auto mask = mlx::core::zeros_like(last_token_logits);
-        mask = mlx::core::scatter(mask, sorted_indices, mlx::core::ones({top_k}, mask.dtype()), 0);
-        
-        // Apply mask to logits (set non-top-k values to -inf)
-        auto masked_logits = mlx::core::where(
-            mask,
-            last_token_logits,
-            mlx::core::full_like(last_token_logits, -1e10));
-        
-        last_token_logits = masked_logits;
+        last_token_logits = mlx::core::divide(last_token_logits, mlx::core::array(temperature));
     }
     
-    // Apply softmax to get probabilities
-    auto probs = mlx::core::softmax(last_token_logits, -1);
+    // Apply top-k sampling if specified: everything below each row's k-th
+    // largest logit is masked out
+    if (top_k > 0 && top_k < last_token_logits.shape()[1]) {
+        auto kth_largest = mlx::core::min(mlx::core::topk(last_token_logits, top_k, -1), -1, true);
+        last_token_logits = mlx::core::where(
+            mlx::core::less(last_token_logits, kth_largest),
+            mlx::core::full_like(last_token_logits, -1e10),
+            last_token_logits);
+    }
     
-    // Sample from the distribution
-    auto next_token = mlx::core::random::categorical(probs);
+    // Sample from the distribution; categorical normalizes the logits itself
+    auto next_token = mlx::core::random::categorical(last_token_logits, -1);
     
     return next_token;
 }
 
+int TransformerModel::numLayers() const {
+    return static_cast<int>(layers_.size());
+}
+
 void TransformerModel::clearKVCache() {
     for (auto& layer : layers_) {
-        layer->updateKVCache(mlx::core::array(), mlx::core::array());
+        layer->clearKVCache();
+    }
+}
+
+void TransformerModel::selectBatch(const mlx::core::array& indices) {
+    for (auto& layer : layers_) {
+        layer->selectKVRows(indices);
+    }
+}
+
+void TransformerModel::forkKVCache(int64_t num_rows) {
+    for (auto& layer : layers_) {
+        layer->forkKVCache(num_rows);
+    }
+}
+
+void TransformerModel::swapKVCaches(std::vector<KVCache>& caches) {
+    caches.resize(layers_.size(), KVCache(kv_options_));
+    for (size_t i = 0; i < layers_.size(); i++) {
+        layers_[i]->swapKVCache(caches[i]);
     }
 }
 
+void TransformerModel::restoreKVCache(
+    int layer,
+    const mlx::core::array& keys,
+    const mlx::core::array& values,
+    int64_t tokens_seen,
+    int64_t evicted) {
+    
+    layers_.at(layer)->restoreKVCache(keys, values, tokens_seen, evicted);
+}
+
+const KVCache& TransformerModel::kvCache(int layer) const {
+    return layers_.at(layer)->kvCache();
+}
+
+const ModelConfig& TransformerModel::config() const {
+    return config_;
+}
+
+size_t TransformerModel::kvCacheBytes() const {
+    size_t bytes = 0;
+    for (const auto& layer : layers_) {
+        bytes += layer->kvCache().nbytes();
+    }
+    return bytes;
+}
+
+size_t TransformerModel::kvCacheIndependentBytes() const {
+    size_t bytes = 0;
+    for (const auto& layer : layers_) {
+        bytes += layer->kvCache().independentBytes();
+    }
+    return bytes;
+}
+
+size_t TransformerModel::estimateKVCacheBytes(int64_t batch_size, int64_t max_tokens) const {
+    int64_t positions = kv_options_.bounded() ? std::min(max_tokens, kv_options_.capacity()) : max_tokens;
+    // Keys and values, [batch, heads, positions, head_dim] each, in the weights' dtype
+    return static_cast<size_t>(config_.num_hidden_layers) * 2 * batch_size * positions *
+        config_.hidden_size * toMlxDtype(config_.compute_dtype).size();
+}
+
+size_t TransformerModel::estimateActivationBytes(
+    int64_t batch_size,
+    int64_t seq_length,
+    int64_t past_length) const {
+    
+    // Q/K/V/attention output and the FFN gate/up/product of one layer are live
+    // at the same time, plus float32 attention scores and the float32 logits
+    // of the last position
+    size_t tokens = static_cast<size_t>(batch_size) * seq_length;
+    size_t per_token = 4 * config_.hidden_size + 3 * config_.intermediate_size;
+    size_t scores = tokens * config_.num_attention_heads * (past_length + seq_length) * sizeof(float);
+    size_t logits = static_cast<size_t>(batch_size) * config_.vocab_size * sizeof(float);
+    return tokens * per_token * toMlxDtype(config_.compute_dtype).size() + scores + logits;
+}
+
+mlx::core::array TransformerModel::attentionMask(
+    const mlx::core::array& padding_mask,
+    int64_t seq_length,
+    bool use_cache) const {
+    
+    auto dtype = toMlxDtype(config_.compute_dtype);
+    // The first layer this model runs; as a pipeline stage the others are empty
+    int64_t past_length = use_cache ? kvCache(first_layer_).retainedLength(seq_length) : 0;
+    
+    if (padding_mask.size() == 0) {
+        // Single-token steps without padding need no mask at all
+        return seq_length > 1 ? causalMask(seq_length, past_length, dtype) : mlx::core::array();
+    }
+    
+    // The padding mask covers every token since the cache was cleared; keep
+    // only the columns of positions that survive eviction (sinks + tail)
+    auto key_padding = padding_mask;
+    auto batch_size = padding_mask.shape()[0];
+    int64_t total = padding_mask.shape()[1];
+    int64_t kept = past_length + seq_length;
+    if (kept < total) {
+        int sinks = static_cast<int>(std::min(kv_options_.sink_tokens, past_length));
+        key_padding = mlx::core::concatenate({
+            mlx::core::slice(padding_mask, {0, 0}, {batch_size, sinks}),
+            mlx::core::slice(padding_mask, {0, static_cast<int>(total - (kept - sinks))}, {batch_size, static_cast<int>(total)})
+        }, 1);
+    }
+    
+    return paddedCausalMask(key_padding, seq_length, past_length, dtype);
+}
+
 } // namespace mlx_transformer
\ No newline at end of file
@@ -9,33 +9,163 @@
 
 namespace mlx_transformer {
 
+// Which positions of the sequence get a final norm + LM head projection
+enum class LogitsMode {
+    ALL,   // Every position, e.g. for scoring
+    LAST   // Only the last position, which is all that sampling needs
+};
+
 class TransformerModel {
 public:
-    TransformerModel(const ModelConfig& config);
+    TransformerModel(const ModelConfig& config, const KVCacheOptions& kv_options = {});
     
     void loadWeights(ModelLoader& loader);
     
+    // Loads only what a pipeline stage running layers [first_layer,
+    // end_layer) needs: the embedding for the first stage, the final norm and
+    // LM head for the last one. The remaining layers stay empty.
+    void loadWeights(ModelLoader& loader, int first_layer, int end_layer);
+    
+    // attention_mask is an optional [batch, tokens] padding mask (1 for real
+    // tokens, 0 for padding) covering every token since the KV cache was
+    // cleared, including the new ones. It is combined with the causal mask
+    // and kept in step with KV eviction. Without it, all tokens are real.
     mlx::core::array forward(
         const mlx::core::array& input_ids,
-        const mlx::core::array& attention_mask = {});
+        const mlx::core::array& attention_mask = {},
+        bool use_cache = false,
+        LogitsMode logits_mode = LogitsMode::ALL);
+    
+    // Embedding and transformer layers only: hidden states before the final
+    // norm. num_layers >= 0 exits early after that many layers; the KV caches
+    // of the skipped layers are left untouched, so early exit is only
+    // meaningful without the cache.
+    mlx::core::array forwardHidden(
+        const mlx::core::array& input_ids,
+        const mlx::core::array& attention_mask = {},
+        bool use_cache = false,
+        int num_layers = -1);
+    
+    // Runs this model's stage (see loadWeights): token ids [batch, seq] in
+    // for the first stage, hidden states otherwise; float32 logits out of the
+    // last stage, hidden states otherwise. The padding mask is the same as
+    // for forward.
+    mlx::core::array forwardStage(
+        const mlx::core::array& input,
+        const mlx::core::array& attention_mask = {},
+        bool use_cache = false,
+        LogitsMode logits_mode = LogitsMode::LAST);
+    
+    int firstLayer() const;
+    int endLayer() const;
+    
+    // Final norm, computed in float32 and returned in the input's dtype
+    mlx::core::array finalNorm(const mlx::core::array& hidden_states);
+    
+    // Final norm + LM head for hidden states [batch, positions, hidden];
+    // returns float32 logits
+    mlx::core::array computeLogits(const mlx::core::array& hidden_states);
+    
+    int numLayers() const;
+    
+    // Log-probability of every token of input_ids[:, 1:] given all tokens
+    // before it, cached ones included: [batch, seq - 1] float32
+    mlx::core::array scoreTokens(
+        const mlx::core::array& input_ids,
+        const mlx::core::array& attention_mask = {},
+        bool use_cache = false);
+    
+    // log_softmax(logits)[..., target] for float32 logits [batch, positions,
+    // vocab] and targets [batch, positions]. Only the target logits and one
+    // logsumexp per position are computed; the full log-softmax tensor is
+    // never materialized.
+    static mlx::core::array tokenLogprobs(const mlx::core::array& logits, const mlx::core::array& targets);
     
-    // Generate next token for sequence generation
+    // Generate next token for sequence generation. input_ids holds only the
+    // tokens not yet in the KV cache (the prompt first, then one token per step).
+    // allowed_tokens is an optional bool mask ([vocab] or [batch, vocab]) from
+    // a decoding constraint; disallowed tokens are never sampled.
     mlx::core::array generate_next_token(
         const mlx::core::array& input_ids,
         float temperature = 1.0,
-        int top_k = 0);
+        int top_k = 0,
+        const mlx::core::array& attention_mask = {},
+        const mlx::core::array& allowed_tokens = {});
+    
+    // Samples one token per row from float32 logits [batch, vocab]
+    static mlx::core::array sample(
+        const mlx::core::array& logits,
+        float temperature,
+        int top_k,
+        const mlx::core::array& allowed_tokens = {});
     
     // Clear KV cache for all layers
     void clearKVCache();
+    
+    // Keep only the given batch rows of every layer's KV cache, e.g. to
+    // retire finished sequences or to fan one row out to several
+    void selectBatch(const mlx::core::array& indices);
+    
+    // Fan a single-row cache out to num_rows rows that share it as a prefix
+    // by reference; rows then diverge with block-level copy-on-write. Used
+    // for n-best sampling and beam search. Needs an unbounded cache.
+    void forkKVCache(int64_t num_rows);
+    
+    // Exchanges every layer's KV cache with caches[layer]; caches is resized
+    // to the layer count. Lets one model serve several independent batches.
+    void swapKVCaches(std::vector<KVCache>& caches);
+    
+    // Replace one layer's KV cache with saved state
+    void restoreKVCache(
+        int layer,
+        const mlx::core::array& keys,
+        const mlx::core::array& values,
+        int64_t tokens_seen,
+        int64_t evicted);
+    
+    // KV cache of one layer (the first by default); all layers hold the
+    // same positions
+    const KVCache& kvCache(int layer = 0) const;
+    
+    const ModelConfig& config() const;
+    
+    // Bytes currently held by the KV caches of all layers
+    size_t kvCacheBytes() const;
+    
+    // Bytes the same rows would hold without prefix/block sharing
+    size_t kvCacheIndependentBytes() const;
+    
+    // Upper bound on KV cache bytes for a session of max_tokens tokens
+    size_t estimateKVCacheBytes(int64_t batch_size, int64_t max_tokens) const;
+    
+    // Rough peak of the temporaries created by one forward step
+    size_t estimateActivationBytes(int64_t batch_size, int64_t seq_length, int64_t past_length) const;
 
 private:
     ModelConfig config_;
+    KVCacheOptions kv_options_;
     
     mlx::core::array token_embedding_;
     std::vector<std::unique_ptr<TransformerBlock>> layers_;
+    
+    // Layers this model runs; all of them unless loaded as a pipeline stage
+    int first_layer_ = 0;
+    int end_layer_ = 0;
+    
+    // [hidden, vocab], laid out once at load time. With tied embeddings this
+    // is the [vocab, hidden] embedding tensor itself, shared rather than copied.
     mlx::core::array lm_head_weight_;
+    bool tied_lm_head_ = false;
+    
     mlx::core::array final_ln_weight_;
     mlx::core::array final_ln_bias_;
+    
+    // Additive [batch, 1, seq, keys] mask (or [seq, keys] without padding)
+    // for seq_length new tokens; empty when no masking is needed
+    mlx::core::array attentionMask(
+        const mlx::core::array& padding_mask,
+        int64_t seq_length,
+        bool use_cache) const;
 };
 
 } // namespace mlx_transformer
\ No newline at end of file